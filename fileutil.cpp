@@ -5,12 +5,17 @@
 #include <string>
 #include <fstream>
 
+#include "fileutil.h"
+
 #ifdef _WIN32
 #include <windows.h>
 #else
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
 #endif
 
 std::string getHomeDir()
@@ -205,3 +210,78 @@ std::string stripComments(const std::string& text)
 	return out.str();
 }
 
+MappedFile::MappedFile()
+{
+#ifdef _WIN32
+	file = INVALID_HANDLE_VALUE;
+	mapping = NULL;
+#else
+	fd = -1;
+#endif
+	data = NULL;
+	size = 0;
+}
+MappedFile::~MappedFile()
+{
+	close();
+}
+bool MappedFile::open(const char* filename)
+{
+	close();
+#ifdef _WIN32
+	file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0)
+	{
+		close();
+		return false;
+	}
+	size = (size_t)fileSize.QuadPart;
+	mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (mapping)
+		data = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+#else
+	fd = ::open(filename, O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat info;
+	if (fstat(fd, &info) != 0 || info.st_size == 0)
+	{
+		close();
+		return false;
+	}
+	size = (size_t)info.st_size;
+	void* ptr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	if (ptr != MAP_FAILED)
+		data = (const char*)ptr;
+#endif
+	if (!data)
+	{
+		close();
+		return false;
+	}
+	return true;
+}
+void MappedFile::close()
+{
+#ifdef _WIN32
+	if (data)
+		UnmapViewOfFile(data);
+	if (mapping)
+		CloseHandle(mapping);
+	if (file != INVALID_HANDLE_VALUE)
+		CloseHandle(file);
+	file = INVALID_HANDLE_VALUE;
+	mapping = NULL;
+#else
+	if (data)
+		munmap((void*)data, size);
+	if (fd >= 0)
+		::close(fd);
+	fd = -1;
+#endif
+	data = NULL;
+	size = 0;
+}
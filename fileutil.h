@@ -17,4 +17,24 @@ bool readFile(std::string& str, const char* filename);
 bool readUncomment(std::istream& stream, std::string& line); //not thread safe! or fully tested
 std::string stripComments(const std::string& text); //wrapper for one-line readUncomment
 
+//read only view of a whole file, paged in by the OS as it's touched. data is NULL if not open
+class MappedFile
+{
+#ifdef _WIN32
+	void* file;
+	void* mapping;
+#else
+	int fd;
+#endif
+	MappedFile(const MappedFile& other) {}
+	MappedFile& operator=(const MappedFile& other) {return *this;}
+public:
+	const char* data;
+	size_t size;
+	MappedFile();
+	~MappedFile();
+	bool open(const char* filename);
+	void close();
+};
+
 #endif
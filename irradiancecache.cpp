@@ -0,0 +1,139 @@
+/* Copyright 2011 Pyarelal Knowles, under GNU LGPL (see LICENCE.txt) */
+
+#include "prec.h"
+
+#include "util.h"
+#include "irradiancecache.h"
+
+#include <math.h>
+
+IrradianceCache::Node::Node(const vec3f& c, float h) : centre(c), halfSize(h), records(NULL)
+{
+	for (int i = 0; i < 8; ++i)
+		children[i] = NULL;
+}
+
+IrradianceCache::IrradianceCache() : root(NULL), count(0)
+{
+}
+
+void IrradianceCache::clear()
+{
+	root = NULL;
+	count = 0;
+	nodes.clear();
+	records.clear();
+}
+
+IrradianceCache::Node* IrradianceCache::addNode(const vec3f& centre, float halfSize)
+{
+	nodes.emplace_back(centre, halfSize);
+	return &nodes.back();
+}
+
+int IrradianceCache::octant(const Node* node, const vec3f& pos)
+{
+	return (pos.x >= node->centre.x ? 1 : 0) | (pos.y >= node->centre.y ? 2 : 0) | (pos.z >= node->centre.z ? 4 : 0);
+}
+
+bool IrradianceCache::reaches(const Node* node, const vec3f& pos)
+{
+	//a record's region goes at most its node's halfSize past the node
+	vec3f d = pos - node->centre;
+	float reach = node->halfSize * 2.0f;
+	return myabs(d.x) <= reach && myabs(d.y) <= reach && myabs(d.z) <= reach;
+}
+
+bool IrradianceCache::lookup(const vec3f& pos, const vec3f& normal, float accuracy, vec3f& irradiance) const
+{
+	//weights fall to zero at the edge of each record's region (Tabellion and Lamorlette), so there are no seams
+	float totalWeight = 0.0f;
+	vec3f total(0.0f);
+	const Node* stack[512]; //loose regions overlap, so up to 8 nodes per level are visited
+	int top = 0;
+	const Node* start = root.load(std::memory_order_acquire);
+	if (start && reaches(start, pos))
+		stack[top++] = start;
+	while (top > 0)
+	{
+		const Node* node = stack[--top];
+		for (const Record* r = node->records.load(std::memory_order_acquire); r; r = r->next)
+		{
+			vec3f offset = pos - r->pos;
+			float error = offset.size() / r->radius + sqrt(mymax(0.0f, 1.0f - normal.dot(r->normal)));
+			if (error >= accuracy)
+				continue;
+
+			//a record in front of the point sees things the point can't
+			if (offset.dot(normal + r->normal) * 0.5f < -0.05f * r->radius)
+				continue;
+
+			float weight = 1.0f / mymax(error, 1e-4f) - 1.0f / accuracy;
+			vec3f turn = r->normal.cross(normal);
+			vec3f e;
+			for (int c = 0; c < 3; ++c)
+				e[c] = r->irradiance[c] + turn.dot(r->rotation[c]) + offset.dot(r->translation[c]);
+			total += vmax(e, vec3f(0.0f)) * weight;
+			totalWeight += weight;
+		}
+
+		for (int i = 0; i < 8 && top < 512; ++i)
+		{
+			const Node* child = node->children[i].load(std::memory_order_acquire);
+			if (child && reaches(child, pos))
+				stack[top++] = child;
+		}
+	}
+	if (totalWeight <= 0.0f)
+		return false;
+	irradiance = total / totalWeight;
+	return true;
+}
+
+void IrradianceCache::insert(const Record& record, float accuracy)
+{
+	//records go in the smallest node that contains their position and is at least as big as their region
+	float size = mymax(record.radius * accuracy, 1e-6f);
+	insertMutex.lock();
+	Node* node = root.load(std::memory_order_relaxed);
+	if (!node)
+		node = addNode(record.pos, size);
+
+	//grow upwards until the root holds the record, keeping the old root as a child
+	while (true)
+	{
+		vec3f d = record.pos - node->centre;
+		if (myabs(d.x) <= node->halfSize && myabs(d.y) <= node->halfSize && myabs(d.z) <= node->halfSize && node->halfSize >= size)
+			break;
+		vec3f centre = node->centre;
+		for (int k = 0; k < 3; ++k)
+			centre[k] += d[k] >= 0.0f ? node->halfSize : -node->halfSize;
+		Node* parent = addNode(centre, node->halfSize * 2.0f);
+		parent->children[octant(parent, node->centre)].store(node, std::memory_order_release);
+		node = parent;
+	}
+	root.store(node, std::memory_order_release);
+
+	for (int depth = 0; node->halfSize * 0.5f >= size && depth < 32; ++depth)
+	{
+		int i = octant(node, record.pos);
+		Node* child = node->children[i].load(std::memory_order_relaxed);
+		if (!child)
+		{
+			float h = node->halfSize * 0.5f;
+			vec3f centre = node->centre;
+			for (int k = 0; k < 3; ++k)
+				centre[k] += (i & (1 << k)) ? h : -h;
+			child = addNode(centre, h);
+			node->children[i].store(child, std::memory_order_release);
+		}
+		node = child;
+	}
+
+	records.push_back(record);
+	Record& added = records.back();
+	added.next = node->records.load(std::memory_order_relaxed);
+	node->records.store(&added, std::memory_order_release);
+	++count;
+	insertMutex.unlock();
+}
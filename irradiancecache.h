@@ -0,0 +1,53 @@
+/* Copyright 2011 Pyarelal Knowles, under GNU LGPL (see LICENCE.txt) */
+
+#ifndef PYARLIB_IRRADIANCECACHE_H
+#define PYARLIB_IRRADIANCECACHE_H
+
+#include "vec.h"
+#include "thread.h"
+
+#include <deque>
+#include <atomic>
+
+//sparse irradiance samples with gradients (Ward and Heckbert), interpolated between instead of sampling the
+//hemisphere at every point. records live in a loose octree that only grows: lookups take no lock and may run
+//while another thread inserts, so records can be added lazily as rendering finds gaps
+class IrradianceCache
+{
+public:
+	struct Record {
+		vec3f pos;
+		vec3f normal;
+		vec3f irradiance;
+		vec3f rotation[3]; //per channel gradient with respect to rotating the normal (by the axis-angle vector)
+		vec3f translation[3]; //per channel gradient with respect to moving along the surface
+		float radius; //harmonic mean distance to the surfaces seen from pos, clamped by the caller
+		const Record* next; //next record in the same node
+	};
+private:
+	struct Node {
+		vec3f centre;
+		float halfSize;
+		std::atomic<Node*> children[8];
+		std::atomic<const Record*> records; //each record's region of use is within the node grown by halfSize
+		Node(const vec3f& c, float h);
+	};
+	std::deque<Node> nodes; //elements never move, so readers can follow pointers while a writer appends
+	std::deque<Record> records;
+	std::atomic<Node*> root;
+	std::atomic<int> count;
+	Mutex insertMutex;
+	Node* addNode(const vec3f& centre, float halfSize);
+	static int octant(const Node* node, const vec3f& pos);
+	static bool reaches(const Node* node, const vec3f& pos); //pos may be within a region of the node's records
+public:
+	IrradianceCache();
+	void clear(); //not safe while other threads use the cache
+	int size() const {return count.load();}
+
+	//records are used up to accuracy * radius away, less for differing normals. smaller is slower and more accurate
+	bool lookup(const vec3f& pos, const vec3f& normal, float accuracy, vec3f& irradiance) const; //false if no record applies
+	void insert(const Record& record, float accuracy);
+};
+
+#endif
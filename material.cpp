@@ -179,6 +179,7 @@ void Material::init()
 	reflects = false;
 	transmits = false;
 	unlit = false;
+	opaque = false;
 }
 void Material::upload(bool freeLocal)
 {
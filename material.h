@@ -78,6 +78,7 @@ struct Material : BindableMaterial
 	bool reflects;
 	bool transmits;
 	bool unlit;
+	bool opaque; //fully blocks light, so shadow rays can stop at the first hit
 	
 	Material();
 	Material(std::string colourTexture);
@@ -0,0 +1,190 @@
+/* Copyright 2011 Pyarelal Knowles, under GNU LGPL (see LICENCE.txt) */
+
+#include "prec.h"
+
+#include "util.h"
+#include "photonmap.h"
+
+#include <algorithm>
+
+struct AxisCompare
+{
+	int axis;
+	AxisCompare(int a) : axis(a) {}
+	bool operator()(const PhotonMap::Node& a, const PhotonMap::Node& b) const
+	{
+		return (&a.pos.x)[axis] < (&b.pos.x)[axis];
+	}
+};
+
+struct NodeRange
+{
+	int a, b;
+	float distSq; //squared distance from the query to the range's side of the parent split
+	NodeRange() {}
+	NodeRange(int na, int nb, float d) : a(na), b(nb), distSq(d) {}
+};
+
+PhotonMap::PhotonMap()
+{
+	threadDepth = 0;
+}
+
+void PhotonMap::BuildThread::run()
+{
+	map->buildRange(a, b, depth);
+}
+
+float PhotonMap::buildRange(int a, int b, int depth)
+{
+	if (a >= b)
+		return 0.0f;
+
+	//split the widest axis at the median
+	vec3f bmin = nodes[a].pos;
+	vec3f bmax = nodes[a].pos;
+	for (int i = a + 1; i < b; ++i)
+	{
+		bmin = vmin(bmin, nodes[i].pos);
+		bmax = vmax(bmax, nodes[i].pos);
+	}
+	vec3f size = bmax - bmin;
+	int axis = (size.x > size.y && size.x > size.z) ? 0 : (size.y > size.z ? 1 : 2);
+	int m = (a + b) / 2;
+	std::nth_element(nodes.begin() + a, nodes.begin() + m, nodes.begin() + b, AxisCompare(axis));
+	nodes[m].data = (nodes[m].data & ~3u) | axis;
+
+	//subtrees don't share nodes, so the left one can be built on another thread
+	float left, right;
+	if (depth < threadDepth && m - a > 1024)
+	{
+		BuildThread thread;
+		thread.map = this;
+		thread.a = a;
+		thread.b = m;
+		thread.depth = depth + 1;
+		thread.start();
+		right = buildRange(m + 1, b, depth + 1);
+		thread.wait();
+		left = a < m ? nodes[(a + m) / 2].reach : 0.0f;
+	}
+	else
+	{
+		left = buildRange(a, m, depth + 1);
+		right = buildRange(m + 1, b, depth + 1);
+	}
+	nodes[m].reach = mymax(nodes[m].radius, mymax(left, right));
+	return nodes[m].reach;
+}
+
+void PhotonMap::build(const std::vector<vec3f>& points, const std::vector<float>& radii, int nthreads)
+{
+	assert(points.size() == radii.size());
+	nodes.resize(points.size());
+	for (int i = 0; i < (int)points.size(); ++i)
+	{
+		nodes[i].pos = points[i];
+		nodes[i].radius = radii[i];
+		nodes[i].reach = radii[i];
+		nodes[i].data = (uint32_t)i << 2;
+	}
+
+	threadDepth = ceilLog2(mymax(1, nthreads));
+	buildRange(0, (int)nodes.size(), 0);
+}
+
+void PhotonMap::clear()
+{
+	nodes.clear();
+}
+
+void PhotonMap::gather(const vec3f& pos, float radius, std::vector<int>& results) const
+{
+	results.clear();
+	float radiusSq = radius * radius;
+	NodeRange stack[64];
+	int top = 0;
+	stack[top++] = NodeRange(0, (int)nodes.size(), 0.0f);
+	while (top > 0)
+	{
+		NodeRange r = stack[--top];
+		if (r.a >= r.b)
+			continue;
+		int m = (r.a + r.b) / 2;
+		const Node& node = nodes[m];
+		if ((node.pos - pos).sizesq() <= radiusSq)
+			results.push_back(node.id());
+
+		float d = (&pos.x)[node.axis()] - (&node.pos.x)[node.axis()];
+		if (d * d <= radiusSq)
+			stack[top++] = d < 0.0f ? NodeRange(m + 1, r.b, 0.0f) : NodeRange(r.a, m, 0.0f);
+		stack[top++] = d < 0.0f ? NodeRange(r.a, m, 0.0f) : NodeRange(m + 1, r.b, 0.0f);
+	}
+}
+
+void PhotonMap::nearest(const vec3f& pos, int k, float maxRadius, std::vector<Neighbour>& results) const
+{
+	//results is a max-heap, so the furthest of the k found so far is at the front
+	results.clear();
+	if (k <= 0)
+		return;
+	float boundSq = maxRadius * maxRadius;
+	NodeRange stack[64];
+	int top = 0;
+	stack[top++] = NodeRange(0, (int)nodes.size(), 0.0f);
+	while (top > 0)
+	{
+		NodeRange r = stack[--top];
+		if (r.a >= r.b || r.distSq > boundSq)
+			continue;
+		int m = (r.a + r.b) / 2;
+		const Node& node = nodes[m];
+		float distSq = (node.pos - pos).sizesq();
+		if (distSq <= boundSq)
+		{
+			Neighbour n;
+			n.id = node.id();
+			n.distSq = distSq;
+			if ((int)results.size() == k)
+			{
+				std::pop_heap(results.begin(), results.end());
+				results.back() = n;
+			}
+			else
+				results.push_back(n);
+			std::push_heap(results.begin(), results.end());
+			if ((int)results.size() == k)
+				boundSq = results.front().distSq;
+		}
+
+		//visit the near side first, so the bound shrinks before the far side is reached
+		float d = (&pos.x)[node.axis()] - (&node.pos.x)[node.axis()];
+		stack[top++] = d < 0.0f ? NodeRange(m + 1, r.b, d * d) : NodeRange(r.a, m, d * d);
+		stack[top++] = d < 0.0f ? NodeRange(r.a, m, 0.0f) : NodeRange(m + 1, r.b, 0.0f);
+	}
+}
+
+void PhotonMap::covers(const vec3f& pos, std::vector<int>& results) const
+{
+	//like gather(), but each point has its own radius. subtrees are skipped using their reach
+	results.clear();
+	NodeRange stack[64];
+	int top = 0;
+	stack[top++] = NodeRange(0, (int)nodes.size(), 0.0f);
+	while (top > 0)
+	{
+		NodeRange r = stack[--top];
+		if (r.a >= r.b)
+			continue;
+		int m = (r.a + r.b) / 2;
+		const Node& node = nodes[m];
+		if (r.distSq > node.reach * node.reach)
+			continue;
+		if ((node.pos - pos).sizesq() <= node.radius * node.radius)
+			results.push_back(node.id());
+
+		float d = (&pos.x)[node.axis()] - (&node.pos.x)[node.axis()];
+		stack[top++] = d < 0.0f ? NodeRange(m + 1, r.b, d * d) : NodeRange(r.a, m, d * d);
+		stack[top++] = d < 0.0f ? NodeRange(r.a, m, 0.0f) : NodeRange(m + 1, r.b, 0.0f);
+	}
+}
@@ -0,0 +1,50 @@
+/* Copyright 2011 Pyarelal Knowles, under GNU LGPL (see LICENCE.txt) */
+
+#ifndef PYARLIB_PHOTONMAP_H
+#define PYARLIB_PHOTONMAP_H
+
+#include "vec.h"
+#include "thread.h"
+
+#include <vector>
+#include <stdint.h>
+
+//balanced KD tree of points, built in one pass and stored flat. the tree over nodes [a, b) has its
+//root at the median (a+b)/2, so children are implicit and there are no pointers to chase.
+//queries write into caller-provided vectors, which keep their capacity between calls
+class PhotonMap
+{
+public:
+	struct Node {
+		vec3f pos;
+		float radius; //footprint of the point, for covers()
+		float reach; //largest radius in the subtree rooted here
+		uint32_t data; //axis (0-2) in the low 2 bits, id given to build() in the rest
+		int axis() const {return data & 3;}
+		int id() const {return (int)(data >> 2);}
+	};
+	struct Neighbour {
+		int id;
+		float distSq;
+		bool operator<(const Neighbour& other) const {return distSq < other.distSq;} //max-heap on distance
+	};
+private:
+	struct BuildThread : Thread {
+		PhotonMap* map;
+		int a, b, depth;
+		virtual void run();
+	};
+	std::vector<Node> nodes;
+	int threadDepth; //build() splits subtrees onto new threads above this depth
+	float buildRange(int a, int b, int depth); //returns the subtree's reach
+public:
+	PhotonMap();
+	void build(const std::vector<vec3f>& points, const std::vector<float>& radii, int nthreads = 1); //ids are indices into points
+	void clear();
+	int size() const {return (int)nodes.size();}
+	void gather(const vec3f& pos, float radius, std::vector<int>& results) const; //points within radius of pos
+	void nearest(const vec3f& pos, int k, float maxRadius, std::vector<Neighbour>& results) const; //up to k closest points within maxRadius, unsorted
+	void covers(const vec3f& pos, std::vector<int>& results) const; //points whose own radius reaches pos
+};
+
+#endif
@@ -39,6 +39,7 @@
 #include "profile.h"
 #include "quaternion.h"
 #include "quickgui.h"
+#include "random.h"
 #include "shaderbuild.h"
 #include "shader.h"
 #include "shaderutil.h"
@@ -5,6 +5,7 @@
 #include <stdio.h>
 
 #include "quaternion.h"
+#include "random.h"
 
 const float quatTolerance = 0.00001f;
 
@@ -523,11 +524,16 @@ Quat Quat::dirUp(const vec3f& dir, const vec3f& up)
 	return Quat(m);
 }
 Quat Quat::random()
+{
+	RandomStream random(rand());
+	return Quat::random(random);
+}
+Quat Quat::random(RandomStream& random)
 {
 	//http://jmonkeyengine.org/forum/topic/random-rotation/
-	float u1 = rand()/(float)RAND_MAX;
-	float u2 = rand()/(float)RAND_MAX;
-	float u3 = rand()/(float)RAND_MAX;
+	float u1 = random.unit();
+	float u2 = random.unit();
+	float u3 = random.unit();
 	float u1sqrt = sqrt(u1);
 	float u1m1sqrt = sqrt(1.0f - u1);
 	float x = u1m1sqrt * sin(2*pi*u2);
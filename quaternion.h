@@ -7,6 +7,8 @@
 #include "vec.h"
 #include "matrix.h"
 
+class RandomStream;
+
 struct Quat {
 	union {
 		struct {
@@ -59,7 +61,8 @@ struct Quat {
 	static Quat fromEuler(const vec3f& angles);
 	static Quat fromTo(const vec3f& from, const vec3f& to);
 	static Quat dirUp(const vec3f& dir, const vec3f& up = vec3f(0, 1, 0));
-	static Quat random();
+	static Quat random(); //uses rand()
+	static Quat random(RandomStream& random);
 };
 
 Quat operator-(const Quat& q);
@@ -0,0 +1,51 @@
+/* Copyright 2011 Pyarelal Knowles, under GNU LGPL (see LICENCE.txt) */
+
+
+#ifndef PYARLIB_RANDOM_H
+#define PYARLIB_RANDOM_H
+
+#include <stdint.h>
+
+//pcg32 (http://www.pcg-random.org). unlike rand() there's no global state or lock, so each thread can own
+//a stream. seeding from whatever identifies the work (pixel, sample, frame) gives the same numbers no
+//matter which thread ends up doing it
+class RandomStream
+{
+	uint64_t state;
+	uint64_t inc;
+	static uint64_t mix(uint64_t x)
+	{
+		//splitmix64 finalizer, so neighbouring seeds don't start out correlated
+		x ^= x >> 30;
+		x *= 0xbf58476d1ce4e5b9ULL;
+		x ^= x >> 27;
+		x *= 0x94d049bb133111ebULL;
+		return x ^ (x >> 31);
+	}
+public:
+	RandomStream(uint64_t seed = 0, uint64_t stream = 0) {this->seed(seed, stream);}
+	void seed(uint64_t seed, uint64_t stream = 0)
+	{
+		state = 0;
+		inc = (stream << 1) | 1;
+		next();
+		state += mix(seed);
+		next();
+	}
+	void seed(uint32_t a, uint32_t b, uint32_t c)
+	{
+		seed(((uint64_t)b << 32) | c, a);
+	}
+	uint32_t next()
+	{
+		uint64_t old = state;
+		state = old * 6364136223846793005ULL + inc;
+		uint32_t shifted = (uint32_t)(((old >> 18) ^ old) >> 27);
+		uint32_t rot = (uint32_t)(old >> 59);
+		return (shifted >> rot) | (shifted << ((-rot) & 31));
+	}
+	float unit() {return (next() >> 8) * (1.0f / 16777216.0f);} //[0, 1)
+	int range(int n) {return (int)(((uint64_t)next() * (uint64_t)n) >> 32);} //[0, n)
+};
+
+#endif
@@ -0,0 +1,299 @@
+/* Copyright 2011 Pyarelal Knowles, under GNU LGPL (see LICENCE.txt) */
+
+#include "prec.h"
+
+#include "util.h"
+#include "socket.h"
+
+#ifdef _WIN32
+//windows.h has already brought in the winsock 1.1 API, which is all that's used here
+#pragma comment(lib, "ws2_32.lib")
+typedef int socklen_t;
+#define INVALID_SOCK INVALID_SOCKET
+#define closeSocket closesocket
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#define INVALID_SOCK -1
+#define closeSocket ::close
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#define NO_MSG_NOSIGNAL //send() to a lost connection raises SIGPIPE unless the socket or process says otherwise
+#endif
+
+static bool startSockets()
+{
+#ifdef _WIN32
+	static bool started = false;
+	if (!started)
+	{
+		WSADATA data;
+		started = WSAStartup(MAKEWORD(1, 1), &data) == 0;
+	}
+	return started;
+#else
+#if defined(NO_MSG_NOSIGNAL) && !defined(SO_NOSIGPIPE)
+	//no per-call or per-socket way to stop SIGPIPE killing the process, so ignore it
+	signal(SIGPIPE, SIG_IGN);
+#endif
+	return true;
+#endif
+}
+
+//fills addr from "host:port", where an empty host is any interface when listening and localhost otherwise
+static bool tcpAddress(const std::string& address, bool listening, sockaddr_in& addr)
+{
+	size_t colon = address.rfind(':');
+	if (colon == std::string::npos)
+	{
+		printf("Error: socket address %s has no port\n", address.c_str());
+		return false;
+	}
+	std::string host = address.substr(0, colon);
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons((unsigned short)atoi(address.c_str() + colon + 1));
+	if (host.size() == 0)
+		addr.sin_addr.s_addr = htonl(listening ? INADDR_ANY : INADDR_LOOPBACK);
+	else
+	{
+		hostent* entry = gethostbyname(host.c_str());
+		if (!entry || entry->h_addrtype != AF_INET)
+		{
+			printf("Error: could not resolve %s\n", host.c_str());
+			return false;
+		}
+		memcpy(&addr.sin_addr, entry->h_addr_list[0], sizeof(addr.sin_addr));
+	}
+	return true;
+}
+
+static bool isUnixAddress(const std::string& address)
+{
+	return address.compare(0, 5, "unix:") == 0;
+}
+
+#ifndef _WIN32
+static bool unixAddress(const std::string& address, sockaddr_un& addr)
+{
+	std::string path = address.substr(5);
+	if (path.size() == 0 || path.size() >= sizeof(addr.sun_path))
+	{
+		printf("Error: bad unix socket path %s\n", path.c_str());
+		return false;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path.c_str());
+	return true;
+}
+#endif
+
+Socket::Socket()
+{
+	sock = INVALID_SOCK;
+}
+Socket::~Socket()
+{
+	close();
+}
+bool Socket::listen(const std::string& address)
+{
+	close();
+	if (!startSockets())
+		return false;
+	if (isUnixAddress(address))
+	{
+#ifdef _WIN32
+		printf("Error: unix sockets are not supported here, %s\n", address.c_str());
+		return false;
+#else
+		sockaddr_un addr;
+		if (!unixAddress(address, addr))
+			return false;
+		unlink(addr.sun_path); //left behind by a listener that didn't close
+		sock = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (sock == INVALID_SOCK || bind(sock, (sockaddr*)&addr, sizeof(addr)) != 0)
+		{
+			printf("Error: could not bind %s\n", address.c_str());
+			close();
+			return false;
+		}
+		unlinkPath = addr.sun_path;
+#endif
+	}
+	else
+	{
+		sockaddr_in addr;
+		if (!tcpAddress(address, true, addr))
+			return false;
+		sock = socket(AF_INET, SOCK_STREAM, 0);
+		int reuse = 1;
+		if (sock != INVALID_SOCK)
+			setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse));
+		if (sock == INVALID_SOCK || bind(sock, (sockaddr*)&addr, sizeof(addr)) != 0)
+		{
+			printf("Error: could not bind %s\n", address.c_str());
+			close();
+			return false;
+		}
+	}
+	if (::listen(sock, 64) != 0)
+	{
+		printf("Error: could not listen on %s\n", address.c_str());
+		close();
+		return false;
+	}
+	return true;
+}
+bool Socket::accept(Socket& client)
+{
+	client.close();
+	if (!isOpen())
+		return false;
+	client.sock = ::accept(sock, NULL, NULL);
+	if (client.sock == INVALID_SOCK)
+		return false;
+	int noDelay = 1; //fails harmlessly for unix sockets
+	setsockopt(client.sock, IPPROTO_TCP, TCP_NODELAY, (const char*)&noDelay, sizeof(noDelay));
+#ifdef SO_NOSIGPIPE
+	int noSignal = 1; //no MSG_NOSIGNAL on macOS. this makes send() to a lost connection fail with EPIPE instead
+	setsockopt(client.sock, SOL_SOCKET, SO_NOSIGPIPE, (const char*)&noSignal, sizeof(noSignal));
+#endif
+	return true;
+}
+bool Socket::connect(const std::string& address)
+{
+	close();
+	if (!startSockets())
+		return false;
+	int result;
+	if (isUnixAddress(address))
+	{
+#ifdef _WIN32
+		printf("Error: unix sockets are not supported here, %s\n", address.c_str());
+		return false;
+#else
+		sockaddr_un addr;
+		if (!unixAddress(address, addr))
+			return false;
+		sock = socket(AF_UNIX, SOCK_STREAM, 0);
+		result = sock == INVALID_SOCK ? -1 : ::connect(sock, (sockaddr*)&addr, sizeof(addr));
+#endif
+	}
+	else
+	{
+		sockaddr_in addr;
+		if (!tcpAddress(address, false, addr))
+			return false;
+		sock = socket(AF_INET, SOCK_STREAM, 0);
+		result = sock == INVALID_SOCK ? -1 : ::connect(sock, (sockaddr*)&addr, sizeof(addr));
+		int noDelay = 1;
+		if (result == 0)
+			setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (const char*)&noDelay, sizeof(noDelay));
+	}
+	if (result != 0)
+	{
+		close();
+		return false;
+	}
+#ifdef SO_NOSIGPIPE
+	int noSignal = 1;
+	setsockopt(sock, SOL_SOCKET, SO_NOSIGPIPE, (const char*)&noSignal, sizeof(noSignal));
+#endif
+	return true;
+}
+bool Socket::send(const void* data, int size)
+{
+	const char* p = (const char*)data;
+	while (size > 0 && isOpen())
+	{
+		int sent = ::send(sock, p, size, MSG_NOSIGNAL);
+		if (sent <= 0)
+			return false;
+		p += sent;
+		size -= sent;
+	}
+	return size == 0;
+}
+bool Socket::recv(void* data, int size)
+{
+	char* p = (char*)data;
+	while (size > 0 && isOpen())
+	{
+		int got = ::recv(sock, p, size, 0);
+		if (got <= 0)
+			return false;
+		p += got;
+		size -= got;
+	}
+	return size == 0;
+}
+bool Socket::setTimeout(float seconds)
+{
+	if (!isOpen())
+		return false;
+#ifdef _WIN32
+	DWORD limit = (DWORD)(seconds * 1000.0f);
+#else
+	timeval limit;
+	limit.tv_sec = (long)seconds;
+	limit.tv_usec = (long)((seconds - (long)seconds) * 1000000.0f);
+#endif
+	return setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&limit, sizeof(limit)) == 0 &&
+		setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, (const char*)&limit, sizeof(limit)) == 0;
+}
+void Socket::close()
+{
+	if (isOpen())
+		closeSocket(sock);
+	sock = INVALID_SOCK;
+#ifndef _WIN32
+	if (unlinkPath.size())
+		unlink(unlinkPath.c_str());
+#endif
+	unlinkPath.clear();
+}
+bool Socket::isOpen() const
+{
+	return sock != INVALID_SOCK;
+}
+int Socket::poll(const std::vector<Socket*>& sockets, std::vector<bool>& readable, float seconds)
+{
+	fd_set set;
+	FD_ZERO(&set);
+	int maxSock = 0;
+	int count = (int)sockets.size();
+	readable.assign(count, false);
+	for (int i = 0; i < count; ++i)
+	{
+		if (!sockets[i]->isOpen())
+			continue;
+		FD_SET(sockets[i]->sock, &set);
+		maxSock = mymax(maxSock, (int)sockets[i]->sock);
+	}
+	timeval limit;
+	limit.tv_sec = (long)seconds;
+	limit.tv_usec = (long)((seconds - (long)seconds) * 1000000.0f);
+	int ready = select(maxSock + 1, &set, NULL, NULL, seconds < 0.0f ? NULL : &limit);
+#ifndef _WIN32
+	if (ready < 0 && errno == EINTR)
+		return 0; //a signal arrived, which isn't an error. the caller just polls again
+#endif
+	if (ready <= 0)
+		return ready;
+	for (int i = 0; i < count; ++i)
+		readable[i] = sockets[i]->isOpen() && FD_ISSET(sockets[i]->sock, &set);
+	return ready;
+}
@@ -0,0 +1,42 @@
+/* Copyright 2011 Pyarelal Knowles, under GNU LGPL (see LICENCE.txt) */
+
+
+#ifndef PYARLIB_SOCKET_H
+#define PYARLIB_SOCKET_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+//blocking stream sockets. addresses are "unix:<path>" for a unix domain socket or "<host>:<port>" for TCP.
+//listening on ":<port>" accepts connections on every interface
+class Socket
+{
+private:
+	//no copying!
+	Socket(const Socket& other) {}
+	Socket& operator=(const Socket& other) {return *this;}
+#ifdef _WIN32
+	uintptr_t sock; //SOCKET, without pulling winsock into every header
+#else
+	int sock;
+#endif
+	std::string unlinkPath; //unix socket file made by listen(), removed by close()
+public:
+	Socket();
+	~Socket();
+	bool listen(const std::string& address);
+	bool accept(Socket& client); //blocks until a connection arrives
+	bool connect(const std::string& address);
+	bool send(const void* data, int size); //all of data. false if the connection is lost
+	bool recv(void* data, int size); //exactly size bytes. false if the connection is lost or closed by the other end
+	bool setTimeout(float seconds); //send() and recv() fail once the other end makes no progress for this long. 0 for no limit
+	void close();
+	bool isOpen() const;
+
+	//waits until some of the sockets can be read or accepted without blocking, up to seconds (negative for no limit).
+	//closed sockets are skipped. returns how many are ready, 0 on timeout or a signal, or -1 on error
+	static int poll(const std::vector<Socket*>& sockets, std::vector<bool>& readable, float seconds);
+};
+
+#endif
@@ -104,6 +104,7 @@ Thread::Thread()
 {
 	bWaiting = false;
 	bRunning = false;
+	bJoinable = false;
 #ifdef _WIN32
 	thread = 0;
 #endif
@@ -126,7 +127,9 @@ void* Thread::starter(void* instance)
 void Thread::start()
 {
 	if (running()) return; //can't start multiple times!
+	wait(); //clean up the last run if it finished without being waited on
 	bRunning = true;
+	bJoinable = true;
 	
 #ifdef _WIN32
 	if (thread > 0)
@@ -146,7 +149,7 @@ void Thread::start()
 }
 void Thread::wait()
 {
-	if (!running()) return; //haven't start()ed thread yet
+	if (!bJoinable) return; //haven't start()ed thread yet. may have finished running but still needs joining
 	
 	bWaiting = true;
 #ifdef _WIN32
@@ -162,6 +165,7 @@ void Thread::wait()
 #else
 	pthread_join(thread, NULL);
 #endif
+	bJoinable = false;
 	bWaiting = false;
 }
 void Thread::create(void (*func)(void))
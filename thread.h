@@ -72,6 +72,7 @@ private:
 #endif
 	bool bWaiting;
 	bool bRunning;
+	bool bJoinable; //started and not yet waited on, even if run() has returned
 	static void* starter(void* instance);
 public:
 	Thread();
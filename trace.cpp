@@ -6,14 +6,32 @@
 #include "trace.h"
 #include "camera.h"
 #include "img.h"
-#include "rtree.h"
 #include "imgpng.h"
 #include "quaternion.h"
 
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define TRACE_SIMD 1
+#include <xmmintrin.h>
+#else
+#define TRACE_SIMD 0
+#endif
+
 using namespace std;
 
 #define GLOBAL_TRACE_DEBUG 0
 
+//BVH traversal stacks are fixed size. each level pushes two nodes and pops one, so trees must stay shallower
+#define BVH_MAX_DEPTH 64
+
+//random streams are seeded with (stream, sample, frame). camera rays use (image pixel, sample) and baking (texel, 0),
+//with samples counting up from 0, so other work takes sample indices from the top, which those never reach
+static const uint32_t samplePhoton = 0xFFFFFFFFu; //stream is the photon index
+static const uint32_t sampleIrradiance = 0xFFFFFFFEu; //stream is the image pixel of an irradiance pre-pass point
+static const uint32_t sampleLight = 0xFFFFFFFDu; //stream is the light index, for the light's sample pattern
+static const uint32_t sampleEmitSphere = 0xFFFFFFF0u; //patterns shared by every pixel, from stream 0
+static const uint32_t samplePatterns = 0xFFFFFFF1u;
+static const uint32_t sampleOcclusion = 0xFFFFFFF2u;
+
 bool TraceScene::SAHEvent::operator<(const SAHEvent& other) const
 {
 	if (pos < other.pos) return true;
@@ -28,7 +46,14 @@ bool TraceScene::SAHEvent::operator<(const SAHEvent& other) const
 TraceScene::TraceScene()
 {
 	cullBackface = false;
-	totalJobs = 0;
+	accel = ACCEL_KDTREE;
+	buildStats = BuildStats();
+	tree = NULL;
+	treeNodes = 0;
+	blockData = NULL;
+	totalPixels = 0;
+	pixelsComplete = 0;
+	renderInfo.initializingThreads = false;
 	background = vec4f(0.0f);
 	defaultMaterial = new Material();
 	defaultMaterial->colour = vec4f(0.6, 0.6, 0.6, 1.0f);
@@ -39,9 +64,49 @@ TraceScene::TraceScene()
 	shootPhotons = false;
 	photons.emit = 0;
 	gloss.samples = 12;
+	tiling.size = 16;
+	tiling.order = TILE_ORDER_HILBERT;
+	progressive.enabled = false;
+	progressive.threshold = 1.0f / 255.0f;
+	progressive.minPasses = 4;
+	progressive.maxPasses = 64;
+	progressive.maxTime = 0.0f;
+	progressive.passes = 0;
+	preview.enabled = false;
+	preview.levels = 3;
+	preview.frameTime = 0.0f;
+	distributed.tilesPerThread = 4;
+	distributed.timeout = 0.0f;
+	renderId = 0;
+	lightsBuilt = 0;
+	wavefront.enabled = false;
+	lightSampling.minLights = 8;
+	lightSampling.samples = 4;
+	wavefront.maxRays = 16384;
+	irradiance.enabled = false;
+	irradiance.accuracy = 0.25f;
+	irradiance.minRadius = 0.1f;
+	irradiance.maxRadius = 4.0f;
+	irradiance.prepass = 8;
+	toneMapping.op = TONE_CLAMP;
+	toneMapping.exposure = 1.0f;
+	toneMapping.gamma = 1.0f;
+	resume = false;
+	baking.occlusionSamples = 64;
+	baking.occlusionDistance = 1.0f;
+	baking.padding = 2;
+	renderInfo.cancelled = false;
+	renderInfo.pass = 0;
+	renderInfo.previewBlock = 1;
+	renderInfo.finished = false;
 	traversalCost = 16.0f;
 	intersectCost = 1.0f;
-	photonTree = NULL;
+	buildThreads = 4;
+	packetTracing = true;
+	frame = 0;
+	photonCount = 0;
+	sampled = 0;
+	debug = false;
 	debugMesh = NULL;
 	debugMeshTrace = NULL;
 	debugMeshTrace2 = NULL;
@@ -57,8 +122,11 @@ TraceScene::TraceScene()
 TraceScene::~TraceScene()
 {
 	delete defaultMaterial;
-	delete photonTree;
 	cancel();
+	for (int i = 0; i < (int)workers.size(); ++i)
+		delete workers[i];
+	for (int i = 0; i < (int)connecting.size(); ++i)
+		delete connecting[i];
 }
 TraceScene::Vertex TraceScene::interpolateVertex(int a, int b, int c, float s, float t)
 {
@@ -308,6 +376,81 @@ bool TraceScene::intersectRayTriangle(const Ray& ray, const Triangle& triangle,
 	return false;
 }
 
+#if TRACE_SIMD
+static inline __m128 dot4(const __m128 (&a)[3], const __m128 (&b)[3])
+{
+	return _mm_add_ps(_mm_add_ps(_mm_mul_ps(a[0], b[0]), _mm_mul_ps(a[1], b[1])), _mm_mul_ps(a[2], b[2]));
+}
+
+//4 ray/triangle pairs. rays or triangles may be the same in every lane
+static inline int intersect4(const __m128 (&start)[3], const __m128 (&dir)[3], const __m128 (&a)[3], const __m128 (&n)[3], const __m128 (&bs)[3], const __m128 (&bt)[3], __m128 tmin, __m128 tmax, bool cullBackface, __m128& time, __m128& s, __m128& t, __m128& d_ndir)
+{
+	__m128 w[3];
+	for (int k = 0; k < 3; ++k)
+		w[k] = _mm_sub_ps(a[k], start[k]);
+	d_ndir = dot4(n, dir);
+	time = _mm_div_ps(dot4(n, w), d_ndir);
+	
+	//w = hit point - a
+	for (int k = 0; k < 3; ++k)
+		w[k] = _mm_sub_ps(_mm_mul_ps(dir[k], time), w[k]);
+	s = dot4(w, bs);
+	t = dot4(w, bt);
+	
+	__m128 zero = _mm_setzero_ps();
+	__m128 hit = cullBackface ? _mm_cmplt_ps(d_ndir, zero) : _mm_cmpneq_ps(d_ndir, zero);
+	hit = _mm_and_ps(hit, _mm_and_ps(_mm_cmpge_ps(s, zero), _mm_cmpge_ps(t, zero)));
+	hit = _mm_and_ps(hit, _mm_cmple_ps(_mm_add_ps(s, t), _mm_set1_ps(1.0f)));
+	hit = _mm_and_ps(hit, _mm_and_ps(_mm_cmpgt_ps(time, tmin), _mm_cmple_ps(time, tmax)));
+	return _mm_movemask_ps(hit);
+}
+#endif
+
+int TraceScene::intersectBlock(const TriangleBlock& block, const Ray& ray, float tmin, float tmax, float (&time)[4], float (&s)[4], float (&t)[4], int& backface)
+{
+	//time from the triangle's plane, as in intersectRayTriangle, so rays leaving a surface don't
+	//hit coplanar neighbours. barycentrics are dot products with the precomputed bs/bt
+#if TRACE_SIMD
+	__m128 start[3], dir[3], a[3], n[3], bs[3], bt[3];
+	for (int k = 0; k < 3; ++k)
+	{
+		start[k] = _mm_set1_ps(ray.start[k]);
+		dir[k] = _mm_set1_ps(ray.dir[k]);
+		a[k] = _mm_loadu_ps(block.a[k]);
+		n[k] = _mm_loadu_ps(block.n[k]);
+		bs[k] = _mm_loadu_ps(block.bs[k]);
+		bt[k] = _mm_loadu_ps(block.bt[k]);
+	}
+	__m128 time4, s4, t4, d_ndir;
+	int mask = intersect4(start, dir, a, n, bs, bt, _mm_set1_ps(tmin), _mm_set1_ps(tmax), cullBackface, time4, s4, t4, d_ndir);
+	_mm_storeu_ps(time, time4);
+	_mm_storeu_ps(s, s4);
+	_mm_storeu_ps(t, t4);
+	backface = _mm_movemask_ps(_mm_cmpge_ps(d_ndir, _mm_setzero_ps()));
+	return mask;
+#else
+	int mask = 0;
+	backface = 0;
+	for (int j = 0; j < block.count; ++j)
+	{
+		vec3f a(block.a[0][j], block.a[1][j], block.a[2][j]);
+		vec3f n(block.n[0][j], block.n[1][j], block.n[2][j]);
+		float d_ndir = n.dot(ray.dir);
+		if (d_ndir == 0.0f || (cullBackface && d_ndir >= 0.0f))
+			continue;
+		time[j] = n.dot(a - ray.start) / d_ndir;
+		vec3f w = ray.start + ray.dir * time[j] - a;
+		s[j] = w.dot(vec3f(block.bs[0][j], block.bs[1][j], block.bs[2][j]));
+		t[j] = w.dot(vec3f(block.bt[0][j], block.bt[1][j], block.bt[2][j]));
+		if (s[j] >= 0.0f && t[j] >= 0.0f && s[j] + t[j] <= 1.0f && time[j] > tmin && time[j] <= tmax)
+			mask |= 1 << j;
+		if (d_ndir >= 0.0f)
+			backface |= 1 << j;
+	}
+	return mask;
+#endif
+}
+
 TraceScene::Bounds TraceScene::intersectVoxel(const Bounds& a, const Bounds& b)
 {
 	Bounds ret;
@@ -452,7 +595,15 @@ void TraceScene::addEvents(std::vector<SAHEvent>& E, const SAHTriangle& t)
 	}
 }
 	
-void TraceScene::findSplit(Bounds voxel, std::vector<SAHEvent>& E, int totalTriangles, SAHSplit& bestSplit)
+bool TraceScene::SAHSplit::operator<(const SAHSplit& other) const
+{
+	//ties go to the split a sweep over the sorted events finds first, so per-axis sweeps agree with findSplit(axis = -1)
+	if (cost != other.cost) return cost < other.cost;
+	if (pos != other.pos) return pos < other.pos;
+	return axis < other.axis;
+}
+
+void TraceScene::findSplit(Bounds voxel, const std::vector<SAHEvent>& E, int totalTriangles, SAHSplit& bestSplit, int axis)
 {
 	#if GLOBAL_TRACE_DEBUG
 	for (int i  = 0; i < (int)E.size(); ++i)
@@ -473,6 +624,11 @@ void TraceScene::findSplit(Bounds voxel, std::vector<SAHEvent>& E, int totalTria
 	{
 		const SAHEvent& p = E[i];
 		const int& k = p.axis;
+		if (axis >= 0 && k != axis)
+		{
+			++i;
+			continue;
+		}
 		
 		int Estart(0), Eplane(0), Eend(0);
 		while (i < En && p.pos == E[i].pos && p.axis == E[i].axis && E[i].type == SAHEvent::END)
@@ -514,11 +670,41 @@ void TraceScene::findSplit(Bounds voxel, std::vector<SAHEvent>& E, int totalTria
 	#endif
 }
 
-void TraceScene::doSplit(SAHSplit split, const std::vector<SAHTriangle>& T, const std::vector<SAHEvent>& E, std::vector<SAHTriangle>& Tl, std::vector<SAHEvent>& El, std::vector<SAHTriangle>& Tr, std::vector<SAHEvent>& Er)
+void TraceScene::SplitThread::run()
 {
+	scene->findSplit(voxel, *events, totalTriangles, split, axis);
+}
+
+void TraceScene::findSplitParallel(Bounds voxel, const std::vector<SAHEvent>& E, int totalTriangles, SAHSplit& bestSplit)
+{
+	//sweep y and z on other threads. each sweep reads the whole list but only counts its own axis
+	SplitThread threads[2];
+	for (int k = 0; k < 2; ++k)
+	{
+		threads[k].scene = this;
+		threads[k].voxel = voxel;
+		threads[k].events = &E;
+		threads[k].totalTriangles = totalTriangles;
+		threads[k].axis = k + 1;
+		threads[k].start();
+	}
+	findSplit(voxel, E, totalTriangles, bestSplit, 0);
+	for (int k = 0; k < 2; ++k)
+	{
+		threads[k].wait();
+		if (threads[k].split < bestSplit)
+			bestSplit = threads[k].split;
+	}
+}
+
+void TraceScene::doSplit(KDBuild& out, SAHSplit split, const std::vector<SAHTriangle>& T, const std::vector<SAHEvent>& E, KDLevel& children)
+{
+	//linear time split as in Wald and Havran, "On building fast kd-Trees for Ray Tracing, and on doing that in O(N log N)"
+	std::vector<uchar>& side = out.side;
+	
 	//classify triangles
 	for (int i = 0; i < (int)T.size(); ++i)
-		triangleData[T[i].triangle].side = SAHTriangle::BOTH;
+		side[T[i].triangle] = SAHTriangle::BOTH;
 	
 	for (int i = 0; i < (int)E.size(); ++i)
 	{
@@ -526,7 +712,7 @@ void TraceScene::doSplit(SAHSplit split, const std::vector<SAHTriangle>& T, cons
 		if (e.axis != split.axis)
 			continue;
 			
-		uchar& triangleSide = triangleData[e.triangle].side;
+		uchar& triangleSide = side[e.triangle];
 		
 		if (e.type == SAHEvent::END && e.pos <= split.pos)
 			triangleSide = SAHTriangle::LEFT;
@@ -541,28 +727,30 @@ void TraceScene::doSplit(SAHSplit split, const std::vector<SAHTriangle>& T, cons
 		}
 	}
 	
-	//split events list
+	for (int s = 0; s < 2; ++s)
+	{
+		children.T[s].clear();
+		children.E[s].clear();
+		out.kept[s].clear();
+		out.straddle[s].clear();
+	}
+	
+	//split events list. events of triangles entirely on one side stay sorted
 	for (int i = 0; i < (int)E.size(); ++i)
 	{
-		uchar side = triangleData[E[i].triangle].side;
-		if (side == SAHTriangle::LEFT)
-			El.push_back(E[i]);
-		else if (side == SAHTriangle::RIGHT)
-			Er.push_back(E[i]);
+		uchar s = side[E[i].triangle];
+		if (s != SAHTriangle::BOTH)
+			out.kept[s].push_back(E[i]);
 		//else side == BOTH, discard event
 	}
 	
-	vector<SAHEvent> Enl, Enr;
-	
 	//split triangles list
 	for (int i = 0; i < (int)T.size(); ++i)
 	{
-		uchar side = triangleData[T[i].triangle].side;
-		if (side == SAHTriangle::LEFT)
-			Tl.push_back(T[i]);
-		if (side == SAHTriangle::RIGHT)
-			Tr.push_back(T[i]);
-		if (side == SAHTriangle::BOTH)
+		uchar s = side[T[i].triangle];
+		if (s != SAHTriangle::BOTH)
+			children.T[s].push_back(T[i]);
+		else
 		{
 			//clip triangle to voxel and generate new events
 			SAHTriangle left(T[i]);
@@ -577,43 +765,67 @@ void TraceScene::doSplit(SAHSplit split, const std::vector<SAHTriangle>& T, cons
 			assert(right.clip.bmin[split.axis] == split.pos);
 			#endif
 			
-			Tl.push_back(left);
-			Tr.push_back(right);
-			addEvents(Enl, left);
-			addEvents(Enr, right);
+			children.T[SAHTriangle::LEFT].push_back(left);
+			children.T[SAHTriangle::RIGHT].push_back(right);
+			addEvents(out.straddle[SAHTriangle::LEFT], left);
+			addEvents(out.straddle[SAHTriangle::RIGHT], right);
 		}
 	}
-
-	std::sort(Enl.begin(), Enl.end());
-	std::sort(Enr.begin(), Enr.end());
-	
-	size_t El_mid = El.size();
-	size_t Er_mid = Er.size();
 	
-	El.insert(El.end(), Enl.begin(), Enl.end());
-	Er.insert(Er.end(), Enr.begin(), Enr.end());
-	
-	std::inplace_merge(El.begin(), El.begin() + El_mid, El.end());
-	std::inplace_merge(Er.begin(), Er.begin() + Er_mid, Er.end());
+	//only the new events from straddling triangles need sorting, typically O(sqrt(N)) of them.
+	//merge them with the kept events straight into the children's lists
+	for (int s = 0; s < 2; ++s)
+	{
+		std::sort(out.straddle[s].begin(), out.straddle[s].end());
+		children.E[s].reserve(out.kept[s].size() + out.straddle[s].size());
+		std::merge(out.kept[s].begin(), out.kept[s].end(), out.straddle[s].begin(), out.straddle[s].end(), std::back_inserter(children.E[s]));
+	}
 	
 	#if GLOBAL_TRACE_DEBUG
+	const std::vector<SAHEvent>& El = children.E[SAHTriangle::LEFT];
+	const std::vector<SAHEvent>& Er = children.E[SAHTriangle::RIGHT];
 	for (int i  = 0; i < (int)El.size(); ++i)
 		assert(El[i].axis != split.axis || El[i].pos <= split.pos);
 	for (int i  = 0; i < (int)Er.size(); ++i)
 		assert(Er[i].axis != split.axis || Er[i].pos >= split.pos);
-	for (int i  = 0; i < (int)Enl.size(); ++i)
-		assert(Enl[i].axis != split.axis || Enl[i].pos <= split.pos);
-	for (int i  = 0; i < (int)Enr.size(); ++i)
-		assert(Enr[i].axis != split.axis || Enr[i].pos >= split.pos);
 	#endif
 }
-int TraceScene::rbuild(int depth, std::vector<SAHTriangle>& T, std::vector<SAHEvent>& E, Bounds voxel)
+void TraceScene::SubtreeThread::run()
+{
+	scene->rbuild(out, depth, T, E, voxel);
+}
+
+void TraceScene::splice(KDBuild& out, KDBuild& subtree)
+{
+	//append a subtree built into its own buffers, offsetting its node and triangle indices
+	uint nodeOffset = (uint)out.tree.size();
+	uint triangleOffset = (uint)out.triangles.size();
+	for (size_t i = 0; i < subtree.tree.size(); ++i)
+	{
+		KDBuildNode node = subtree.tree[i];
+		uint offset = (node.type == 3) ? triangleOffset : nodeOffset;
+		node.a += offset;
+		node.b += offset;
+		out.tree.push_back(node);
+	}
+	out.triangles.insert(out.triangles.end(), subtree.triangles.begin(), subtree.triangles.end());
+	out.debugTriangles.insert(out.debugTriangles.end(), subtree.debugTriangles.begin(), subtree.debugTriangles.end());
+	out.depth = mymax(out.depth, subtree.depth);
+	mystdclear(subtree.tree);
+	mystdclear(subtree.triangles);
+}
+
+int TraceScene::rbuild(KDBuild& out, int depth, std::vector<SAHTriangle>& T, std::vector<SAHEvent>& E, Bounds voxel)
 {
-	if (treeDepth < depth)
-		treeDepth = depth;
+	//subtrees and split sweeps near the root run on their own threads
+	int parallelDepth = (buildThreads > 1) ? ceilLog2(buildThreads) : 0;
+	const size_t minParallelEvents = 1 << 15;
+	
+	if (out.depth < depth)
+		out.depth = depth;
 
-	int nodeindex = (int)tree.size();
-	tree.push_back(Node());
+	int nodeindex = (int)out.tree.size();
+	out.tree.push_back(KDBuildNode());
 	//tree[nodeindex].debug = voxel;
 	
 	//termination condition
@@ -623,7 +835,10 @@ int TraceScene::rbuild(int depth, std::vector<SAHTriangle>& T, std::vector<SAHEv
 	SAHSplit split;
 	if (!leaf)
 	{
-		findSplit(voxel, E, (int)T.size(), split);
+		if (depth < parallelDepth && E.size() >= minParallelEvents)
+			findSplitParallel(voxel, E, (int)T.size(), split);
+		else
+			findSplit(voxel, E, (int)T.size(), split);
 		if (split.cost >= intersectCost * T.size())
 			leaf = true;
 	}
@@ -633,25 +848,34 @@ int TraceScene::rbuild(int depth, std::vector<SAHTriangle>& T, std::vector<SAHEv
 	
 	if (leaf)
 	{
-		tree[nodeindex].type = 3; /* leaf */
-		tree[nodeindex].a = (int)triangles.size();
+		out.tree[nodeindex].type = 3; /* leaf */
+		out.tree[nodeindex].a = (int)out.triangles.size();
 		for (int i = 0; i < (int)T.size(); ++i)
-			triangles.push_back(T[i].triangle);
-		tree[nodeindex].b = (int)triangles.size();
+			out.triangles.push_back(T[i].triangle);
+		out.tree[nodeindex].b = (int)out.triangles.size();
 	}
 	else
 	{
-		//split triangle and event list at chosen split plane
-		vector<SAHTriangle> Tl, Tr;
-		vector<SAHEvent> El, Er;
-		doSplit(split, T, E, Tl, El, Tr, Er);
+		//split triangle and event list at chosen split plane into this depth's scratch
+		if ((int)out.levels.size() <= depth)
+			out.levels.resize(depth + 1);
+		KDLevel& children = out.levels[depth];
+		doSplit(out, split, T, E, children);
+		std::vector<SAHTriangle>& Tl = children.T[SAHTriangle::LEFT];
+		std::vector<SAHTriangle>& Tr = children.T[SAHTriangle::RIGHT];
+		std::vector<SAHEvent>& El = children.E[SAHTriangle::LEFT];
+		std::vector<SAHEvent>& Er = children.E[SAHTriangle::RIGHT];
 
-		//triangles and events have been split. release parent memory		
-		mystdclear(E);
-		mystdclear(T);
+		//triangles and events have been split. the input is the parent level's scratch and is
+		//reused by the next node there, except for the root's which is only needed once
+		if (depth == 0)
+		{
+			mystdclear(E);
+			mystdclear(T);
+		}
 
-		tree[nodeindex].type = split.axis;
-		tree[nodeindex].split = split.pos;
+		out.tree[nodeindex].type = split.axis;
+		out.tree[nodeindex].split = split.pos;
 		Bounds voxelLess = voxel;
 		Bounds voxelGreater = voxel;
 		voxelLess.bmax[split.axis] = split.pos;
@@ -665,66 +889,150 @@ int TraceScene::rbuild(int depth, std::vector<SAHTriangle>& T, std::vector<SAHEv
 		printf("Split gives %.2fx%i + %.2fx%i\n", Lvol, Tl.size(), Rvol, Tr.size());
 		#endif
 		
-		int left = rbuild(depth + 1, Tl, El, voxelLess);
-		int right = rbuild(depth + 1, Tr, Er, voxelGreater);
-		tree[nodeindex].a = left;
-		tree[nodeindex].b = right;
+		int left, right;
+		if (depth < parallelDepth && Tr.size() > 1)
+		{
+			//build the right subtree into separate buffers on another thread, then splice
+			//it in after the left. node order matches the single threaded build
+			SubtreeThread* thread = new SubtreeThread();
+			thread->scene = this;
+			thread->depth = depth + 1;
+			thread->voxel = voxelGreater;
+			thread->out.side.resize(out.side.size());
+			thread->T.swap(Tr);
+			thread->E.swap(Er);
+			thread->start();
+			left = rbuild(out, depth + 1, Tl, El, voxelLess);
+			thread->wait();
+			right = (int)out.tree.size();
+			splice(out, thread->out);
+			Tr.swap(thread->T); //give the scratch memory back to this level
+			Er.swap(thread->E);
+			delete thread;
+		}
+		else
+		{
+			left = rbuild(out, depth + 1, Tl, El, voxelLess);
+			right = rbuild(out, depth + 1, Tr, Er, voxelGreater);
+		}
+		out.tree[nodeindex].a = left;
+		out.tree[nodeindex].b = right;
 		
 		if (debug)
 		{
 			switch (split.axis)
 			{
 			case 0:
-				debugTriangles.push_back(vec3f(split.pos, voxel.bmin.y, voxel.bmin.z));
-				debugTriangles.push_back(vec3f(1.0f, 0.0f, 0.0f));
-				debugTriangles.push_back(vec3f(split.pos, voxel.bmax.y, voxel.bmin.z));
-				debugTriangles.push_back(vec3f(1.0f, 0.0f, 0.0f));
-				debugTriangles.push_back(vec3f(split.pos, voxel.bmax.y, voxel.bmax.z));
-				debugTriangles.push_back(vec3f(1.0f, 0.0f, 0.0f));
-				debugTriangles.push_back(vec3f(split.pos, voxel.bmin.y, voxel.bmax.z));
-				debugTriangles.push_back(vec3f(1.0f, 0.0f, 0.0f));
+				out.debugTriangles.push_back(vec3f(split.pos, voxel.bmin.y, voxel.bmin.z));
+				out.debugTriangles.push_back(vec3f(1.0f, 0.0f, 0.0f));
+				out.debugTriangles.push_back(vec3f(split.pos, voxel.bmax.y, voxel.bmin.z));
+				out.debugTriangles.push_back(vec3f(1.0f, 0.0f, 0.0f));
+				out.debugTriangles.push_back(vec3f(split.pos, voxel.bmax.y, voxel.bmax.z));
+				out.debugTriangles.push_back(vec3f(1.0f, 0.0f, 0.0f));
+				out.debugTriangles.push_back(vec3f(split.pos, voxel.bmin.y, voxel.bmax.z));
+				out.debugTriangles.push_back(vec3f(1.0f, 0.0f, 0.0f));
 				break;
 			case 1:
-				debugTriangles.push_back(vec3f(voxel.bmin.x, split.pos, voxel.bmin.z));
-				debugTriangles.push_back(vec3f(0.0f, 1.0f, 0.0f));
-				debugTriangles.push_back(vec3f(voxel.bmax.x, split.pos, voxel.bmin.z));
-				debugTriangles.push_back(vec3f(0.0f, 1.0f, 0.0f));
-				debugTriangles.push_back(vec3f(voxel.bmax.x, split.pos, voxel.bmax.z));
-				debugTriangles.push_back(vec3f(0.0f, 1.0f, 0.0f));
-				debugTriangles.push_back(vec3f(voxel.bmin.x, split.pos, voxel.bmax.z));
-				debugTriangles.push_back(vec3f(0.0f, 1.0f, 0.0f));
+				out.debugTriangles.push_back(vec3f(voxel.bmin.x, split.pos, voxel.bmin.z));
+				out.debugTriangles.push_back(vec3f(0.0f, 1.0f, 0.0f));
+				out.debugTriangles.push_back(vec3f(voxel.bmax.x, split.pos, voxel.bmin.z));
+				out.debugTriangles.push_back(vec3f(0.0f, 1.0f, 0.0f));
+				out.debugTriangles.push_back(vec3f(voxel.bmax.x, split.pos, voxel.bmax.z));
+				out.debugTriangles.push_back(vec3f(0.0f, 1.0f, 0.0f));
+				out.debugTriangles.push_back(vec3f(voxel.bmin.x, split.pos, voxel.bmax.z));
+				out.debugTriangles.push_back(vec3f(0.0f, 1.0f, 0.0f));
 				break;
 			case 2:
-				debugTriangles.push_back(vec3f(voxel.bmin.x, voxel.bmin.y, split.pos));
-				debugTriangles.push_back(vec3f(0.0f, 0.0f, 1.0f));
-				debugTriangles.push_back(vec3f(voxel.bmax.x, voxel.bmin.y, split.pos));
-				debugTriangles.push_back(vec3f(0.0f, 0.0f, 1.0f));
-				debugTriangles.push_back(vec3f(voxel.bmax.x, voxel.bmax.y, split.pos));
-				debugTriangles.push_back(vec3f(0.0f, 0.0f, 1.0f));
-				debugTriangles.push_back(vec3f(voxel.bmin.x, voxel.bmax.y, split.pos));
-				debugTriangles.push_back(vec3f(0.0f, 0.0f, 1.0f));
+				out.debugTriangles.push_back(vec3f(voxel.bmin.x, voxel.bmin.y, split.pos));
+				out.debugTriangles.push_back(vec3f(0.0f, 0.0f, 1.0f));
+				out.debugTriangles.push_back(vec3f(voxel.bmax.x, voxel.bmin.y, split.pos));
+				out.debugTriangles.push_back(vec3f(0.0f, 0.0f, 1.0f));
+				out.debugTriangles.push_back(vec3f(voxel.bmax.x, voxel.bmax.y, split.pos));
+				out.debugTriangles.push_back(vec3f(0.0f, 0.0f, 1.0f));
+				out.debugTriangles.push_back(vec3f(voxel.bmin.x, voxel.bmax.y, split.pos));
+				out.debugTriangles.push_back(vec3f(0.0f, 0.0f, 1.0f));
 				break;
 			}
 		}
 	}
 	return nodeindex;
 }
-void TraceScene::build()
+void TraceScene::SortThread::run()
 {
-	MyTimer timer;
-	timer.time();
+	if (mid > begin)
+		std::inplace_merge(events->begin() + begin, events->begin() + mid, events->begin() + end);
+	else
+		std::sort(events->begin() + begin, events->begin() + end);
+}
+
+void TraceScene::sortEvents(std::vector<SAHEvent>& E)
+{
+	int n = mymax(1, buildThreads);
+	if (n == 1 || E.size() < (size_t)n * 1024)
+	{
+		std::sort(E.begin(), E.end());
+		return;
+	}
 	
-	printf("Building KD Tree\n");
+	//sort a chunk per thread
+	std::vector<size_t> bounds;
+	for (int i = 0; i <= n; ++i)
+		bounds.push_back((E.size() * i) / n);
+	std::vector<SortThread> threads(n);
+	for (int i = 0; i < n; ++i)
+	{
+		threads[i].events = &E;
+		threads[i].begin = threads[i].mid = bounds[i];
+		threads[i].end = bounds[i+1];
+		threads[i].start();
+	}
+	for (int i = 0; i < n; ++i)
+		threads[i].wait();
 	
+	//merge neighbouring pairs of chunks in parallel until one is left
+	while (bounds.size() > 2)
+	{
+		int tasks = (int)(bounds.size() - 1) / 2;
+		for (int i = 0; i < tasks; ++i)
+		{
+			threads[i].begin = bounds[i*2];
+			threads[i].mid = bounds[i*2+1];
+			threads[i].end = bounds[i*2+2];
+			threads[i].start();
+		}
+		for (int i = 0; i < tasks; ++i)
+			threads[i].wait();
+		std::vector<size_t> merged;
+		for (size_t i = 0; i < bounds.size(); i += 2)
+			merged.push_back(bounds[i]);
+		if (merged.back() != bounds.back())
+			merged.push_back(bounds.back());
+		bounds.swap(merged);
+	}
+}
+
+static TraceScene::Bounds triangleBounds(const TraceScene::Triangle& t)
+{
+	TraceScene::Bounds bounds;
+	bounds.bmin = vmin(vmin(t.a, t.a + t.u), t.a + t.v);
+	bounds.bmax = vmax(vmax(t.a, t.a + t.u), t.a + t.v);
+	return bounds;
+}
+
+bool TraceScene::buildKDTree()
+{
 	int totalTriangles = (int)triangleData.size();
 	
 	vector<SAHTriangle> T(totalTriangles);
 	vector<SAHEvent> E;
+	Bounds sceneBounds;
+	sceneBounds.bmin = sceneBounds.bmax = vec3f(0.0f);
 	for (int i = 0; i < totalTriangles; ++i)
 	{
-		T[i].clip.bmin = vmin(vmin(triangleData[i].a, triangleData[i].a + triangleData[i].u), triangleData[i].a + triangleData[i].v);
-		T[i].clip.bmax = vmax(vmax(triangleData[i].a, triangleData[i].a + triangleData[i].u), triangleData[i].a + triangleData[i].v);
+		T[i].clip = triangleBounds(triangleData[i]);
 		T[i].triangle = i;
+		sceneBounds.bmin = i ? vmin(sceneBounds.bmin, T[i].clip.bmin) : T[i].clip.bmin;
+		sceneBounds.bmax = i ? vmax(sceneBounds.bmax, T[i].clip.bmax) : T[i].clip.bmax;
 		
 		addEvents(E, T[i]);
 	}
@@ -743,7 +1051,7 @@ void TraceScene::build()
 	assert(Ts.z + Tp.z == (int)T.size());
 	#endif
 	
-	std::sort(E.begin(), E.end());
+	sortEvents(E);
 	
 	#if 0
 	for (int i = 0; i < (int)E.size(); ++i)
@@ -754,8 +1062,13 @@ void TraceScene::build()
 	if (debug)
 		debugTriangles.clear();
 	
-	treeDepth = 0;
-	rbuild(0, T, E, sceneBounds);
+	KDBuild out;
+	out.side.resize(totalTriangles);
+	rbuild(out, 0, T, E, sceneBounds);
+	triangles.swap(out.triangles);
+	treeDepth = out.depth;
+	if (debug)
+		debugTriangles.swap(out.debugTriangles);
 	
 	if (debug)
 	{
@@ -774,1241 +1087,3866 @@ void TraceScene::build()
 		debugMesh->upload(false);
 	}
 	
-	#if 1
-	int numLeaves = 0;
-	int numTriangles = 0;
-	uint maxLeaf = 0;
-	for (int i = 0; i < (int)tree.size(); ++i)
+	std::vector<KDBuildNode>& nodes = out.tree;
+	buildStats.nodes = (int)nodes.size();
+	buildStats.maxDepth = treeDepth;
+	for (int i = 0; i < (int)nodes.size(); ++i)
 	{
-		if (tree[i].type == 3)
+		if (nodes[i].type == 3)
 		{
-			++numLeaves;
-			numTriangles += tree[i].b - tree[i].a;
-			maxLeaf = mymax(tree[i].b - tree[i].a, maxLeaf);
+			++buildStats.leaves;
+			buildStats.maxLeafSize = mymax(buildStats.maxLeafSize, (int)(nodes[i].b - nodes[i].a));
 		}
 	}
 	
-	printf("Created KD Tree\n");
-	printf("\t%i branch capacity\n", (int)tree.size());
-	printf("\t%i total leaves\n", numLeaves);
-	printf("\t%i total prims\n", totalTriangles);
-	printf("\t%i prims in leaves\n", (int)triangles.size());
-	printf("\t%i prims in leaves check\n", numTriangles);
-	printf("\t%i max leaf size\n", maxLeaf);
-	printf("\t%i max depth\n", treeDepth);
-	printf("\tTime: %f\n", timer.time());
-	#endif
+	buildBlocks(nodes);
+	return layoutTree(nodes);
 }
 
-float TraceScene::Ray::transfer(const TraceScene::HitInfo& hitInfo, const vec3f& incidence)
+void TraceScene::buildBlocks(std::vector<KDBuildNode>& nodes)
 {
-	float t = (hitInfo.pos - start).size();
-	const vec3f& N = hitInfo.interp.n;
-	
-	for (int i = 0; i < 4; ++i)
+	//repoint leaves from their triangle ranges to blocks of 4
+	blocks.clear();
+	for (int i = 0; i < (int)nodes.size(); ++i)
 	{
-		vec3f newP = d[i].P + d[i].D * t;
-		vec3f DD = incidence + d[i].D;
-		DD.normalize();
-		float dtdd = -N.dot(newP) / N.dot(DD);
-		d[i].P += d[i].D * t + DD * dtdd;
+		if (nodes[i].type != 3)
+			continue;
+		uint first = (uint)blocks.size();
+		for (uint b = nodes[i].a; b < nodes[i].b; b += 4)
+		{
+			TriangleBlock block;
+			memset(&block, 0, sizeof(block));
+			block.count = mymin(4, (int)(nodes[i].b - b));
+			for (int j = 0; j < 4; ++j)
+			{
+				//unused lanes repeat the last triangle index with a zero normal
+				block.triangle[j] = triangles[b + mymin(j, block.count - 1)];
+				if (j >= block.count)
+					continue;
+				//s = w.bs and t = w.bt are intersectRayTriangle's barycentrics, w = hit - a
+				const Triangle& t = triangleData[block.triangle[j]];
+				vec3f bs = (t.v * t.d_uv - t.u * t.d_vv) / t.uvuuvv;
+				vec3f bt = (t.u * t.d_uv - t.v * t.d_uu) / t.uvuuvv;
+				for (int k = 0; k < 3; ++k)
+				{
+					block.a[k][j] = t.a[k];
+					block.n[k][j] = t.n[k];
+					block.bs[k][j] = bs[k];
+					block.bt[k][j] = bt[k];
+				}
+			}
+			blocks.push_back(block);
+		}
+		nodes[i].a = first;
+		nodes[i].b = (uint)blocks.size();
 	}
-	return t;
 }
 
-void TraceScene::Ray::reflect(const TraceScene::HitInfo& surface, const vec3f& incidence, const vec3f (&curve)[4])
+uint TraceScene::layoutSubtree(const std::vector<KDBuildNode>& nodes, const std::vector<uint>& sizes, uint node, std::vector<Node>& out)
 {
-	const vec3f& N = surface.backface?-surface.interp.n:surface.interp.n;
+	uint index = (uint)out.size();
+	out.push_back(Node());
+	const KDBuildNode& n = nodes[node];
+	if (n.type == 3)
+	{
+		out[index].count = n.b - n.a;
+		out[index].data = 3 | (n.a << 2);
+		return index;
+	}
 	
-	float dn = incidence.dot(N);
-	for (int i = 0; i < 4; ++i)
+	//rbuild writes nodes depth first, so the left child is already next
+	layoutSubtree(nodes, sizes, node + 1, out);
+	
+	//start right subtrees that fit in a cache line on a new line rather than straddling two
+	const uint lineNodes = 64 / sizeof(Node);
+	uint used = (uint)out.size() % lineNodes;
+	if (sizes[n.b] <= lineNodes && used + sizes[n.b] > lineNodes)
 	{
-		float dndx = d[i].D.dot(N) + incidence.dot(curve[i]);
-		d[i].D = d[i].D - (curve[i] * dn + N * dndx) * 2.0f;
+		Node pad;
+		pad.count = 0;
+		pad.data = 3;
+		out.resize(out.size() + lineNodes - used, pad);
+		buildStats.padding += lineNodes - used;
 	}
+	uint right = layoutSubtree(nodes, sizes, n.b, out);
+	
+	out[index].split = n.split;
+	out[index].data = n.type | (right << 2);
+	return index;
 }
 
-void TraceScene::Ray::refract(const TraceScene::HitInfo& surface, const vec3f& incidence, const vec3f (&curve)[4], float eta)
+bool TraceScene::layoutTree(const std::vector<KDBuildNode>& nodes)
 {
-	const vec3f& N = surface.backface?-surface.interp.n:surface.interp.n;
+	//subtree sizes. children always come after their parent
+	std::vector<uint> sizes(nodes.size(), 1);
+	for (int i = (int)nodes.size() - 1; i >= 0; --i)
+		if (nodes[i].type != 3)
+			sizes[i] += sizes[nodes[i].a] + sizes[nodes[i].b];
+	
+	std::vector<Node> layout;
+	layout.reserve(nodes.size());
+	layoutSubtree(nodes, sizes, 0, layout);
+	if ((layout.size() | blocks.size()) >> 30)
+	{
+		printf("Error: KD tree too big for 30 bit node offsets\n");
+		return false;
+	}
 	
-	float dn = incidence.dot(N);
-	float dis = 1.0f - eta*eta * (1.0 - dn * dn);
-	float ddn = -sqrt(dis);
-	float mu = eta*dn - ddn;
+	//copy to a cache line aligned start, so the layout's lines match the hardware's
+	const uint lineNodes = 64 / sizeof(Node);
+	treeMemory.resize(layout.size() + lineNodes - 1);
+	uint skip = (uint)((64 - (uintptr_t)&treeMemory[0] % 64) % 64 / sizeof(Node));
+	std::copy(layout.begin(), layout.end(), &treeMemory[skip]);
+	tree = &treeMemory[skip];
+	treeNodes = (uint)layout.size();
+	return true;
+}
+
+//build cache files start with this header. the arrays follow at 64 byte aligned offsets, so the
+//tree keeps its cache line layout when the file is mapped
+#define KD_CACHE_VERSION 2
+struct KDCacheHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t nodeSize, blockSize; //catches files from builds with a different struct layout
+	uint32_t treeNodes, blocks, triangles;
+	uint64_t key;
+	uint64_t nodesOffset, blocksOffset, trianglesOffset;
+	int32_t treeDepth;
+	TraceScene::BuildStats stats;
+};
+static const char kdCacheMagic[8] = "PYKDTRE";
+
+static uint64_t fnv1a(uint64_t hash, const void* data, size_t size)
+{
+	const unsigned char* bytes = (const unsigned char*)data;
+	for (size_t i = 0; i < size; ++i)
+		hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+	return hash;
+}
+
+static uint64_t cacheAlign(uint64_t offset)
+{
+	return (offset + 63) & ~(uint64_t)63;
+}
+
+static bool cacheWrite(FILE* file, uint64_t& pos, uint64_t offset, const void* data, size_t size, size_t count)
+{
+	//zero the padding up to offset, then write the array. files are written in order, without seeking
+	static const char zeros[64] = {0};
+	if (offset - pos >= sizeof(zeros) || fwrite(zeros, 1, (size_t)(offset - pos), file) != offset - pos)
+		return false;
+	pos = offset + size * count;
+	return count == 0 || fwrite(data, size, count, file) == count;
+}
+
+uint64_t TraceScene::buildKey()
+{
+	//the tree only depends on the triangles, which already have the mesh transforms baked in, and the SAH costs.
+	//triangleShading isn't part of the tree, so changing materials keeps the same file
+	uint32_t version = KD_CACHE_VERSION;
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	hash = fnv1a(hash, &version, sizeof(version));
+	hash = fnv1a(hash, &traversalCost, sizeof(traversalCost));
+	hash = fnv1a(hash, &intersectCost, sizeof(intersectCost));
+	if (triangleData.size())
+		hash = fnv1a(hash, &triangleData[0], triangleData.size() * sizeof(Triangle));
+	return hash;
+}
+
+bool TraceScene::loadKDTree(const std::string& filename, uint64_t key)
+{
+	if (!buildCacheFile.open(filename.c_str()))
+		return false;
 	
-	for (int i = 0; i < 4; ++i)
+	const KDCacheHeader& header = *(const KDCacheHeader*)buildCacheFile.data;
+	uint64_t size = buildCacheFile.size;
+	if (size < sizeof(KDCacheHeader) || memcmp(header.magic, kdCacheMagic, sizeof(kdCacheMagic)) != 0 ||
+		header.version != KD_CACHE_VERSION || header.key != key ||
+		header.nodeSize != sizeof(Node) || header.blockSize != sizeof(TriangleBlock) ||
+		header.nodesOffset + (uint64_t)header.treeNodes * sizeof(Node) > size ||
+		header.blocksOffset + (uint64_t)header.blocks * sizeof(TriangleBlock) > size ||
+		header.trianglesOffset + (uint64_t)header.triangles * sizeof(uint) > size)
 	{
-		float dndx = d[i].D.dot(N) + incidence.dot(curve[i]);
-		float mudx = (eta - eta*eta*dn/ddn) * dndx;
-		d[i].D = d[i].D * eta - (curve[i] * mu + N * mudx);
+		printf("Warning: ignoring out of date build cache %s\n", filename.c_str());
+		buildCacheFile.close();
+		return false;
 	}
+	
+	//nodes and blocks are used in place. the triangle list is small and only needed for stats
+	tree = (const Node*)(buildCacheFile.data + header.nodesOffset);
+	treeNodes = header.treeNodes;
+	blockData = (const TriangleBlock*)(buildCacheFile.data + header.blocksOffset);
+	const uint* indices = (const uint*)(buildCacheFile.data + header.trianglesOffset);
+	triangles.assign(indices, indices + header.triangles);
+	treeDepth = header.treeDepth;
+	buildStats = header.stats;
+	return true;
 }
 
-void TraceScene::Ray::tangentDiff(const TraceScene::HitInfo& surface, const Vertex& a, const Vertex& b, const Vertex& c, vec3f (&curve)[4], vec2f (&area)[4])
+void TraceScene::saveKDTree(const std::string& filename, uint64_t key)
 {
-	const vec3f& N = surface.interp.n;
-	Triangle& triangle = *surface.triangle;
-	for (int i = 0; i < 4; ++i)
+	KDCacheHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, kdCacheMagic, sizeof(kdCacheMagic));
+	header.version = KD_CACHE_VERSION;
+	header.nodeSize = sizeof(Node);
+	header.blockSize = sizeof(TriangleBlock);
+	header.treeNodes = treeNodes;
+	header.blocks = (uint32_t)blocks.size();
+	header.triangles = (uint32_t)triangles.size();
+	header.key = key;
+	header.nodesOffset = cacheAlign(sizeof(header));
+	header.blocksOffset = cacheAlign(header.nodesOffset + treeNodes * sizeof(Node));
+	header.trianglesOffset = cacheAlign(header.blocksOffset + blocks.size() * sizeof(TriangleBlock));
+	header.treeDepth = treeDepth;
+	header.stats = buildStats;
+	
+	//written under a temporary name then renamed, so nothing ever maps a partly written file
+	std::string temp = filename + ".tmp";
+	FILE* file = fopen(temp.c_str(), "wb");
+	if (!file)
 	{
-		vec3f wd = surface.pos + d[i].P - triangle.a;
-		float d_wvdx = vecDot(wd, triangle.v);
-		float d_wudx = vecDot(wd, triangle.u);
-		vec3f bd;
-		bd.x = (triangle.d_uv*d_wvdx - triangle.d_vv*d_wudx) / triangle.uvuuvv;
-		bd.y = (triangle.d_uv*d_wudx - triangle.d_uu*d_wvdx) / triangle.uvuuvv;
-		bd.z = surface.s + surface.t - bd.x - bd.y;
-		bd.x -= surface.s;
-		bd.y -= surface.t;
-		curve[i] = (a.n * bd.x + b.n * bd.y + c.n * bd.z);
-		curve[i] -= N * N.dot(curve[i]);
-		if (surface.backface) //FIXME: this seems a little unintuitive - normal derivs are negated for backfaces for refraction and reflection
-			curve[i] = -curve[i];
-		area[i] = a.t * bd.x + b.t * bd.y + c.t * bd.z;
+		printf("Error: could not write build cache %s\n", temp.c_str());
+		return;
+	}
+	uint64_t pos = 0;
+	bool ok = cacheWrite(file, pos, 0, &header, sizeof(header), 1);
+	ok = ok && cacheWrite(file, pos, header.nodesOffset, tree, sizeof(Node), treeNodes);
+	ok = ok && cacheWrite(file, pos, header.blocksOffset, blockData, sizeof(TriangleBlock), blocks.size());
+	ok = ok && cacheWrite(file, pos, header.trianglesOffset, triangles.size() ? &triangles[0] : NULL, sizeof(uint), triangles.size());
+	ok = (fclose(file) == 0) && ok;
+	remove(filename.c_str());
+	if (!ok || rename(temp.c_str(), filename.c_str()) != 0)
+	{
+		printf("Error: could not write build cache %s\n", filename.c_str());
+		remove(temp.c_str());
 	}
 }
 
-bool TraceScene::hitSurface(vec4f& colour, Ray& ray, HitInfo& hitInfo, TraceStack& rays, int sampleOffset, int traceFlags)
+struct CentroidCompare
 {
-	bool isPhoton = ((traceFlags & TRACE_PHOTON) > 0);
-	bool hasBounced = (ray.mask & (Ray::REFLECT | Ray::REFRACT)) != 0;
-	bool debugTrace = ((traceFlags & TRACE_DEBUG) > 0);
-	bool insertPhoton = isPhoton && hasBounced;
-	bool lowIntensity = ray.intensity.x + ray.intensity.y + ray.intensity.z + ray.intensity.w < 0.1f;
-	bool isGlobal = (ray.mask & Ray::GLOBAL) > 0;
-	bool nonPrimary = isGlobal || lowIntensity;
-	
-	//if (lowIntensity)
-	//	return true;
-	
-	//don't use multiple texture samples for GI rays - too expensive
-	bool singleSample = nonPrimary;
-
-	//calculate normalized incidense vector
-	vec3f incidence = ray.dir;
-	incidence.normalize();
+	const std::vector<vec3f>& centroids;
+	int axis;
+	CentroidCompare(const std::vector<vec3f>& c, int a) : centroids(c), axis(a) {}
+	bool operator()(uint a, uint b) const {return centroids[a][axis] < centroids[b][axis];}
+};
 
-	//copy ray and compute differentials
-	//FIXME: how the hell do I incorporate normal maps? since they may be sampled differently due to the differentials
-	Ray newRay = ray;
-	float distance = newRay.transfer(hitInfo, incidence);
+int TraceScene::rbuildBVH(std::vector<BVHNode>& nodes, std::vector<uint>& indices, const std::vector<Bounds>& itemBounds, const std::vector<vec3f>& centroids, int depth, int begin, int end)
+{
+	//splits are forced above this size, even if the SAH would make a leaf
+	const int maxLeafSize = 8;
+	const int numBins = 16;
 	
-	/*
-	vec3f bdx, bdy; //barycentric derivatives - xyz = s, t, 1-s-t
-	if (true)
-	{
-		Triangle& triangle = *hitInfo.triangle;
-		vec3f wdx = hitInfo.pos + newRay.dx.P - triangle.a;
-		vec3f wdy = hitInfo.pos + newRay.dy.P - triangle.a;
-		float d_wvdx = vecDot(wdx, triangle.v);
-		float d_wudx = vecDot(wdx, triangle.u);
-		float d_wvdy = vecDot(wdy, triangle.v);
-		float d_wudy = vecDot(wdy, triangle.u);
-		bdx.x = (triangle.d_uv*d_wvdx - triangle.d_vv*d_wudx) / triangle.uvuuvv;
-		bdx.y = (triangle.d_uv*d_wudx - triangle.d_uu*d_wvdx) / triangle.uvuuvv;
-		bdy.x = (triangle.d_uv*d_wvdy - triangle.d_vv*d_wudy) / triangle.uvuuvv;
-		bdy.y = (triangle.d_uv*d_wudy - triangle.d_uu*d_wvdy) / triangle.uvuuvv;
-		bdx.z = hitInfo.s + hitInfo.t - bdx.x - bdx.y;
-		bdy.z = hitInfo.s + hitInfo.t - bdy.x - bdy.y;
-		bdx.x -= hitInfo.s;
-		bdx.y -= hitInfo.t;
-		bdy.x -= hitInfo.s;
-		bdy.y -= hitInfo.t;
-	}
+	//skewed centroids can peel off one item per SAH split. from half the stack size on, splits are at the
+	//median, which adds at most log2(count / maxLeafSize) more levels
+	bool median = depth >= BVH_MAX_DEPTH / 2;
 	
-	vec2f dTdx = vertexData[hitInfo.triangle->verts[1]].t * bdx.x + vertexData[hitInfo.triangle->verts[2]].t * bdx.y + vertexData[hitInfo.triangle->verts[0]].t * bdx.z;
-	vec2f dTdy = vertexData[hitInfo.triangle->verts[1]].t * bdy.x + vertexData[hitInfo.triangle->verts[2]].t * bdy.y + vertexData[hitInfo.triangle->verts[0]].t * bdy.z;
-	*/
+	buildStats.maxDepth = mymax(buildStats.maxDepth, depth);
 	
-	vec3f normalDerivs[4];
-	vec2f sampleArea[4];
-	newRay.tangentDiff(hitInfo, vertexData[hitInfo.triangle->verts[1]], vertexData[hitInfo.triangle->verts[2]], vertexData[hitInfo.triangle->verts[0]], normalDerivs, sampleArea);
-
-	vec3f normal;
+	int nodeindex = (int)nodes.size();
+	nodes.push_back(BVHNode());
 	
-	if (debugTrace && (!isPhoton || insertPhoton))
+	Bounds bounds, centroidBounds;
+	bounds = itemBounds[indices[begin]];
+	centroidBounds.bmin = centroidBounds.bmax = centroids[indices[begin]];
+	for (int i = begin + 1; i < end; ++i)
 	{
-		debugMutex.lock();
-		for (float x = 0; x <= 1; x += 0.1)
+		bounds.bmin = vmin(bounds.bmin, itemBounds[indices[i]].bmin);
+		bounds.bmax = vmax(bounds.bmax, itemBounds[indices[i]].bmax);
+		centroidBounds.bmin = vmin(centroidBounds.bmin, centroids[indices[i]]);
+		centroidBounds.bmax = vmax(centroidBounds.bmax, centroids[indices[i]]);
+	}
+	nodes[nodeindex].bounds = bounds;
+	
+	//bin centroids along each axis and sweep the bin boundaries for the cheapest SAH split
+	int count = end - begin;
+	float leafCost = intersectCost * count;
+	float bestCost = leafCost;
+	int bestAxis = -1;
+	int bestBin = 0;
+	float area = mymax(SA(bounds), 1e-20f);
+	for (int k = 0; k < 3 && count > 1 && !median; ++k)
+	{
+		float extent = centroidBounds.bmax[k] - centroidBounds.bmin[k];
+		if (extent <= 0.0f)
+			continue;
+		float binScale = numBins / extent;
+		
+		BVHBin bins[numBins];
+		for (int b = 0; b < numBins; ++b)
+			bins[b].count = 0;
+		for (int i = begin; i < end; ++i)
 		{
-			vec3f x1 = interpLinear(newRay.d[0].P, newRay.d[3].P, x);
-			vec3f x2 = interpLinear(newRay.d[1].P, newRay.d[2].P, x);
-			for (float y = 0; y <= 1; y += 0.1)
+			int b = mymin(numBins - 1, (int)((centroids[indices[i]][k] - centroidBounds.bmin[k]) * binScale));
+			const Bounds& tb = itemBounds[indices[i]];
+			if (bins[b].count++ == 0)
+				bins[b].bounds = tb;
+			else
 			{
-				debugPoints.push_back(hitInfo.pos + interpLinear(x1, x2, y));
+				bins[b].bounds.bmin = vmin(bins[b].bounds.bmin, tb.bmin);
+				bins[b].bounds.bmax = vmax(bins[b].bounds.bmax, tb.bmax);
 			}
 		}
 		
-		for (int i = 0; i < 4; ++i)
+		//right to left sweep stores the area and count of everything right of each boundary
+		float rightArea[numBins];
+		int rightCount[numBins];
+		Bounds acc;
+		int accCount = 0;
+		for (int b = numBins - 1; b > 0; --b)
 		{
-			Ray tmp = newRay;
-			tmp.mask |= Ray::DEBUG1;
-			tmp.d[0] = Ray::Diff(vec3f(0.0f), vec3f(0.0f));
-			tmp.d[1] = Ray::Diff(vec3f(0.0f), vec3f(0.0f));
-			tmp.d[2] = Ray::Diff(vec3f(0.0f), vec3f(0.0f));
-			tmp.d[3] = Ray::Diff(vec3f(0.0f), vec3f(0.0f));
-			tmp.start = hitInfo.pos + newRay.d[i].P + hitInfo.interp.n * 0.1;
-			tmp.end = hitInfo.pos + newRay.d[i].P + (hitInfo.interp.n + normalDerivs[i] * 10.0) * 0.1;
-			debugRays.push_back(tmp);
+			if (bins[b].count)
+			{
+				if (accCount == 0)
+					acc = bins[b].bounds;
+				acc.bmin = vmin(acc.bmin, bins[b].bounds.bmin);
+				acc.bmax = vmax(acc.bmax, bins[b].bounds.bmax);
+				accCount += bins[b].count;
+			}
+			rightArea[b] = accCount ? SA(acc) : 0.0f;
+			rightCount[b] = accCount;
+		}
+		accCount = 0;
+		for (int b = 0; b < numBins - 1; ++b)
+		{
+			if (bins[b].count)
+			{
+				if (accCount == 0)
+					acc = bins[b].bounds;
+				acc.bmin = vmin(acc.bmin, bins[b].bounds.bmin);
+				acc.bmax = vmax(acc.bmax, bins[b].bounds.bmax);
+				accCount += bins[b].count;
+			}
+			if (accCount == 0 || rightCount[b+1] == 0)
+				continue;
+			float cost = traversalCost + intersectCost * (SA(acc) * accCount + rightArea[b+1] * rightCount[b+1]) / area;
+			if (cost < bestCost || (bestAxis < 0 && count > maxLeafSize))
+			{
+				bestCost = cost;
+				bestAxis = k;
+				bestBin = b + 1;
+			}
 		}
-		
-		debugRays.push_back(newRay);
-		debugRays.back().end = hitInfo.pos;
-		debugMutex.unlock();
 	}
-
-	Material* material = materials[hitInfo.triangle->material];
-	vec3f specularColour = material->specular;
-	vec4f diffuseColour = material->colour;
-	vec3f ambientColour = material->ambient;
-	if (material->imgColour.mipmaps.size())
+	
+	if (bestAxis < 0 && count <= maxLeafSize)
 	{
-		vec4f textureColour;
-		if (singleSample)
-			textureColour = texture2D(&material->imgColour, hitInfo.interp.t, 0);
-		else
-			textureColour = texture2D(&material->imgColour, hitInfo.interp.t, sampleArea);
-		diffuseColour *= textureColour;
-		ambientColour *= textureColour.xyz();
+		nodes[nodeindex].offset = begin;
+		nodes[nodeindex].count = count;
+		nodes[nodeindex].axis = 0;
+		++buildStats.leaves;
+		buildStats.maxLeafSize = mymax(buildStats.maxLeafSize, count);
+		return nodeindex;
 	}
 	
-	//hold up. if this was a shadow ray we just care about transparency, nothing else
-	if (traceFlags & TRACE_SHADOW)
+	int mid;
+	if (median)
 	{
-		float t = 1.0f - diffuseColour.w;
-		colour *= t;
-		if (t < 1.0f/255.0f)
-			return true;
-		return false;
+		vec3f extent = centroidBounds.bmax - centroidBounds.bmin;
+		bestAxis = (extent.x > extent.y && extent.x > extent.z) ? 0 : (extent.y > extent.z ? 1 : 2);
+		mid = (begin + end) / 2;
+		CentroidCompare compare(centroids, bestAxis);
+		std::nth_element(indices.begin() + begin, indices.begin() + mid, indices.begin() + end, compare);
 	}
-	
-	if (material->imgNormal.mipmaps.size())
+	else if (bestAxis >= 0)
 	{
-		vec3f biNormal = hitInfo.interp.ts.cross(hitInfo.interp.n).unit();
-		vec3f tangent = hitInfo.interp.n.cross(biNormal).unit();
-		if (singleSample)
-			normal = texture2D(&material->imgNormal, hitInfo.interp.t, 0).xyz() * 2.0f - 1.0f;
-		else
-			normal = texture2D(&material->imgNormal, hitInfo.interp.t, sampleArea).xyz() * 2.0f - 1.0f;
-		normal.normalize();
-		normal = tangent * normal.x + hitInfo.interp.n * normal.z + biNormal * normal.y;
+		float binScale = numBins / (centroidBounds.bmax[bestAxis] - centroidBounds.bmin[bestAxis]);
+		mid = begin;
+		for (int i = begin; i < end; ++i)
+		{
+			int b = mymin(numBins - 1, (int)((centroids[indices[i]][bestAxis] - centroidBounds.bmin[bestAxis]) * binScale));
+			if (b < bestBin)
+				std::swap(indices[i], indices[mid++]);
+		}
 	}
 	else
-		normal = hitInfo.interp.n;
-	
-	//normal = hitInfo.triangle->n;
-
-	//ratio of refractive indices		
-	float eta = hitInfo.backface ? material->index : 1.0f/material->index;
+	{
+		//too many triangles with the same centroid. split the list in half
+		bestAxis = 0;
+		mid = (begin + end) / 2;
+	}
 	
-	//a normal always opposite the direction of the ray
-	//const vec3f& facingNormal = hitInfo.backface?-normal:normal;
+	assert(depth + 1 < BVH_MAX_DEPTH);
+	rbuildBVH(nodes, indices, itemBounds, centroids, depth + 1, begin, mid);
+	int right = rbuildBVH(nodes, indices, itemBounds, centroids, depth + 1, mid, end);
+	nodes[nodeindex].offset = right;
+	nodes[nodeindex].count = 0;
+	nodes[nodeindex].axis = bestAxis;
+	return nodeindex;
+}
 
-	//child rays will copy the current ray. initialize some common attibs
-	if (hitInfo.time > 0.0000001f && ray.start != hitInfo.pos)
-		newRay.lastHit.clear(); //clear lastHit if ray moved
-	newRay.lastHit.insert(hitInfo.triangle);
-	newRay.start = hitInfo.pos;
-	newRay.canary += 1;
+static void boundsCentroids(const std::vector<TraceScene::Bounds>& bounds, std::vector<vec3f>& centroids)
+{
+	centroids.resize(bounds.size());
+	for (int i = 0; i < (int)bounds.size(); ++i)
+		centroids[i] = (bounds[i].bmin + bounds[i].bmax) * 0.5f;
+}
 
-	//shadow rays. calculate light intensity for this hit point
-	vec3f lightIntensity(0.0f);
-	vec3f specularIntensity(0.0f);
-	vec3f specularReflectionDir;
-	reflect(specularReflectionDir, incidence, normal);
+void TraceScene::buildBVH(std::vector<BVHNode>& nodes, std::vector<uint>& indices, const std::vector<Bounds>& bounds, const std::vector<vec3f>& centroids, int begin, int end)
+{
+	//leaf offsets are relative to indices, which holds indices of bounds
+	indices.resize(end - begin);
+	for (int i = begin; i < end; ++i)
+		indices[i - begin] = i;
 	
-	bool traceShadows = traceFlags & TRACE_CAMERA;
-	if (material->unlit)
+	if (end > begin)
+		rbuildBVH(nodes, indices, bounds, centroids, 0, 0, end - begin);
+}
+
+void TraceScene::buildInstances()
+{
+	//one BVH per prototype in object space, then one over the instances' world bounds
+	std::vector<Bounds> bounds(prototypeTriangles.size());
+	std::vector<vec3f> centroids;
+	for (int i = 0; i < (int)prototypeTriangles.size(); ++i)
+		bounds[i] = triangleBounds(prototypeTriangles[i]);
+	boundsCentroids(bounds, centroids);
+	for (int i = 0; i < (int)prototypes.size(); ++i)
 	{
-		traceShadows = false;
-		lightIntensity = vec3f(1.0f);
+		prototypes[i].bvh.clear();
+		buildBVH(prototypes[i].bvh, prototypes[i].triangles, bounds, centroids, prototypes[i].first, prototypes[i].first + prototypes[i].count);
 	}
 	
-	if (traceShadows)
+	boundsCentroids(instanceBounds, centroids);
+	instanceBVH.clear();
+	buildBVH(instanceBVH, instanceIndices, instanceBounds, centroids, 0, (int)instanceBounds.size());
+}
+
+void TraceScene::buildLights()
+{
+	//a BVH over the area each light's samples cover, with the summed power below each node for pickLight()
+	lightBounds.resize(lights.size());
+	for (int l = 0; l < (int)lights.size(); ++l)
 	{
-		Ray shadowRay = newRay;
-		//FIXME: neet to turn off differential computation
-		memset(shadowRay.d, 0, sizeof(newRay.d));
-		shadowRay.mask |= Ray::SHADOW;
-		HitInfo lightHit;
-		for (int l = 0; l < (int)lights.size(); ++l)
+		for (int i = 0; i < 4; ++i)
 		{
-			float randomAngle = UNIT_RAND * 2.0f * pi;
-			vec2f randomRotate;
-			vec2f randomOffset;
-			if (lights[l].square)
-				randomOffset = vec2f(UNIT_RAND * 2.0f, UNIT_RAND * 2.0f);
-			else
-				randomRotate = vec2f(cos(randomAngle), sin(randomAngle));
-	
-			int startSample = 0;
-			int endSample = ceil((int)lights[l].samples.size(), dof.samples);
-	
-			//use only one random sample for each light if this is GI contribution
-			if (nonPrimary)
-			{
-				startSample = rand() % lights[l].samples.size();
-				endSample = startSample + 1;
-			}
-	
-			//shoot shadow rays towards light
-			for (int sampleIndex = startSample; sampleIndex < endSample; ++sampleIndex)
-			{
-				int s = (sampleOffset + sampleIndex) % lights[l].samples.size();
-	
-				//randomize samples
-				vec2f offset = lights[l].samples[s];
-				if (lights[l].square)
-				{
-					offset += randomOffset;
-					if (offset.x > 1.0f) offset.x -= 2.0f;
-					if (offset.y > 1.0f) offset.y -= 2.0f;
-				}
-				else
-					offset = vec2f(offset.x * randomRotate.x + offset.y * randomRotate.y, -offset.x * randomRotate.y + offset.y * randomRotate.x);
-
-				//initialize shadow ray
-				shadowRay.start = newRay.start;
-				shadowRay.lastHit = newRay.lastHit;
-				shadowRay.end = lights[l].transform * vec4f(offset, 0.0f, 1.0f);
-		
-				//bring back the light sample a little just in case it's in the plane of a triangle
-				shadowRay.dir = shadowRay.end - shadowRay.start;
-				shadowRay.dir *= 0.9999;
-				shadowRay.end = shadowRay.start + shadowRay.dir;
-		
-				//diffuse component for each sample is standard N dot L
-				vec3f lightDir = shadowRay.dir;
-				lightDir.normalize();
-				float diffuseScalar = mymax(0.0f, normal.dot(lightDir));
-		
-				//don't bother for back facing light contribution
-				if (diffuseScalar == 0.0f)
-					continue;
-		
-				//keep intensity value when traversing light occluders - transparency contributes colour
-				//note: intensity.w represents total visibility, used to mix occluder colour
-				vec4f intensity = vec4f(lights[l].intensity, 1.0f);
-			
-				bool found = false;
-				if (shadowRay.dir.sizesq() > 0.001)
-					found = trace(intensity, shadowRay, lightHit, rays, sampleOffset, TRACE_SHADOW | (debugTrace?TRACE_DEBUG:0));
-				
-				/*
-				if ((shadowRay.end - lightHit.pos).sizesq() < 0.001)
-					break;
-		
-				Material* occluderMat = materials[lightHit.triangle->material];
-				vec4f occluderCol = material->colour;
-				if (occluderMat->imgColour)
-					occluderCol *= texture2D(occluderMat->imgColour, lightHit.interp.t);
-				float transmit = 1.0f - occluderCol.w;
-		
-				//intensity = vec4f((intensity * transmit + occluderCol.xyz() * occluderCol.w * intensity.w) * transmit, intensity.w * transmit);
-				intensity *= transmit;
-		
-				if (intensity.w < 1.0f/256.0f)
-				{
-					foundOpaque = true;
-					break;
-				}
-				if (lightHit.time > 0.0000001f && shadowRay.start != lightHit.pos)
-					shadowRay.lastHit.clear();
-				shadowRay.lastHit.insert(lightHit.triangle);
-				shadowRay.start = lightHit.pos;
-				*/
-				
-				//FIXME: rem when delete shadowScale
-				intensity = intensity * shadowScale + vec4f(lights[l].intensity, 1.0f) * (1.0f - shadowScale);
-				
-				//add specular intensity for the hit
-				float specularScalar = pow(mymax(0.0f, specularReflectionDir.dot(lightDir)), material->shininess);
-				specularIntensity += intensity.xyz() * specularScalar;
-		
-				//add diffuse intensity
-				lightIntensity += intensity.xyz() * diffuseScalar;
-			}
-	
-			//normalize number of samples
-			float intensityScalar = 1.0f / (endSample - startSample);
-			lightIntensity *= intensityScalar;
-			specularIntensity *= intensityScalar;
+			vec3f corner = vec3f(lights[l].transform * vec4f((i & 1) ? 1.0f : -1.0f, (i & 2) ? 1.0f : -1.0f, 0.0f, 1.0f));
+			lightBounds[l].bmin = i ? vmin(lightBounds[l].bmin, corner) : corner;
+			lightBounds[l].bmax = i ? vmax(lightBounds[l].bmax, corner) : corner;
 		}
 	}
-
-	//apply absorbtion
-	if (hitInfo.backface && material->transmits)
-	{
-		newRay.intensity.x *= exp(-(1.0f - material->transmit.x) * distance * material->density);
-		newRay.intensity.y *= exp(-(1.0f - material->transmit.y) * distance * material->density);
-		newRay.intensity.z *= exp(-(1.0f - material->transmit.z) * distance * material->density);
-	}
-	
-	
-	
-	//find tangents to the reflect direction
-	vec3f u, v;
-	createTangents(normal, u, v);
-		
-	//random rotation so gloss rays don't align
-	float a = UNIT_RAND*2.0f*pi;
-	float ca = cos(a);
-	float sa = sin(a);
-	
-	bool isGlossy = material->gloss < 1.0f;
-	int glossRays = (isGlossy && !hasBounced && !isGlobal) ? gloss.samples : 1;
-	vec4f glossIntensity = newRay.intensity * vec4f(vec3f(1.0f / glossRays), 1.0f);
-	for (int i = 0; i < glossRays; ++i)
+	std::vector<vec3f> centroids;
+	boundsCentroids(lightBounds, centroids);
+	lightBVH.clear();
+	buildBVH(lightBVH, lightIndices, lightBounds, centroids, 0, (int)lightBounds.size());
+	
+	//children always follow their parent, so a reverse pass sums bottom up
+	lightPower.resize(lightBVH.size());
+	for (int i = (int)lightBVH.size() - 1; i >= 0; --i)
 	{
-		vec3f glossyNormal;			
-		if (isGlossy)
+		const BVHNode& node = lightBVH[i];
+		if (node.count)
 		{
-			//FIXME: may generate back-facing normal
-			vec3f sampleDir = gloss.normalOffsets[i];
-			sampleDir.x *= 1.0f - material->gloss;
-			sampleDir.y *= 1.0f - material->gloss;
-			sampleDir.normalize();
-			glossyNormal = vec3f(sampleDir.x * ca + sampleDir.y * sa, -sampleDir.x * sa + sampleDir.y * ca, sampleDir.z);
-			glossyNormal = u * glossyNormal.x + v * glossyNormal.y + normal * glossyNormal.z;
-			glossyNormal.normalize();
-			newRay.intensity = glossIntensity;
+			lightPower[i] = 0.0f;
+			for (uint j = node.offset; j < node.offset + node.count; ++j)
+				lightPower[i] += lightPowerOf(lights[lightIndices[j]]);
 		}
 		else
-			glossyNormal = normal;
+			lightPower[i] = lightPower[i + 1] + lightPower[node.offset];
+	}
+	lightsBuilt = lightsKey();
+}
 
-		//FIXME: something's wrong here when there's no material->transmits
-		//calculate fresnel ratio
-		float reflectance;
-		if (material->transmits)// && material->reflects)
-		{
-			if (hitInfo.backface)
-				fresnel(reflectance, incidence, -hitInfo.interp.n, material->index, 1.0f);
-			else
-				fresnel(reflectance, incidence, hitInfo.interp.n, 1.0f, material->index);
-			//reflectance = pow(reflectance, 1.0f/1.2f);
-		}
-		else
-			reflectance = material->reflects ? 1.0f : 0.0f;
+static void materialFlags(Material* material)
+{
+	material->transmits = material->transmit.sizesq() != 0.0f;
+	material->reflects = material->reflect.sizesq() != 0.0f;
+	material->opaque = material->colour.w >= 1.0f &&
+		(material->imgColour.mipmaps.size() == 0 || material->imgColour.mipmaps[0]->channels < 4);
+}
 
-		//create reflect ray
-		if ((material->reflects || (material->transmits && ((ray.mask & Ray::REFRACT) > 0))) && reflectance > 0.0f)
-		{
-			vec3f reflectDir;
-			reflect(reflectDir, incidence, glossyNormal);
-	
-			if (reflectDir.dot(hitInfo.triangle->n) < 0.0)
-			{
-				reflect(reflectDir, reflectDir, hitInfo.triangle->n);
-				//newRay.intensity.x = 1.0f; //for debugging
-			}
+void TraceScene::build()
+{
+	MyTimer timer;
+	timer.time();
 	
-			Ray reflectRay = newRay;
-			reflectRay.mask |= Ray::REFLECT;
-			reflectRay.end = reflectRay.start + reflectDir * 100.0f;
-			if ((ray.mask & Ray::REFRACT) > 0) //FIXME: sets reflect colour to white if already refracted for TIR. physically OK?
-				reflectRay.intensity = newRay.intensity * reflectance;
-			else
-				reflectRay.intensity = newRay.intensity * vec4f(material->reflect, 1.0) * reflectance;
-			reflectRay.depth += 1;
-			reflectRay.reflect(hitInfo, incidence, normalDerivs);
-			rays.push(reflectRay);
+	bool loaded = false;
+	printf("Building %s\n", (accel == ACCEL_BVH) ? "BVH" : "KD Tree");
 	
-			newRay.intensity *= (1.0 - reflectance);
-		}
-
-		//create refract ray
-		if (material->transmits && reflectance < 1.0f)
-		{
-			vec3f refractDir;
-			refract(refractDir, incidence, hitInfo.backface?-glossyNormal:glossyNormal, eta);
+	treeMemory.clear();
+	tree = NULL;
+	treeNodes = 0;
+	buildCacheFile.close();
+	blockData = NULL;
+	bvh.clear();
+	blocks.clear();
+	triangles.clear();
 	
-			if (refractDir.dot(hitInfo.backface?-hitInfo.triangle->n:hitInfo.triangle->n) > 0.0)
-			{
-				reflect(refractDir, refractDir, hitInfo.triangle->n);
-				newRay.intensity.x = 1.0f; //for debugging
-			}
-		
-			Ray refractRay = newRay;
-			refractRay.mask |= Ray::REFRACT;
-			refractRay.end = refractRay.start + refractDir * 100.0f;
-			refractRay.intensity = newRay.intensity;
-			refractRay.depth += 1;
-			refractRay.refract(hitInfo, incidence, normalDerivs, eta);
-			/*for (int i = 0; i < 4; ++i)
-			{
-				if (hitInfo.backface)
-					refract(refractRay.d[i].D, refractRay.d[i].D + incidence, -hitInfo.interp.n - normalDerivs[i], eta);
-				else
-					refract(refractRay.d[i].D, refractRay.d[i].D + incidence, hitInfo.interp.n + normalDerivs[i], eta);
-				refractRay.d[i].D -= refractDir;
-			}*/
-			rays.push(refractRay);
+	//photons from the last render may hit triangles that have changed
+	sampled = 0;
 	
-			newRay.intensity = vec4f(0.0f);
-		}
-	} //end glossy rays
-
-	if (traceFlags & TRACE_CAMERA)
+	//the default material never goes through addMesh(), and others may have been edited since
+	shootPhotons = false;
+	for (int i = 0; i < (int)materials.size(); ++i)
 	{
-		//lightIntensity = vec3f(0.0f);
+		materialFlags(materials[i]);
+		shootPhotons = shootPhotons || materials[i]->transmits || materials[i]->reflects;
+	}
 	
-		//sample photons
-		if (photonTree && photonPoints.size())
-		{
-			//FIXME: replace with derivative bounds
-			const float rayRadius = 0.00001;//(newRay.d[0].P.size() + newRay.d[1].P.size() + newRay.d[2].P.size() + newRay.d[3].P.size()) * 0.25f;
-			float falloff = 6.0;
-			std::vector<int> results;
-			//KDTreeIterator iter = photonTree->find((float*)&hitInfo.pos, pr);
-			photonTree->find(results, hitInfo.pos - rayRadius, hitInfo.pos + rayRadius);
-			
-			for (int i = 0; i < (int)results.size(); ++i)
-			{
-				int n = results[i];
-				vec3f& pos = photonPoints[n];
-				Photon& info = photonInfo[n];
-				//fixme: light scattering from solid object should be brighter?
-				float backScale = info.hit.backface?1.0f:-1.0f;
-				float diffuseScalar = mymax(0.0f, backScale * normal.dot(info.dir));
-				float dist = falloff * (pos - hitInfo.pos).size() / info.radius;
-				float att = mymax(0.0, 1.0 / (1.0 + dist) - 1.0 / (1.0 + falloff));
-				//colour += newRay.intensity * vec4f(info.colour * diffuseScalar * att, 0.0f);// / (float)photons.emit;
-				lightIntensity += vec3f(info.colour * diffuseScalar * att);
-			}
+	//instances and lights always use BVHs. buildStats covers the scene's structure only
+	buildInstances();
+	buildLights();
+	buildStats = BuildStats();
+	
+	if (accel == ACCEL_KDTREE)
+	{
+		//a tree saved for the same triangles and costs is mapped in rather than rebuilt
+		uint64_t key = 0;
+		std::string filename;
+		if (buildCache.size() && !debug)
+		{
+			key = buildKey();
+			char name[32];
+			sprintf(name, "%016llx.kdtree", (unsigned long long)key);
+			filename = joinPath(buildCache, name);
+		}
+		loaded = filename.size() && loadKDTree(filename, key);
+		if (!loaded && buildKDTree())
+		{
+			blockData = blocks.size() ? &blocks[0] : NULL;
+			if (filename.size())
+				saveKDTree(filename, key);
+		}
+		else if (!loaded)
+		{
+			//node offsets overflowed. the layout is unusable, so trace with a BVH instead
+			printf("Falling back to a BVH\n");
+			treeMemory.clear();
+			tree = NULL;
+			treeNodes = 0;
+			blocks.clear();
+			triangles.clear();
+			buildStats = BuildStats();
+			accel = ACCEL_BVH;
 		}
-		
-		vec4f col = newRay.intensity * vec4f(ambientColour + diffuseColour.xyz() * lightIntensity + specularColour * specularIntensity, diffuseColour.w);
-		
-		#if 1
-		if (ray.mask & Ray::GLOBAL)
-			colour += vec4f(col.xyz() * col.w, 0.0f);
-		else
-			colour += vec4f(col.xyz() * col.w, col.w);
-		#endif
 	}
 	
-	if (insertPhoton)
+	if (accel == ACCEL_BVH)
 	{
-		Photon p;
-		//FIXME: replace with derivative bounds
-		p.radius = mymax(mymax(newRay.d[0].P.size(), newRay.d[1].P.size()), mymax(newRay.d[2].P.size(), newRay.d[3].P.size()));
-		p.colour = newRay.intensity * 1.0 / p.radius;
-		p.dir = incidence;
-		p.hit = hitInfo;
-		photonPoints.push_back(hitInfo.pos);
-		photonInfo.push_back(p);
+		//triangle bounds are only needed while building, so they're recomputed rather than kept from addMesh()
+		std::vector<Bounds> bounds(triangleData.size());
+		std::vector<vec3f> centroids;
+		for (int i = 0; i < (int)triangleData.size(); ++i)
+			bounds[i] = triangleBounds(triangleData[i]);
+		boundsCentroids(bounds, centroids);
+		buildBVH(bvh, triangles, bounds, centroids, 0, (int)bounds.size());
+		buildStats.nodes = (int)bvh.size();
 	}
-
-	//emit global illumination rays
-	//if the ray intensity is low, don't bother
-	//if the material reflects, the surfaceTexture or "gloss" parameter takes over. dont' trace GI
-	//if the ray is already a GI ray, only emit more if below the max depth
-	bool traceGI = gi.samples > 0 && gi.maxDepth > 0;
-	if (traceGI && diffuseColour.w > 1.0f/255.0f && !material->reflects && (traceFlags & TRACE_CAMERA) && (!(ray.mask & Ray::GLOBAL) || ray.depth < gi.maxDepth))
-	{
-		vec4f giBaseIntensity = newRay.intensity * vec4f(diffuseColour.xyz() * diffuseColour.w, diffuseColour.w);
 	
-		Ray giRay = newRay;
-		if (giRay.mask & Ray::GLOBAL)
-			giRay.depth += 1; //already a GI ray, it's recursing exponentially
-		else
-			giRay.depth = 1; //reset depth count - it's just become a GI ray
-		giRay.mask |= Ray::GLOBAL;
+	buildStats.references = (int)triangles.size();
+	buildStats.time = timer.time();
+	
+	printf("%s %s\n", loaded ? "Loaded" : "Created", (accel == ACCEL_BVH) ? "BVH" : "KD Tree");
+	printf("\t%i nodes\n", buildStats.nodes);
+	printf("\t%i total leaves\n", buildStats.leaves);
+	printf("\t%i total prims\n", (int)triangleData.size());
+	printf("\t%i prims in leaves\n", buildStats.references);
+	printf("\t%i max leaf size\n", buildStats.maxLeafSize);
+	printf("\t%i max depth\n", buildStats.maxDepth);
+	if (instances.size())
+		printf("\t%i instances of %i meshes, %i prims\n", (int)instances.size(), (int)prototypes.size(), (int)prototypeTriangles.size());
+	if (accel == ACCEL_KDTREE)
+		printf("\t%i padding nodes\n", buildStats.padding);
+	printf("\tTime: %f\n", buildStats.time);
+}
+
+void TraceScene::TraceStats::operator+=(const TraceStats& other)
+{
+	rays += other.rays;
+	cameraRays += other.cameraRays;
+	globalRays += other.globalRays;
+	photonRays += other.photonRays;
+	nodes += other.nodes;
+	leaves += other.leaves;
+	triangleTests += other.triangleTests;
+	shadowRays += other.shadowRays;
+	orderedShadowRays += other.orderedShadowRays;
+	packets += other.packets;
+	divergentPackets += other.divergentPackets;
+	waveRays += other.waveRays;
+	irradianceHits += other.irradianceHits;
+	irradianceRecords += other.irradianceRecords;
+	queryRays += other.queryRays;
+}
+
+void TraceScene::addStats(const TraceStats& stats)
+{
+	statsMutex.lock();
+	traceStats += stats;
+	statsMutex.unlock();
+}
+
+TraceScene::Stats TraceScene::getStats()
+{
+	Stats ret;
+	ret.accel = accel;
+	ret.build = buildStats;
+	statsMutex.lock();
+	ret.trace = traceStats;
+	statsMutex.unlock();
+	return ret;
+}
+
+void TraceScene::resetStats()
+{
+	statsMutex.lock();
+	traceStats = TraceStats();
+	statsMutex.unlock();
+}
+
+float TraceScene::Ray::transfer(const TraceScene::HitInfo& hitInfo, const vec3f& incidence)
+{
+	float t = (hitInfo.pos - start).size();
+	const vec3f& N = hitInfo.interp.n;
+	
+	for (int i = 0; i < 4; ++i)
+	{
+		vec3f newP = d[i].P + d[i].D * t;
+		vec3f DD = incidence + d[i].D;
+		DD.normalize();
+		float dtdd = -N.dot(newP) / N.dot(DD);
+		d[i].P += d[i].D * t + DD * dtdd;
+	}
+	return t;
+}
+
+void TraceScene::Ray::reflect(const TraceScene::HitInfo& surface, const vec3f& incidence, const vec3f (&curve)[4])
+{
+	const vec3f& N = surface.backface?-surface.interp.n:surface.interp.n;
+	
+	float dn = incidence.dot(N);
+	for (int i = 0; i < 4; ++i)
+	{
+		float dndx = d[i].D.dot(N) + incidence.dot(curve[i]);
+		d[i].D = d[i].D - (curve[i] * dn + N * dndx) * 2.0f;
+	}
+}
+
+void TraceScene::Ray::refract(const TraceScene::HitInfo& surface, const vec3f& incidence, const vec3f (&curve)[4], float eta)
+{
+	const vec3f& N = surface.backface?-surface.interp.n:surface.interp.n;
+	
+	float dn = incidence.dot(N);
+	float dis = 1.0f - eta*eta * (1.0 - dn * dn);
+	float ddn = -sqrt(dis);
+	float mu = eta*dn - ddn;
+	
+	for (int i = 0; i < 4; ++i)
+	{
+		float dndx = d[i].D.dot(N) + incidence.dot(curve[i]);
+		float mudx = (eta - eta*eta*dn/ddn) * dndx;
+		d[i].D = d[i].D * eta - (curve[i] * mu + N * mudx);
+	}
+}
+
+void TraceScene::Ray::tangentDiff(const TraceScene::HitInfo& surface, const Triangle& triangle, const Vertex& a, const Vertex& b, const Vertex& c, vec3f (&curve)[4], vec2f (&area)[4])
+{
+	const vec3f& N = surface.interp.n;
+	for (int i = 0; i < 4; ++i)
+	{
+		vec3f wd = surface.pos + d[i].P - triangle.a;
+		float d_wvdx = vecDot(wd, triangle.v);
+		float d_wudx = vecDot(wd, triangle.u);
+		vec3f bd;
+		bd.x = (triangle.d_uv*d_wvdx - triangle.d_vv*d_wudx) / triangle.uvuuvv;
+		bd.y = (triangle.d_uv*d_wudx - triangle.d_uu*d_wvdx) / triangle.uvuuvv;
+		bd.z = surface.s + surface.t - bd.x - bd.y;
+		bd.x -= surface.s;
+		bd.y -= surface.t;
+		curve[i] = (a.n * bd.x + b.n * bd.y + c.n * bd.z);
+		curve[i] -= N * N.dot(curve[i]);
+		if (surface.backface) //FIXME: this seems a little unintuitive - normal derivs are negated for backfaces for refraction and reflection
+			curve[i] = -curve[i];
+		area[i] = a.t * bd.x + b.t * bd.y + c.t * bd.z;
+	}
+}
+
+static float lightImportance(const TraceScene::Bounds& bounds, float power, const vec3f& pos, const vec3f& normal)
+{
+	//lights don't fall off with distance here, so only N.L varies. bound it over the box's bounding sphere
+	vec3f centre = (bounds.bmin + bounds.bmax) * 0.5f;
+	float radius = (bounds.bmax - bounds.bmin).size() * 0.5f;
+	vec3f toCentre = centre - pos;
+	float dist = toCentre.size();
+	if (dist <= radius)
+		return power;
+	float cosAxis = normal.dot(toCentre) / dist;
+	float sinCone = radius / dist;
+	float cosCone = sqrt(1.0f - sinCone * sinCone);
+	if (cosAxis >= cosCone)
+		return power;
+	
+	//cosine of the angle from the normal to the nearest edge of the cone
+	float sinAxis = sqrt(mymax(0.0f, 1.0f - cosAxis * cosAxis));
+	return power * mymax(0.0f, cosAxis * cosCone + sinAxis * sinCone);
+}
+
+int TraceScene::pickLight(TraceContext& context, const vec3f& pos, const vec3f& normal, float& pdf)
+{
+	//one path down the light tree, choosing children by their importance
+	pdf = 1.0f;
+	int node = 0;
+	while (!lightBVH[node].count)
+	{
+		int left = node + 1;
+		int right = lightBVH[node].offset;
+		float a = lightImportance(lightBVH[left].bounds, lightPower[left], pos, normal);
+		float b = lightImportance(lightBVH[right].bounds, lightPower[right], pos, normal);
+		if (a + b <= 0.0f)
+			return -1;
+		float p = a / (a + b);
+		if (context.random.unit() < p)
+		{
+			node = left;
+			pdf *= p;
+		}
+		else
+		{
+			node = right;
+			pdf *= 1.0f - p;
+		}
+	}
+	
+	//leaves hold a few lights, picked the same way. importance is cheap, so it's recomputed rather than stored
+	const BVHNode& leaf = lightBVH[node];
+	float total = 0.0f;
+	for (uint j = leaf.offset; j < leaf.offset + leaf.count; ++j)
+		total += lightImportance(lightBounds[lightIndices[j]], lightPowerOf(lights[lightIndices[j]]), pos, normal);
+	if (total <= 0.0f)
+		return -1;
+	float r = context.random.unit() * total;
+	uint pick = leaf.offset;
+	float importance = 0.0f;
+	for (uint j = leaf.offset; j < leaf.offset + leaf.count; ++j)
+	{
+		float i = lightImportance(lightBounds[lightIndices[j]], lightPowerOf(lights[lightIndices[j]]), pos, normal);
+		if (i <= 0.0f)
+			continue;
+		pick = j;
+		importance = i;
+		if (r < i)
+			break;
+		r -= i;
+	}
+	pdf *= importance / total;
+	return lightIndices[pick];
+}
+
+void TraceScene::addLightSample(TraceContext& context, const Ray& from, Ray& shadowRay, TraceStack& rays, int sampleOffset, bool debugTrace,
+	int light, vec2f offset, const vec3f& normal, const vec3f& specularReflectionDir, float shininess, float weight, vec3f& lightIntensity, vec3f& specularIntensity)
+{
+	HitInfo lightHit;
+	
+	//initialize shadow ray
+	shadowRay.start = from.start;
+	shadowRay.lastHit = from.lastHit;
+	shadowRay.end = lights[light].transform * vec4f(offset, 0.0f, 1.0f);
+
+	//bring back the light sample a little just in case it's in the plane of a triangle
+	shadowRay.dir = shadowRay.end - shadowRay.start;
+	shadowRay.dir *= 0.9999;
+	shadowRay.end = shadowRay.start + shadowRay.dir;
+
+	//diffuse component for each sample is standard N dot L
+	vec3f lightDir = shadowRay.dir;
+	lightDir.normalize();
+	float diffuseScalar = mymax(0.0f, normal.dot(lightDir));
+
+	//don't bother for back facing light contribution
+	if (diffuseScalar == 0.0f)
+		return;
+
+	//keep intensity value when traversing light occluders - transparency contributes colour
+	//note: intensity.w represents total visibility, used to mix occluder colour
+	vec4f intensity = vec4f(lights[light].intensity, 1.0f);
+
+	//an opaque occluder anywhere blocks the light, so there's no need to find the nearest. only
+	//transmissive occluders need processing in order, and debug traces to record every hit
+	bool found = false;
+	if (shadowRay.dir.sizesq() > 0.001)
+	{
+		if (debugTrace)
+			found = trace(context, intensity, shadowRay, lightHit, rays, sampleOffset, TRACE_SHADOW | TRACE_DEBUG);
+		else
+		{
+			++context.stats.rays;
+			++context.stats.shadowRays;
+			found = intersectAny(context, shadowRay, lightHit);
+			if (found && materials[shading(lightHit).material]->opaque)
+				intensity = vec4f(0.0f);
+			else if (found)
+			{
+				++context.stats.orderedShadowRays;
+				found = intersect(context, shadowRay, lightHit, NULL) && shade(context, intensity, shadowRay, lightHit, rays, sampleOffset, TRACE_SHADOW);
+			}
+		}
+	}
+	
+	/*
+	if ((shadowRay.end - lightHit.pos).sizesq() < 0.001)
+		break;
+
+	Material* occluderMat = materials[shading(lightHit).material];
+	vec4f occluderCol = material->colour;
+	if (occluderMat->imgColour)
+		occluderCol *= texture2D(occluderMat->imgColour, lightHit.interp.t);
+	float transmit = 1.0f - occluderCol.w;
+
+	//intensity = vec4f((intensity * transmit + occluderCol.xyz() * occluderCol.w * intensity.w) * transmit, intensity.w * transmit);
+	intensity *= transmit;
+
+	if (intensity.w < 1.0f/256.0f)
+	{
+		foundOpaque = true;
+		break;
+	}
+	if (lightHit.time > 0.0000001f && shadowRay.start != lightHit.pos)
+		shadowRay.lastHit.clear();
+	shadowRay.lastHit.insert(lightHit.triangle);
+	shadowRay.start = lightHit.pos;
+	*/
+	
+	//FIXME: rem when delete shadowScale
+	intensity = intensity * shadowScale + vec4f(lights[light].intensity, 1.0f) * (1.0f - shadowScale);
+	
+	//add specular intensity for the hit
+	float specularScalar = pow(mymax(0.0f, specularReflectionDir.dot(lightDir)), shininess);
+	specularIntensity += intensity.xyz() * (specularScalar * weight);
+
+	//add diffuse intensity
+	lightIntensity += intensity.xyz() * (diffuseScalar * weight);
+}
+
+void TraceScene::gatherPhotons(TraceContext& context, const vec3f& at, const vec3f& normal, vec3f& lightIntensity)
+{
+	//each photon splats over its own radius, so gather the photons covering the hit
+	float falloff = 6.0;
+	std::vector<int>& results = context.photonResults;
+	photonMap.covers(at, results);
+	
+	for (int i = 0; i < (int)results.size(); ++i)
+	{
+		int n = results[i];
+		vec3f& pos = photonPoints[n];
+		Photon& info = photonInfo[n];
+		//fixme: light scattering from solid object should be brighter?
+		float backScale = info.hit.backface?1.0f:-1.0f;
+		float diffuseScalar = mymax(0.0f, backScale * normal.dot(info.dir));
+		float dist = falloff * (pos - at).size() / info.radius;
+		float att = mymax(0.0, 1.0 / (1.0 + dist) - 1.0 / (1.0 + falloff));
+		//colour += newRay.intensity * vec4f(info.colour * diffuseScalar * att, 0.0f);// / (float)photons.emit;
+		lightIntensity += vec3f(info.colour * diffuseScalar * att);
+	}
+}
+
+void TraceScene::sampleLights(TraceContext& context, const Ray& from, const vec3f& normal, const vec3f& specularReflectionDir, float shininess, bool nonPrimary,
+	TraceStack& rays, int sampleOffset, bool debugTrace, vec3f& lightIntensity, vec3f& specularIntensity)
+{
+	Ray shadowRay = from;
+	//FIXME: neet to turn off differential computation
+	memset(shadowRay.d, 0, sizeof(shadowRay.d));
+	shadowRay.mask |= Ray::SHADOW;
+	if ((int)lights.size() > lightSampling.minLights && lightBVH.size())
+	{
+		//too many lights to visit each one. a few are picked from the light tree, in proportion to what they could add
+		int count = nonPrimary ? 1 : mymax(1, ceil(lightSampling.samples, dof.samples));
+		for (int i = 0; i < count; ++i)
+		{
+			float pdf;
+			int l = pickLight(context, from.start, normal, pdf);
+			if (l < 0)
+				break; //every light is behind the surface
+			
+			vec2f offset = lights[l].samples[context.random.range((int)lights[l].samples.size())];
+			if (lights[l].square)
+			{
+				offset.x += context.random.unit() * 2.0f;
+				offset.y += context.random.unit() * 2.0f;
+				if (offset.x > 1.0f) offset.x -= 2.0f;
+				if (offset.y > 1.0f) offset.y -= 2.0f;
+			}
+			else
+			{
+				float angle = context.random.unit() * 2.0f * pi;
+				vec2f rotate(cos(angle), sin(angle));
+				offset = vec2f(offset.x * rotate.x + offset.y * rotate.y, -offset.x * rotate.y + offset.y * rotate.x);
+			}
+			addLightSample(context, from, shadowRay, rays, sampleOffset, debugTrace, l, offset, normal, specularReflectionDir, shininess, 1.0f / (pdf * count), lightIntensity, specularIntensity);
+		}
+	}
+	else for (int l = 0; l < (int)lights.size(); ++l)
+	{
+		float randomAngle = context.random.unit() * 2.0f * pi;
+		vec2f randomRotate;
+		vec2f randomOffset;
+		if (lights[l].square)
+		{
+			randomOffset.x = context.random.unit() * 2.0f;
+			randomOffset.y = context.random.unit() * 2.0f;
+		}
+		else
+			randomRotate = vec2f(cos(randomAngle), sin(randomAngle));
+
+		int startSample = 0;
+		int endSample = ceil((int)lights[l].samples.size(), dof.samples);
+
+		//use only one random sample for each light if this is GI contribution
+		if (nonPrimary)
+		{
+			startSample = context.random.range((int)lights[l].samples.size());
+			endSample = startSample + 1;
+		}
+
+		//shoot shadow rays towards light. samples are averaged per light, so each light adds its full intensity
+		float weight = 1.0f / (endSample - startSample);
+		for (int sampleIndex = startSample; sampleIndex < endSample; ++sampleIndex)
+		{
+			int s = (sampleOffset + sampleIndex) % lights[l].samples.size();
+
+			//randomize samples
+			vec2f offset = lights[l].samples[s];
+			if (lights[l].square)
+			{
+				offset += randomOffset;
+				if (offset.x > 1.0f) offset.x -= 2.0f;
+				if (offset.y > 1.0f) offset.y -= 2.0f;
+			}
+			else
+				offset = vec2f(offset.x * randomRotate.x + offset.y * randomRotate.y, -offset.x * randomRotate.y + offset.y * randomRotate.x);
+
+			addLightSample(context, from, shadowRay, rays, sampleOffset, debugTrace, l, offset, normal, specularReflectionDir, shininess, weight, lightIntensity, specularIntensity);
+		}
+	}
+}
+
+bool TraceScene::hitSurface(TraceContext& context, vec4f& colour, Ray& ray, HitInfo& hitInfo, TraceStack& rays, int sampleOffset, int traceFlags)
+{
+	bool isPhoton = ((traceFlags & TRACE_PHOTON) > 0);
+	bool hasBounced = (ray.mask & (Ray::REFLECT | Ray::REFRACT)) != 0;
+	bool debugTrace = ((traceFlags & TRACE_DEBUG) > 0);
+	bool insertPhoton = isPhoton && hasBounced;
+	bool lowIntensity = ray.intensity.x + ray.intensity.y + ray.intensity.z + ray.intensity.w < 0.1f;
+	bool isGlobal = (ray.mask & Ray::GLOBAL) > 0;
+	bool nonPrimary = isGlobal || lowIntensity;
+	
+	//if (lowIntensity)
+	//	return true;
+	
+	//don't use multiple texture samples for GI rays - too expensive
+	bool singleSample = nonPrimary;
+
+	//calculate normalized incidense vector
+	vec3f incidence = ray.dir;
+	incidence.normalize();
+
+	//copy ray and compute differentials
+	//FIXME: how the hell do I incorporate normal maps? since they may be sampled differently due to the differentials
+	Ray newRay = ray;
+	float distance = newRay.transfer(hitInfo, incidence);
+	
+	/*
+	vec3f bdx, bdy; //barycentric derivatives - xyz = s, t, 1-s-t
+	if (true)
+	{
+		Triangle& triangle = *hitInfo.triangle;
+		vec3f wdx = hitInfo.pos + newRay.dx.P - triangle.a;
+		vec3f wdy = hitInfo.pos + newRay.dy.P - triangle.a;
+		float d_wvdx = vecDot(wdx, triangle.v);
+		float d_wudx = vecDot(wdx, triangle.u);
+		float d_wvdy = vecDot(wdy, triangle.v);
+		float d_wudy = vecDot(wdy, triangle.u);
+		bdx.x = (triangle.d_uv*d_wvdx - triangle.d_vv*d_wudx) / triangle.uvuuvv;
+		bdx.y = (triangle.d_uv*d_wudx - triangle.d_uu*d_wvdx) / triangle.uvuuvv;
+		bdy.x = (triangle.d_uv*d_wvdy - triangle.d_vv*d_wudy) / triangle.uvuuvv;
+		bdy.y = (triangle.d_uv*d_wudy - triangle.d_uu*d_wvdy) / triangle.uvuuvv;
+		bdx.z = hitInfo.s + hitInfo.t - bdx.x - bdx.y;
+		bdy.z = hitInfo.s + hitInfo.t - bdy.x - bdy.y;
+		bdx.x -= hitInfo.s;
+		bdx.y -= hitInfo.t;
+		bdy.x -= hitInfo.s;
+		bdy.y -= hitInfo.t;
+	}
+	
+	vec2f dTdx = vertexData[hitInfo.triangle->verts[1]].t * bdx.x + vertexData[hitInfo.triangle->verts[2]].t * bdx.y + vertexData[hitInfo.triangle->verts[0]].t * bdx.z;
+	vec2f dTdy = vertexData[hitInfo.triangle->verts[1]].t * bdy.x + vertexData[hitInfo.triangle->verts[2]].t * bdy.y + vertexData[hitInfo.triangle->verts[0]].t * bdy.z;
+	*/
+	
+	Triangle triangle;
+	Vertex verts[3];
+	surfaceTriangle(hitInfo, triangle, verts);
+	
+	vec3f normalDerivs[4];
+	vec2f sampleArea[4];
+	newRay.tangentDiff(hitInfo, triangle, verts[1], verts[2], verts[0], normalDerivs, sampleArea);
+
+	vec3f normal;
+	
+	if (debugTrace && (!isPhoton || insertPhoton))
+	{
+		debugMutex.lock();
+		for (float x = 0; x <= 1; x += 0.1)
+		{
+			vec3f x1 = interpLinear(newRay.d[0].P, newRay.d[3].P, x);
+			vec3f x2 = interpLinear(newRay.d[1].P, newRay.d[2].P, x);
+			for (float y = 0; y <= 1; y += 0.1)
+			{
+				debugPoints.push_back(hitInfo.pos + interpLinear(x1, x2, y));
+			}
+		}
+		
+		for (int i = 0; i < 4; ++i)
+		{
+			Ray tmp = newRay;
+			tmp.mask |= Ray::DEBUG1;
+			tmp.d[0] = Ray::Diff(vec3f(0.0f), vec3f(0.0f));
+			tmp.d[1] = Ray::Diff(vec3f(0.0f), vec3f(0.0f));
+			tmp.d[2] = Ray::Diff(vec3f(0.0f), vec3f(0.0f));
+			tmp.d[3] = Ray::Diff(vec3f(0.0f), vec3f(0.0f));
+			tmp.start = hitInfo.pos + newRay.d[i].P + hitInfo.interp.n * 0.1;
+			tmp.end = hitInfo.pos + newRay.d[i].P + (hitInfo.interp.n + normalDerivs[i] * 10.0) * 0.1;
+			debugRays.push_back(tmp);
+		}
+		
+		debugRays.push_back(newRay);
+		debugRays.back().end = hitInfo.pos;
+		debugMutex.unlock();
+	}
+
+	Material* material = materials[shading(hitInfo).material];
+	vec3f specularColour = material->specular;
+	vec4f diffuseColour = material->colour;
+	vec3f ambientColour = material->ambient;
+	if (material->imgColour.mipmaps.size())
+	{
+		vec4f textureColour;
+		if (singleSample)
+			textureColour = texture2D(&material->imgColour, hitInfo.interp.t, 0);
+		else
+			textureColour = texture2D(&material->imgColour, hitInfo.interp.t, sampleArea);
+		diffuseColour *= textureColour;
+		ambientColour *= textureColour.xyz();
+	}
+	
+	//hold up. if this was a shadow ray we just care about transparency, nothing else
+	if (traceFlags & TRACE_SHADOW)
+	{
+		float t = 1.0f - diffuseColour.w;
+		colour *= t;
+		if (t < 1.0f/255.0f)
+			return true;
+		return false;
+	}
+	
+	if (material->imgNormal.mipmaps.size())
+	{
+		vec3f biNormal = hitInfo.interp.ts.cross(hitInfo.interp.n).unit();
+		vec3f tangent = hitInfo.interp.n.cross(biNormal).unit();
+		if (singleSample)
+			normal = texture2D(&material->imgNormal, hitInfo.interp.t, 0).xyz() * 2.0f - 1.0f;
+		else
+			normal = texture2D(&material->imgNormal, hitInfo.interp.t, sampleArea).xyz() * 2.0f - 1.0f;
+		normal.normalize();
+		normal = tangent * normal.x + hitInfo.interp.n * normal.z + biNormal * normal.y;
+	}
+	else
+		normal = hitInfo.interp.n;
+	
+	//normal = hitInfo.triangle->n;
+
+	//ratio of refractive indices		
+	float eta = hitInfo.backface ? material->index : 1.0f/material->index;
+	
+	//a normal always opposite the direction of the ray
+	//const vec3f& facingNormal = hitInfo.backface?-normal:normal;
+
+	//child rays will copy the current ray. initialize some common attibs
+	if (hitInfo.time > 0.0000001f && ray.start != hitInfo.pos)
+		newRay.lastHit.clear(); //clear lastHit if ray moved
+	newRay.lastHit.insert(hitInfo.triangle, hitInfo.instance);
+	newRay.start = hitInfo.pos;
+	newRay.canary += 1;
+
+	//shadow rays. calculate light intensity for this hit point
+	vec3f lightIntensity(0.0f);
+	vec3f specularIntensity(0.0f);
+	vec3f specularReflectionDir;
+	reflect(specularReflectionDir, incidence, normal);
+	
+	bool preview = traceFlags & TRACE_PREVIEW;
+	bool traceShadows = (traceFlags & TRACE_CAMERA) && !preview;
+	if (material->unlit)
+	{
+		traceShadows = false;
+		lightIntensity = vec3f(1.0f);
+	}
+	else if (preview)
+		lightIntensity = vec3f(myabs(normal.dot(incidence))); //a headlight shows the shape without any shadow rays
+	
+	if (traceShadows)
+		sampleLights(context, newRay, normal, specularReflectionDir, material->shininess, nonPrimary, rays, sampleOffset, debugTrace, lightIntensity, specularIntensity);
+
+	//apply absorbtion
+	if (hitInfo.backface && material->transmits)
+	{
+		newRay.intensity.x *= exp(-(1.0f - material->transmit.x) * distance * material->density);
+		newRay.intensity.y *= exp(-(1.0f - material->transmit.y) * distance * material->density);
+		newRay.intensity.z *= exp(-(1.0f - material->transmit.z) * distance * material->density);
+	}
+	
+	
+	
+	//find tangents to the reflect direction
+	vec3f u, v;
+	createTangents(normal, u, v);
+		
+	//random rotation so gloss rays don't align
+	float a = context.random.unit()*2.0f*pi;
+	float ca = cos(a);
+	float sa = sin(a);
+	
+	bool isGlossy = material->gloss < 1.0f;
+	int glossRays = (isGlossy && !hasBounced && !isGlobal) ? gloss.samples : 1;
+	vec4f glossIntensity = newRay.intensity * vec4f(vec3f(1.0f / glossRays), 1.0f);
+	for (int i = 0; i < glossRays; ++i)
+	{
+		vec3f glossyNormal;			
+		if (isGlossy)
+		{
+			//FIXME: may generate back-facing normal
+			vec3f sampleDir = gloss.normalOffsets[i];
+			sampleDir.x *= 1.0f - material->gloss;
+			sampleDir.y *= 1.0f - material->gloss;
+			sampleDir.normalize();
+			glossyNormal = vec3f(sampleDir.x * ca + sampleDir.y * sa, -sampleDir.x * sa + sampleDir.y * ca, sampleDir.z);
+			glossyNormal = u * glossyNormal.x + v * glossyNormal.y + normal * glossyNormal.z;
+			glossyNormal.normalize();
+			newRay.intensity = glossIntensity;
+		}
+		else
+			glossyNormal = normal;
+
+		//FIXME: something's wrong here when there's no material->transmits
+		//calculate fresnel ratio
+		float reflectance;
+		if (material->transmits)// && material->reflects)
+		{
+			if (hitInfo.backface)
+				fresnel(reflectance, incidence, -hitInfo.interp.n, material->index, 1.0f);
+			else
+				fresnel(reflectance, incidence, hitInfo.interp.n, 1.0f, material->index);
+			//reflectance = pow(reflectance, 1.0f/1.2f);
+		}
+		else
+			reflectance = material->reflects ? 1.0f : 0.0f;
+
+		//create reflect ray
+		if ((material->reflects || (material->transmits && ((ray.mask & Ray::REFRACT) > 0))) && reflectance > 0.0f)
+		{
+			vec3f reflectDir;
+			reflect(reflectDir, incidence, glossyNormal);
+	
+			if (reflectDir.dot(triangle.n) < 0.0)
+			{
+				reflect(reflectDir, reflectDir, triangle.n);
+				//newRay.intensity.x = 1.0f; //for debugging
+			}
+	
+			Ray reflectRay = newRay;
+			reflectRay.mask |= Ray::REFLECT;
+			reflectRay.end = reflectRay.start + reflectDir * 100.0f;
+			if ((ray.mask & Ray::REFRACT) > 0) //FIXME: sets reflect colour to white if already refracted for TIR. physically OK?
+				reflectRay.intensity = newRay.intensity * reflectance;
+			else
+				reflectRay.intensity = newRay.intensity * vec4f(material->reflect, 1.0) * reflectance;
+			reflectRay.depth += 1;
+			reflectRay.reflect(hitInfo, incidence, normalDerivs);
+			rays.push(reflectRay);
+	
+			newRay.intensity *= (1.0 - reflectance);
+		}
+
+		//create refract ray
+		if (material->transmits && reflectance < 1.0f)
+		{
+			vec3f refractDir;
+			refract(refractDir, incidence, hitInfo.backface?-glossyNormal:glossyNormal, eta);
+	
+			if (refractDir.dot(hitInfo.backface?-triangle.n:triangle.n) > 0.0)
+			{
+				reflect(refractDir, refractDir, triangle.n);
+				newRay.intensity.x = 1.0f; //for debugging
+			}
+		
+			Ray refractRay = newRay;
+			refractRay.mask |= Ray::REFRACT;
+			refractRay.end = refractRay.start + refractDir * 100.0f;
+			refractRay.intensity = newRay.intensity;
+			refractRay.depth += 1;
+			refractRay.refract(hitInfo, incidence, normalDerivs, eta);
+			/*for (int i = 0; i < 4; ++i)
+			{
+				if (hitInfo.backface)
+					refract(refractRay.d[i].D, refractRay.d[i].D + incidence, -hitInfo.interp.n - normalDerivs[i], eta);
+				else
+					refract(refractRay.d[i].D, refractRay.d[i].D + incidence, hitInfo.interp.n + normalDerivs[i], eta);
+				refractRay.d[i].D -= refractDir;
+			}*/
+			rays.push(refractRay);
+	
+			newRay.intensity = vec4f(0.0f);
+		}
+	} //end glossy rays
+
+	if (traceFlags & TRACE_CAMERA)
+	{
+		//lightIntensity = vec3f(0.0f);
+	
+		//sample photons
+		if (photonMap.size() && !preview)
+			gatherPhotons(context, hitInfo.pos, normal, lightIntensity);
+		
+		vec4f col = newRay.intensity * vec4f(ambientColour + diffuseColour.xyz() * lightIntensity + specularColour * specularIntensity, diffuseColour.w);
+		
+		#if 1
+		if (ray.mask & Ray::GLOBAL)
+			colour += vec4f(col.xyz() * col.w, 0.0f);
+		else
+			colour += vec4f(col.xyz() * col.w, col.w);
+		#endif
+	}
+	
+	if (insertPhoton)
+	{
+		Photon p;
+		//FIXME: replace with derivative bounds
+		p.radius = mymax(mymax(newRay.d[0].P.size(), newRay.d[1].P.size()), mymax(newRay.d[2].P.size(), newRay.d[3].P.size()));
+		p.colour = newRay.intensity * 1.0 / p.radius;
+		p.dir = incidence;
+		p.hit = hitInfo;
+		context.photonPoints.push_back(hitInfo.pos);
+		context.photonInfo.push_back(p);
+	}
+
+	//emit global illumination rays
+	//if the ray intensity is low, don't bother
+	//if the material reflects, the surfaceTexture or "gloss" parameter takes over. dont' trace GI
+	//if the ray is already a GI ray, only emit more if below the max depth
+	bool traceGI = gi.samples > 0 && gi.maxDepth > 0;
+	bool emitGI = traceGI && diffuseColour.w > 1.0f/255.0f && !material->reflects && (traceFlags & TRACE_CAMERA) && !preview && (!(ray.mask & Ray::GLOBAL) || ray.depth < gi.maxDepth);
+	bool cachedGI = emitGI && irradiance.enabled && !(ray.mask & Ray::GLOBAL) && gi.samplesHemisphere.size() > 0;
+	if (cachedGI)
+	{
+		//interpolate from nearby records, or compute one here with every hemisphere sample
+		vec3f irradianceHere;
+		if (irradianceCache.lookup(hitInfo.pos, normal, irradiance.accuracy, irradianceHere))
+			++context.stats.irradianceHits;
+		else
+		{
+			IrradianceCache::Record record;
+			computeIrradiance(context, newRay, normal, sampleOffset, record);
+			irradianceCache.insert(record, irradiance.accuracy);
+			irradianceHere = record.irradiance;
+		}
+		vec4f giBaseIntensity = newRay.intensity * vec4f(diffuseColour.xyz() * diffuseColour.w, diffuseColour.w);
+		colour += vec4f(giBaseIntensity.xyz() * irradianceHere * giBaseIntensity.w, 0.0f);
+	}
+	if (emitGI && !cachedGI)
+	{
+		vec4f giBaseIntensity = newRay.intensity * vec4f(diffuseColour.xyz() * diffuseColour.w, diffuseColour.w);
+	
+		Ray giRay = newRay;
+		if (giRay.mask & Ray::GLOBAL)
+			giRay.depth += 1; //already a GI ray, it's recursing exponentially
+		else
+			giRay.depth = 1; //reset depth count - it's just become a GI ray
+		giRay.mask |= Ray::GLOBAL;
+	
+		//find tangents to the normal
+		vec3f u, v;
+		createTangents(normal, u, v);
+	
+		//random rotation so gi rays don't align
+		float a = context.random.unit()*2.0f*pi;
+		float ca = cos(a);
+		float sa = sin(a);
+	
+		int samplesEmitted = 0;
+		int numSamples = ceil((int)gi.samplesHemisphere.size(), dof.samples); //can do both dof and GI at the same time
+		float giScale = ((float)gi.samplesHemisphere.size() / (float)numSamples) / gi.totalDiffuse;
+		for (int sampleIndex = 0; sampleIndex < numSamples; ++sampleIndex)
+		{
+			++samplesEmitted;
+			int i = (sampleOffset + sampleIndex) % gi.samplesHemisphere.size();
+			//vec2f rotoffset(offset.x * ca + offset.y * sa, -offset.x * sa + offset.y * ca);
+			vec3f baseDir = gi.samplesHemisphere[i];
+			vec3f dir(baseDir.x * ca + baseDir.y * sa, -baseDir.x * sa + baseDir.y * ca, baseDir.z);
+			dir = u * dir.x + v * dir.y + normal * dir.z;
+			dir.normalize();
+			float diffuseScalar = dir.dot(normal);
+			//assert(diffuseScalar >= 0.0f);
+			//if (diffuseScalar < 1.0f/255.0f)
+			//	continue;
+			giRay.end = giRay.start + dir * gi.maxDistance;
+			//giRay.intensity = vec4f(newRay.intensity.xyz() * diffuseColour.xyz() * (diffuseColour.w * diffuseScalar * giScale), newRay.intensity.w * diffuseColour.w);
+			giRay.intensity = vec4f(giBaseIntensity.xyz() * (diffuseScalar * giScale), giBaseIntensity.w);
+			rays.push(giRay);
+			
+			//printf("%i: %i %f %f %f %f\n", giRay.depth, samplesEmitted, giRay.intensity.x, giRay.intensity.y, giRay.intensity.z, giRay.intensity.w);
+		}
+	}
+	
+	//continue tracing if transparent
+	if (diffuseColour.w < 1.0f)
+	{
+		//remove intensity from this material
+		newRay.intensity *= 1.0f - diffuseColour.w;
+		
+		ray.mask |= Ray::TRANSPARENT;
+		ray.intensity = newRay.intensity;
+		
+		//don't increment depth - we still want to emit GI rays
+		//transparentRay.depth += 1;
+		//transparentRay.intensity.x -= col.w;
+		//transparentRay.intensity.y -= col.w;
+		//transparentRay.intensity.z -= col.w;
+		return false; //we're not done. keep going
+	}
+	
+	//ray.intensity = vec4f(0.0f);
+	return true; //we're done with this ray. stop tracing along it
+}
+
+//orders hits along a ray. surfaces hit at the same time are ordered by triangle address, then instance, so each is processed once
+static inline bool hitBefore(float timeA, const TraceScene::Triangle* a, int instanceA, float timeB, const TraceScene::Triangle* b, int instanceB)
+{
+	return timeA < timeB || (timeA == timeB && (a < b || (a == b && instanceA < instanceB)));
+}
+
+bool TraceScene::intersectKDTree(TraceContext& context, const Ray& ray, HitInfo& hit, const HitInfo* after, HitSearch any)
+{
+	float minTime = after ? after->time : 0.0f;
+	bool found = false;
+	//the tree is at most 22 levels deep, and each level leaves at most one far child on the stack
+	TraceInterval stack[64];
+	int stackSize = 0;
+	stack[stackSize++] = TraceInterval(0, 0.0f, 1.0f);
+	while (stackSize)
+	{
+		--stackSize;
+		int node = stack[stackSize].node;
+		float start = stack[stackSize].start;
+		float end = stack[stackSize].end;
+		//int depth = stack[stackSize].depth;
+		
+		#if GLOBAL_TRACE_DEBUG
+		for (int i = 0; i < depth; ++i)
+			printf("%c", "_+=#-|@"[i%7]);
+		printf("enter %i, %f->%f (depth %i)\n", node, start, end, depth);
+		#endif
+		
+		//everything in this interval has already been processed
+		if (end < minTime)
+			continue;
+		
+		const Node& n = tree[node];
+		if (n.leaf())
+		{
+			++context.stats.leaves;
+			#if 0
+			Bounds& b = tree[node].debug;
+			if (debug && !debugMeshTrace)
+			{
+				debugTriangles.push_back(vec3f(b.bmin.x, b.bmin.y, b.bmin.z));
+				debugTriangles.push_back(vec3f(b.bmax.x, b.bmin.y, b.bmin.z));
+				debugTriangles.push_back(vec3f(b.bmax.x, b.bmin.y, b.bmax.z));
+				debugTriangles.push_back(vec3f(b.bmin.x, b.bmin.y, b.bmin.z));
+				debugTriangles.push_back(vec3f(b.bmax.x, b.bmin.y, b.bmax.z));
+				debugTriangles.push_back(vec3f(b.bmin.x, b.bmin.y, b.bmax.z));
+		
+				debugTriangles.push_back(vec3f(b.bmin.x, b.bmax.y, b.bmin.z));
+				debugTriangles.push_back(vec3f(b.bmax.x, b.bmax.y, b.bmin.z));
+				debugTriangles.push_back(vec3f(b.bmax.x, b.bmax.y, b.bmax.z));
+				debugTriangles.push_back(vec3f(b.bmin.x, b.bmax.y, b.bmin.z));
+				debugTriangles.push_back(vec3f(b.bmax.x, b.bmax.y, b.bmax.z));
+				debugTriangles.push_back(vec3f(b.bmin.x, b.bmax.y, b.bmax.z));
+		
+				debugTriangles.push_back(vec3f(b.bmin.x, b.bmin.y, b.bmin.z));
+				debugTriangles.push_back(vec3f(b.bmin.x, b.bmax.y, b.bmin.z));
+				debugTriangles.push_back(vec3f(b.bmin.x, b.bmax.y, b.bmax.z));
+				debugTriangles.push_back(vec3f(b.bmin.x, b.bmin.y, b.bmin.z));
+				debugTriangles.push_back(vec3f(b.bmin.x, b.bmax.y, b.bmax.z));
+				debugTriangles.push_back(vec3f(b.bmin.x, b.bmin.y, b.bmax.z));
+		
+				debugTriangles.push_back(vec3f(b.bmax.x, b.bmin.y, b.bmin.z));
+				debugTriangles.push_back(vec3f(b.bmax.x, b.bmax.y, b.bmin.z));
+				debugTriangles.push_back(vec3f(b.bmax.x, b.bmax.y, b.bmax.z));
+				debugTriangles.push_back(vec3f(b.bmax.x, b.bmin.y, b.bmin.z));
+				debugTriangles.push_back(vec3f(b.bmax.x, b.bmax.y, b.bmax.z));
+				debugTriangles.push_back(vec3f(b.bmax.x, b.bmin.y, b.bmax.z));
+		
+				debugTriangles.push_back(vec3f(b.bmin.x, b.bmin.y, b.bmin.z));
+				debugTriangles.push_back(vec3f(b.bmax.x, b.bmin.y, b.bmin.z));
+				debugTriangles.push_back(vec3f(b.bmax.x, b.bmax.y, b.bmin.z));
+				debugTriangles.push_back(vec3f(b.bmin.x, b.bmin.y, b.bmin.z));
+				debugTriangles.push_back(vec3f(b.bmax.x, b.bmax.y, b.bmin.z));
+				debugTriangles.push_back(vec3f(b.bmin.x, b.bmax.y, b.bmin.z));
+		
+				debugTriangles.push_back(vec3f(b.bmin.x, b.bmin.y, b.bmax.z));
+				debugTriangles.push_back(vec3f(b.bmax.x, b.bmin.y, b.bmax.z));
+				debugTriangles.push_back(vec3f(b.bmax.x, b.bmax.y, b.bmax.z));
+				debugTriangles.push_back(vec3f(b.bmin.x, b.bmin.y, b.bmax.z));
+				debugTriangles.push_back(vec3f(b.bmax.x, b.bmax.y, b.bmax.z));
+				debugTriangles.push_back(vec3f(b.bmin.x, b.bmax.y, b.bmax.z));
+			}
+			#endif
+			
+			float time[4], s[4], t[4];
+			int backface;
+			for (uint i = n.offset(); i < n.offset() + n.count; ++i)
+			{
+				const TriangleBlock& block = blockData[i];
+				context.stats.triangleTests += block.count;
+				int mask = intersectBlock(block, ray, start, end, time, s, t, backface);
+				for (int j = 0; j < block.count; ++j)
+				{
+					if (!(mask & (1 << j)))
+						continue;
+					Triangle& tri = triangleData[block.triangle[j]];
+					if (ray.lastHit.contains(&tri))
+						continue;
+					bool opaque = any == HIT_ANY || materials[triangleShading[block.triangle[j]].material]->opaque;
+					if (any)
+					{
+						//keep looking past transmissive surfaces for an opaque one
+						if (found && !opaque)
+							continue;
+					}
+					else
+					{
+						if (after && !hitBefore(after->time, after->triangle, after->instance, time[j], &tri, -1))
+							continue;
+						if (found && !hitBefore(time[j], &tri, -1, hit.time, hit.triangle, hit.instance))
+							continue;
+					}
+					hit.backface = (backface & (1 << j)) != 0;
+					hit.pos = ray.start + ray.dir * time[j];
+					hit.s = s[j];
+					hit.t = t[j];
+					hit.time = time[j];
+					hit.triangle = &tri;
+					hit.instance = -1;
+					found = true;
+					if (any && opaque)
+						return true;
+				}
+			}
+			
+			//leaves are visited front to back, so the first hit found is the nearest
+			if (found && !any)
+			{
+				#if GLOBAL_TRACE_DEBUG
+				printf("FOUND\n");
+				#endif
+				return true;
+			}
+		}
+		else
+		{
+			++context.stats.nodes;
+			int axis = n.type();
+			float pos = n.split;
+		
+			const float& grad = ray.dir[axis];
+			float startPos = ray.start[axis] + grad * start;
+			float endPos = ray.start[axis] + grad * end;
+		
+			bool flip = grad < 0.0f;
+			uint startBranch = flip ? n.offset() : node + 1;
+			uint endBranch = flip ? node + 1 : n.offset();
+		
+			bool a_eq = startPos == pos;
+			bool b_eq = endPos == pos;
+			bool a = startPos > pos;
+			bool b = endPos > pos;
+			bool intersects = (grad != 0.0) && (a != b || a_eq || b_eq);
+		
+			float mid = end;
+			if (intersects)
+				mid = myclamp((pos - ray.start[axis]) / grad, start, end);
+				
+			if (flip != b || b_eq) //add end first because it's a stack
+				stack[stackSize++] = TraceInterval(endBranch, intersects?(mid-0.00001f):start, end);
+				
+			if (flip == a || a_eq) //now the near branch will be searched first
+				stack[stackSize++] = TraceInterval(startBranch, start, intersects?(mid+0.00001f):end);
+		
+			#if GLOBAL_TRACE_DEBUG
+			if (intersects)
+				assert(start <= mid && mid <= end);
+			assert((flip == a || a_eq) || (flip != b || b_eq));
+			#endif
+		
+			#if GLOBAL_TRACE_DEBUG
+			if (flip == a || a_eq)
+			{
+				for (int i = 0; i < depth; ++i)
+					printf("%c", "_+=#-|@"[i%7]);
+				printf("near: %f->%f (%i)\n", start, intersects?mid:end, startBranch);
+			}
+			#endif
+		
+			#if 0
+			if (intersects)
+			{
+				if (debug && !debugMeshTrace)
+				{
+					vec3f intPos = ray.start + ray.dir * mid;
+					debugTriangles.push_back(intPos);
+					debugTriangles.push_back(intPos + vec3f(0.01,0,0));
+					debugTriangles.push_back(intPos + vec3f(0.01,0.01,0));
+					debugTriangles.push_back(intPos);
+					debugTriangles.push_back(intPos + vec3f(0.01,0,0));
+					debugTriangles.push_back(intPos + vec3f(0.01,0,0.01));
+				}
+			}
+			#endif
+		
+		
+			#if GLOBAL_TRACE_DEBUG
+			if (flip != b || b_eq)
+			{
+				for (int i = 0; i < depth; ++i)
+					printf("%c", "_+=#-|@"[i%7]);
+				printf("far: %f->%f (%i)\n", intersects?mid:start, end, endBranch);
+			}
+			#endif
+		
+		}
+	}
+	
+	return found;
+}
+static inline bool intersectBounds(const TraceScene::Bounds& b, const vec3f& start, const vec3f& invDir, float tmin, float tmax)
+{
+	for (int k = 0; k < 3; ++k)
+	{
+		float t1 = (b.bmin[k] - start[k]) * invDir[k];
+		float t2 = (b.bmax[k] - start[k]) * invDir[k];
+		tmin = mymax(tmin, mymin(t1, t2));
+		tmax = mymin(tmax, mymax(t1, t2));
+	}
+	return tmin <= tmax;
+}
+
+bool TraceScene::intersectBVH(TraceContext& context, const Ray& ray, HitInfo& hit, const HitInfo* after, HitSearch any, bool found,
+	const std::vector<BVHNode>& nodes, const std::vector<uint>& indices, std::vector<Triangle>& tris, const std::vector<TriangleShading>& shading, int instance)
+{
+	//matches the KD tree's interval (0, 1], where 1 is the end of the ray
+	float minTime = after ? after->time : 0.0f;
+	vec3f invDir(1.0f / ray.dir.x, 1.0f / ray.dir.y, 1.0f / ray.dir.z);
+	
+	HitInfo testHit;
+	uint stack[BVH_MAX_DEPTH + 1];
+	int stackSize = 0;
+	if (nodes.size())
+		stack[stackSize++] = 0;
+	while (stackSize)
+	{
+		const BVHNode& node = nodes[stack[--stackSize]];
+		if (!intersectBounds(node.bounds, ray.start, invDir, minTime, (found && !any) ? hit.time : 1.0f))
+			continue;
+		
+		if (node.count)
+		{
+			++context.stats.leaves;
+			for (uint i = node.offset; i < node.offset + node.count; ++i)
+			{
+				Triangle& t = tris[indices[i]];
+				if (ray.lastHit.contains(&t, instance))
+					continue;
+				++context.stats.triangleTests;
+				if (!intersectRayTriangle(ray, t, testHit) || testHit.time <= 0.0f || testHit.time > 1.0f)
+					continue;
+				bool opaque = any == HIT_ANY || materials[shading[indices[i]].material]->opaque;
+				if (any)
+				{
+					if (found && !opaque)
+						continue;
+				}
+				else
+				{
+					if (after && !hitBefore(after->time, after->triangle, after->instance, testHit.time, &t, instance))
+						continue;
+					if (found && !hitBefore(testHit.time, &t, instance, hit.time, hit.triangle, hit.instance))
+						continue;
+				}
+				testHit.triangle = &t;
+				testHit.instance = instance;
+				hit = testHit;
+				found = true;
+				if (any && opaque)
+					return true;
+			}
+		}
+		else
+		{
+			++context.stats.nodes;
+			
+			//push the far child first so the near one is visited first
+			uint left = (uint)(&node - &nodes[0]) + 1;
+			if (ray.dir[node.axis] < 0.0f)
+			{
+				stack[stackSize++] = left;
+				stack[stackSize++] = node.offset;
+			}
+			else
+			{
+				stack[stackSize++] = node.offset;
+				stack[stackSize++] = left;
+			}
+		}
+	}
+	return found;
+}
+
+#if TRACE_SIMD
+static inline int activeRays(int mask)
+{
+	return (mask & 1) + ((mask >> 1) & 1) + ((mask >> 2) & 1) + ((mask >> 3) & 1);
+}
+#endif
+
+bool TraceScene::intersectPacket(TraceContext& context, CameraRay* packet, int count)
+{
+#if TRACE_SIMD
+	//rays must agree on the sign of each direction component to visit children in the same order
+	float o[3][4], d[3][4];
+	int flip[3];
+	for (int k = 0; k < 3; ++k)
+	{
+		flip[k] = packet[0].ray.dir[k] < 0.0f;
+		for (int j = 0; j < 4; ++j)
+		{
+			const Ray& ray = packet[mymin(j, count - 1)].ray; //pad with copies of the last ray
+			o[k][j] = ray.start[k];
+			d[k][j] = ray.dir[k];
+			if (d[k][j] == 0.0f || (d[k][j] < 0.0f) != (bool)flip[k] || !ray.lastHit.empty())
+			{
+				++context.stats.divergentPackets;
+				return false;
+			}
+		}
+	}
+	++context.stats.packets;
+	
+	__m128 start[3], dir[3], invDir[3];
+	for (int k = 0; k < 3; ++k)
+	{
+		start[k] = _mm_loadu_ps(o[k]);
+		dir[k] = _mm_loadu_ps(d[k]);
+		invDir[k] = _mm_div_ps(_mm_set1_ps(1.0f), dir[k]);
+	}
+	
+	for (int j = 0; j < count; ++j)
+		packet[j].found = false;
+	
+	//same interval overlap as the single ray traversal
+	const __m128 epsilon = _mm_set1_ps(0.00001f);
+	int done = 0xF & ~((1 << count) - 1); //padding lanes never need a hit
+	
+	struct {
+		uint node;
+		__m128 start, end;
+	} stack[64];
+	int stackSize = 0;
+	
+	uint node = 0;
+	__m128 tmin = _mm_setzero_ps();
+	__m128 tmax = _mm_set1_ps(1.0f);
+	while (true)
+	{
+		int active = _mm_movemask_ps(_mm_cmple_ps(tmin, tmax)) & ~done;
+		const Node& n = tree[node];
+		if (active && !n.leaf())
+		{
+			context.stats.nodes += activeRays(active);
+			int axis = n.type();
+			__m128 split = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(n.split), start[axis]), invDir[axis]);
+			uint nearChild = flip[axis] ? n.offset() : node + 1;
+			uint farChild = flip[axis] ? node + 1 : n.offset();
+			
+			//rays whose split point is outside their interval only need one side
+			bool needNear = (_mm_movemask_ps(_mm_cmpge_ps(split, tmin)) & active) != 0;
+			bool needFar = (_mm_movemask_ps(_mm_cmple_ps(split, tmax)) & active) != 0;
+			if (needNear && needFar)
+			{
+				stack[stackSize].node = farChild;
+				stack[stackSize].start = _mm_max_ps(tmin, _mm_sub_ps(split, epsilon));
+				stack[stackSize].end = tmax;
+				++stackSize;
+			}
+			if (needNear)
+			{
+				node = nearChild;
+				tmax = _mm_min_ps(tmax, _mm_add_ps(split, epsilon));
+			}
+			else
+			{
+				node = farChild;
+				tmin = _mm_max_ps(tmin, _mm_sub_ps(split, epsilon));
+			}
+			continue;
+		}
+		
+		if (active)
+		{
+			//masked leaf intersection. the same maths as intersectBlock, 4 rays against one triangle at a time
+			context.stats.leaves += activeRays(active);
+			int found = 0;
+			for (uint i = n.offset(); i < n.offset() + n.count; ++i)
+			{
+				const TriangleBlock& block = blockData[i];
+				for (int lane = 0; lane < block.count; ++lane)
+				{
+					Triangle& tri = triangleData[block.triangle[lane]];
+					context.stats.triangleTests += activeRays(active);
+					
+					__m128 a[3], n[3], bs[3], bt[3];
+					for (int k = 0; k < 3; ++k)
+					{
+						a[k] = _mm_set1_ps(block.a[k][lane]);
+						n[k] = _mm_set1_ps(block.n[k][lane]);
+						bs[k] = _mm_set1_ps(block.bs[k][lane]);
+						bt[k] = _mm_set1_ps(block.bt[k][lane]);
+					}
+					__m128 time, s, t, d_ndir;
+					int mask = intersect4(start, dir, a, n, bs, bt, tmin, tmax, cullBackface, time, s, t, d_ndir) & active;
+					if (!mask)
+						continue;
+					
+					float timev[4], sv[4], tv[4], d_ndirv[4];
+					_mm_storeu_ps(timev, time);
+					_mm_storeu_ps(sv, s);
+					_mm_storeu_ps(tv, t);
+					_mm_storeu_ps(d_ndirv, d_ndir);
+					for (int j = 0; j < 4; ++j)
+					{
+						if (!(mask & (1 << j)))
+							continue;
+						HitInfo& h = packet[j].hit;
+						if ((found & (1 << j)) && !hitBefore(timev[j], &tri, -1, h.time, h.triangle, h.instance))
+							continue;
+						const Ray& ray = packet[j].ray;
+						h.backface = (d_ndirv[j] >= 0.0f);
+						h.pos = ray.start + ray.dir * timev[j];
+						h.s = sv[j];
+						h.t = tv[j];
+						h.time = timev[j];
+						h.triangle = &tri;
+						h.instance = -1;
+						found |= 1 << j;
+					}
+				}
+			}
+			
+			//leaves are visited front to back, so rays with a hit here are finished
+			for (int j = 0; j < count; ++j)
+				if (found & (1 << j))
+					packet[j].found = true;
+			done |= found;
+			if (done == 0xF)
+				break;
+		}
+		
+		if (!stackSize)
+			break;
+		--stackSize;
+		node = stack[stackSize].node;
+		tmin = stack[stackSize].start;
+		tmax = stack[stackSize].end;
+	}
+	return true;
+#else
+	return false;
+#endif
+}
+
+bool TraceScene::intersectInstances(TraceContext& context, const Ray& ray, HitInfo& hit, const HitInfo* after, HitSearch any, bool found)
+{
+	//the top level BVH finds instances the ray passes through, then the ray is taken into each one's
+	//object space. transforms are affine, so hit times along the ray are the same in both spaces
+	vec3f invDir(1.0f / ray.dir.x, 1.0f / ray.dir.y, 1.0f / ray.dir.z);
+	Ray local;
+	local.lastHit = ray.lastHit;
+	
+	uint stack[BVH_MAX_DEPTH + 1];
+	int stackSize = 0;
+	if (instanceBVH.size())
+		stack[stackSize++] = 0;
+	while (stackSize)
+	{
+		const BVHNode& node = instanceBVH[stack[--stackSize]];
+		if (!intersectBounds(node.bounds, ray.start, invDir, after ? after->time : 0.0f, (found && !any) ? hit.time : 1.0f))
+			continue;
+		
+		if (node.count)
+		{
+			for (uint i = node.offset; i < node.offset + node.count; ++i)
+			{
+				int index = instanceIndices[i];
+				const Instance& instance = instances[index];
+				Prototype& prototype = prototypes[instance.prototype];
+				local.start = vec3f(instance.inverse * vec4f(ray.start, 1.0f));
+				local.dir = instance.inverse * ray.dir;
+				local.end = local.start + local.dir;
+				if (!intersectBVH(context, local, hit, after, any, found, prototype.bvh, prototype.triangles, prototypeTriangles, prototypeShading, index))
+					continue;
+				if (hit.instance == index)
+				{
+					hit.pos = ray.start + ray.dir * hit.time;
+					hit.backface = hit.backface != instance.mirrored;
+				}
+				found = true;
+				if (any == HIT_ANY || (any && materials[shading(hit).material]->opaque))
+					return true;
+			}
+		}
+		else
+		{
+			uint left = (uint)(&node - &instanceBVH[0]) + 1;
+			if (ray.dir[node.axis] < 0.0f)
+			{
+				stack[stackSize++] = left;
+				stack[stackSize++] = node.offset;
+			}
+			else
+			{
+				stack[stackSize++] = node.offset;
+				stack[stackSize++] = left;
+			}
+		}
+	}
+	return found;
+}
+
+bool TraceScene::intersect(TraceContext& context, const Ray& ray, HitInfo& hit, const HitInfo* after)
+{
+	bool found;
+	if (accel == ACCEL_BVH)
+		found = intersectBVH(context, ray, hit, after, HIT_NEAREST, false, bvh, triangles, triangleData, triangleShading, -1);
+	else
+		found = intersectKDTree(context, ray, hit, after, HIT_NEAREST);
+	if (instances.size())
+		found = intersectInstances(context, ray, hit, after, HIT_NEAREST, found);
+	return found;
+}
+
+bool TraceScene::intersectAny(TraceContext& context, const Ray& ray, HitInfo& hit, HitSearch any)
+{
+	bool found;
+	if (accel == ACCEL_BVH)
+		found = intersectBVH(context, ray, hit, NULL, any, false, bvh, triangles, triangleData, triangleShading, -1);
+	else
+		found = intersectKDTree(context, ray, hit, NULL, any);
+	if (instances.size() && !(found && (any == HIT_ANY || materials[shading(hit).material]->opaque)))
+		found = intersectInstances(context, ray, hit, NULL, any, found);
+	return found;
+}
+
+const TraceScene::TriangleShading& TraceScene::shading(const HitInfo& hit) const
+{
+	//hit.triangle points into the hot array of whichever structure was hit
+	if (hit.instance < 0)
+		return triangleShading[hit.triangle - &triangleData[0]];
+	return prototypeShading[hit.triangle - &prototypeTriangles[0]];
+}
+
+void TraceScene::surfaceTriangle(const HitInfo& hit, Triangle& triangle, Vertex (&verts)[3])
+{
+	triangle = *hit.triangle;
+	const TriangleShading& cold = shading(hit);
+	for (int i = 0; i < 3; ++i)
+		verts[i] = vertexData[cold.verts[i]];
+	if (hit.instance < 0)
+		return;
+	
+	//instanced triangles are in object space. transform them the way addMesh() would have
+	const Instance& instance = instances[hit.instance];
+	vec3f a = vec3f(instance.transform * vec4f(triangle.a, 1.0f));
+	vec3f u = instance.transform * triangle.u;
+	vec3f v = instance.transform * triangle.v;
+	triangle.a = a;
+	triangle.u = u;
+	triangle.v = v;
+	triangle.n = u.cross(v).unit();
+	triangle.d_uv = u.dot(v);
+	triangle.d_uu = u.dot(u);
+	triangle.d_vv = v.dot(v);
+	triangle.uvuuvv = (triangle.d_uv*triangle.d_uv - triangle.d_uu*triangle.d_vv);
+	for (int i = 0; i < 3; ++i)
+	{
+		verts[i].n = instance.normalMatrix * verts[i].n;
+		verts[i].n.normalize();
+		verts[i].ts = instance.transform * verts[i].ts;
+	}
+}
+
+void TraceScene::interpolateHit(HitInfo& hit)
+{
+	const TriangleShading& cold = shading(hit);
+	hit.interp = interpolateVertex(cold.verts[0], cold.verts[1], cold.verts[2], hit.s, hit.t);
+	if (hit.instance >= 0)
+	{
+		const Instance& instance = instances[hit.instance];
+		hit.interp.n = instance.normalMatrix * hit.interp.n;
+		hit.interp.ts = instance.transform * hit.interp.ts;
+	}
+	hit.interp.n.normalize();
+}
+
+bool TraceScene::shade(TraceContext& context, vec4f& colour, Ray& ray, HitInfo& hitInfo, TraceStack& rays, int sampleOffset, int traceFlags)
+{
+	//process surfaces in order until one stops the ray
+	HitInfo last;
+	do
+	{
+		interpolateHit(hitInfo);
+		if (hitSurface(context, colour, ray, hitInfo, rays, sampleOffset, traceFlags))
+			return true;
+		
+		last = hitInfo;
+	} while (intersect(context, ray, hitInfo, &last));
+	return false;
+}
+
+bool TraceScene::trace(TraceContext& context, vec4f& colour, Ray& ray, HitInfo& hitInfo, TraceStack& rays, int sampleOffset, int traceFlags)
+{
+	++context.stats.rays;
+	if (traceFlags & TRACE_PHOTON)
+		++context.stats.photonRays;
+	else if (ray.mask & Ray::GLOBAL)
+		++context.stats.globalRays;
+	return intersect(context, ray, hitInfo, NULL) && shade(context, colour, ray, hitInfo, rays, sampleOffset, traceFlags);
+}
+
+static void addSky(vec4f& colour, const TraceScene::Ray& ray)
+{
+	//TODO: background colour
+	float ratio = mymax(ray.dir.unit().y, 0.0f);
+	vec3f sky = interpLinear(vec3f(0.7, 0.8, 1.0), vec3f(0.3, 0.4, 0.6), ratio);
+	//if (ratio == 0.0)
+	//	sky = vec3f(0.4, 0.2, 0.0);
+	colour += vec4f(sky * ray.intensity.xyz(), 1.0f) * ray.intensity.w;
+}
+void TraceScene::addLight(mat44 transform, vec3f intensity, int samples, float radius, bool square)
+{
+	Light light;
+	light.center = vec3f(transform * vec4f(0.0f, 0.0f, 0.0f, 1.0f));
+	if (samples > 1)
+	{
+		RandomStream random;
+		random.seed((uint32_t)lights.size(), sampleLight, frame);
+		if (square)
+			poissonSquare(light.samples, samples, random);
+		else
+			poissonDisc(light.samples, samples, random);
+		//for (int i = 0; i < (int)poisson.size(); ++i)
+		//	light.samples.push_back(vec3f(transform * vec4f(poisson[i] * radius, 0.0f, 1.0f)));
+	}
+	else
+	{
+		light.samples.push_back(vec2f(0.0f));
+		radius = 0.0f;
+	}
+	light.transform = transform * mat44::scale(radius, radius, 1.0f);
+	light.intensity = intensity;// / (float)light.samples.size();
+	light.square = square;
+	lights.push_back(light);
+}
+bool TraceScene::addTriangles(VBOMesh* mesh, const mat44& transform, std::vector<Triangle>& out, std::vector<TriangleShading>& outShading)
+{
+	if (mesh->primitives != GL_TRIANGLES)
+	{
+		printf("Error: Cannot raytrace non-triangle vbomesh.\n");
+		return false;
+	}
+	if (!mesh->data && !mesh->sub[VBOMesh::VERTICES])
+	{
+		printf("Error: TraceScene::addMesh needs local data. load() but don't upload() before TraceScene::addMesh().\n");
+		return false;
+	}
+	if (!mesh->has[VBOMesh::VERTICES] || !mesh->has[VBOMesh::NORMALS])
+	{
+		printf("Error: TraceScene::addMesh needs at least vertices and normals.\n");
+		return false;
+	}
+
+	mat44 normalMatrix = transform.inverse().transpose();
+	bool hasTexCoords = mesh->has[VBOMesh::TEXCOORDS];
+	bool hasTangents = mesh->has[VBOMesh::TANGENTS];
+	
+	int offset = (int)out.size();
+	int matOffset = (int)materials.size();
+	int vertOffset = (int)vertexData.size();
+	
+	//make some more room for this mesh's triangles
+	int numTriangles = mesh->numIndices / 3;
+	int numVertices = mesh->numVertices;
+	out.resize(offset + numTriangles);
+	outShading.resize(offset + numTriangles);
+	vertexData.resize(vertOffset + numVertices);
+	
+	//duplicate materials. it is assumed the mesh has used MaterialCache and the material pointers remain valid
+	materials.resize(matOffset + mesh->materials.size());
+	for (int i = 0; i < (int)mesh->materials.size(); ++i)
+	{
+		int matIndex = matOffset + i;
+		materials[matIndex] = dynamic_cast<Material*>(mesh->materials[i]);
+		if (materials[matIndex] == NULL)
+			materials[matIndex] = defaultMaterial;
+		else
+			materials[matIndex]->keepLocal = true;
+		
+		materialFlags(materials[matIndex]);
+		shootPhotons = shootPhotons || materials[matIndex]->transmits || materials[matIndex]->reflects;
+		
+		if (materials[matIndex]->imgColour.mipmaps.size() == 1)
+			materials[matIndex]->imgColour.generateHostMipmaps();
+		
+		if (cullBackface && materials[matIndex]->transmits)
+			printf("Warning: Transmissive material added with backface culling on.\n");
+	}
+	
+	//get mesh data iterators
+	InterleavedEditor<vec3f> verts = mesh->getAttrib<vec3f>(VBOMesh::VERTICES);
+	InterleavedEditor<vec3f> norms = mesh->getAttrib<vec3f>(VBOMesh::NORMALS);
+	InterleavedEditor<vec2f> texcs;
+	InterleavedEditor<vec3f> tangents;
+	if (hasTexCoords)
+		texcs = mesh->getAttrib<vec2f>(VBOMesh::TEXCOORDS);
+	if (hasTangents)
+		tangents = mesh->getAttrib<vec3f>(VBOMesh::TANGENTS);
+	
+	std::vector<VBOMeshFaceset> meshFacesets;
+	for (VBOMesh::Facesets::iterator it = mesh->facesets.begin(); it != mesh->facesets.end(); ++it)
+		meshFacesets.push_back(it->second);
+	
+	//start copying out and processing the mesh data
+	int faceset = 0;
+	for (int i = 0; i < numTriangles; ++i)
+	{
+		int mat = 0; //default material
+		while (faceset < (int)meshFacesets.size() && i*3 >= meshFacesets[faceset].endIndex)
+			++faceset;
+		if (faceset < (int)meshFacesets.size() && i*3 >= meshFacesets[faceset].startIndex && i*3 < meshFacesets[faceset].endIndex)
+			mat = matOffset + meshFacesets[faceset].material; //triangle's material
+		
+		vec3f a = vec3f(transform * vec4f(verts[mesh->dataIndices[i*3+0]], 1.0f));
+		vec3f b = vec3f(transform * vec4f(verts[mesh->dataIndices[i*3+1]], 1.0f));
+		vec3f c = vec3f(transform * vec4f(verts[mesh->dataIndices[i*3+2]], 1.0f));
+		vec3f u = b - a;
+		vec3f v = c - a;
+		out[offset + i].a = a;
+		out[offset + i].u = b - a;
+		out[offset + i].v = c - a;
+		out[offset + i].n = u.cross(v).unit();
+		out[offset + i].d_uv = u.dot(v);
+		out[offset + i].d_uu = u.dot(u);
+		out[offset + i].d_vv = v.dot(v);
+		out[offset + i].uvuuvv = (out[offset + i].d_uv*out[offset + i].d_uv - out[offset + i].d_uu*out[offset + i].d_vv);
+		outShading[offset + i].material = mat;
+		outShading[offset + i].verts[0] = vertOffset + mesh->dataIndices[i*3+0];
+		outShading[offset + i].verts[1] = vertOffset + mesh->dataIndices[i*3+1];
+		outShading[offset + i].verts[2] = vertOffset + mesh->dataIndices[i*3+2];
+	}
+	for (int i = 0; i < numVertices; ++i)
+	{
+		vertexData[vertOffset + i].n = normalMatrix * norms[i];
+		vertexData[vertOffset + i].n.normalize();
+		vertexData[vertOffset + i].t = hasTexCoords ? texcs[i] : vec2f(0.0f);
+		vertexData[vertOffset + i].ts = transform * (hasTangents ? tangents[i] : vec3f(1.0f, 0.0f, 0.0f));
+	}
+	return true;
+}
+
+void TraceScene::addMesh(VBOMesh* mesh, mat44 transform)
+{
+	MyTimer timer;
+	timer.time();
 	
-		//find tangents to the normal
-		vec3f u, v;
-		createTangents(normal, u, v);
+	int offset = (int)triangleData.size();
+	if (!addTriangles(mesh, transform, triangleData, triangleShading))
+		return;
+	if (meshTriangles.find(mesh) == meshTriangles.end())
+		meshTriangles[mesh] = offset;
 	
-		//random rotation so gi rays don't align
-		float a = UNIT_RAND*2.0f*pi;
+	printf("Time to addMesh(): %f, %i polys\n", timer.time(), (int)triangleData.size() - offset);
+}
+
+void TraceScene::addInstance(VBOMesh* mesh, mat44 transform)
+{
+	std::map<VBOMesh*, int>::iterator it = prototypeIndex.find(mesh);
+	if (it == prototypeIndex.end())
+	{
+		//first use of the mesh. its triangles are kept in object space and its BVH is built by build()
+		Prototype prototype;
+		prototype.first = (int)prototypeTriangles.size();
+		if (!addTriangles(mesh, mat44::identity(), prototypeTriangles, prototypeShading))
+			return;
+		prototype.count = (int)prototypeTriangles.size() - prototype.first;
+		prototype.bounds.bmin = prototype.bounds.bmax = vec3f(0.0f);
+		for (int i = prototype.first; i < (int)prototypeTriangles.size(); ++i)
+		{
+			Bounds bounds = triangleBounds(prototypeTriangles[i]);
+			prototype.bounds.bmin = i > prototype.first ? vmin(prototype.bounds.bmin, bounds.bmin) : bounds.bmin;
+			prototype.bounds.bmax = i > prototype.first ? vmax(prototype.bounds.bmax, bounds.bmax) : bounds.bmax;
+		}
+		it = prototypeIndex.insert(std::make_pair(mesh, (int)prototypes.size())).first;
+		prototypes.push_back(prototype);
+	}
+	
+	Instance instance;
+	instance.prototype = it->second;
+	instance.transform = transform;
+	instance.inverse = transform.inverse();
+	instance.normalMatrix = instance.inverse.transpose();
+	instance.mirrored = transform.det() < 0.0f;
+	instances.push_back(instance);
+	
+	//world bounds from the transformed corners of the object bounds
+	const Bounds& object = prototypes[instance.prototype].bounds;
+	Bounds bounds;
+	for (int i = 0; i < 8; ++i)
+	{
+		vec3f corner((i & 1) ? object.bmax.x : object.bmin.x, (i & 2) ? object.bmax.y : object.bmin.y, (i & 4) ? object.bmax.z : object.bmin.z);
+		corner = vec3f(transform * vec4f(corner, 1.0f));
+		bounds.bmin = i ? vmin(bounds.bmin, corner) : corner;
+		bounds.bmax = i ? vmax(bounds.bmax, corner) : corner;
+	}
+	instanceBounds.push_back(bounds);
+}
+
+void TraceScene::traceSpawned(TraceContext& context, vec4f& colour, Ray& ray, TraceStack& rays, int sampleOffset, int traceFlags)
+{
+	ray.dir = ray.end - ray.start;
+	
+	//non GI rays with small light contribution are discarded
+	if (!(ray.mask & Ray::GLOBAL) && ray.intensity.x < 0.2/256.0f && ray.intensity.y < 0.2/256.0f && ray.intensity.z < 0.2/256.0f)
+		return;
+	
+	//just in case I've messed up
+	if (ray.canary > 100)
+	{
+		printf("Canary died (%s):\n\t%i SHADOW\n\t%i GLOBAL\n\t%i TRANSPARENT\n\t%i REFRACT\n\t%i REFLECT\n",
+			(traceFlags & TRACE_PHOTON) ? "photon" : ((traceFlags & TRACE_SHADOW) ? "shadow" : "camera"),
+			(int)((ray.mask & Ray::SHADOW) > 0),
+			(int)((ray.mask & Ray::GLOBAL) > 0),
+			(int)((ray.mask & Ray::TRANSPARENT) > 0),
+			(int)((ray.mask & Ray::REFRACT) > 0),
+			(int)((ray.mask & Ray::REFLECT) > 0)
+			);
+		return;
+	}
+
+	HitInfo hitInfo;
+	bool found = trace(context, colour, ray, hitInfo, rays, sampleOffset, traceFlags);
+	
+	if (!found && !(ray.mask & Ray::GLOBAL))
+		addSky(colour, ray);
+}
+
+bool TraceScene::trace(TraceContext& context, vec4f& colour, TraceStack& rays, int sampleOffset, int traceFlags)
+{
+	while (rays.size() > 0)
+	{
+		Ray ray = rays.top();
+		rays.pop();
+		traceSpawned(context, colour, ray, rays, sampleOffset, traceFlags);
+	}
+	
+	//colour += vec4f(mymax(0.0f, 1.0f - colour.w));
+	//colour.w = 1.0f;
+	return true;
+}
+
+static void initCameraRay(TraceScene::Ray& ray, const vec3f& start, const vec3f& end, TraceScene::Ray::Diff dx, TraceScene::Ray::Diff dy)
+{
+	ray.start = start;
+	ray.end = end;
+	ray.dir = end - start;
+	ray.intensity = vec4f(1.0f, 1.0f, 1.0f, 1.0f);
+	ray.depth = 0;
+	ray.canary = 0;
+	ray.mask = 0;
+	ray.d[0] = -dx -dy;
+	ray.d[1] = -dx + dy;
+	ray.d[2] = dx + dy;
+	ray.d[3] = dx -dy;
+	ray.lastHit.clear();
+}
+
+void TraceScene::traceCameraRay(vec3f start, vec3f end, vec4f& colour, int sampleOffset, bool debugTrace)
+{
+	if (debugTrace)
+	{
+		debugMutex.lock();
+		printf("Clearing Debug Rays\n");
+		debugPoints.clear();
+		debugRays.clear();
+		debugMutex.unlock();
+	}
+	
+	static Ray::Diff nodiff(vec3f(0.0f), vec3f(0.0f));
+	traceCameraRay(start, end, nodiff, nodiff, colour, sampleOffset, debugTrace);
+}
+
+void TraceScene::traceCameraRay(vec3f start, vec3f end, Ray::Diff dx, Ray::Diff dy, vec4f& colour, int sampleOffset, bool debugTrace)
+{
+	TraceContext context;
+	traceCameraRay(context, start, end, dx, dy, colour, sampleOffset, debugTrace);
+	addStats(context.stats);
+}
+
+void TraceScene::traceCameraRay(TraceContext& context, vec3f start, vec3f end, Ray::Diff dx, Ray::Diff dy, vec4f& colour, int sampleOffset, bool debugTrace)
+{
+	//debugTrace = true;
+
+	Ray startRay;
+	initCameraRay(startRay, start, end, dx, dy);
+	TraceStack& rays = context.rays;
+	rays.push(startRay);
+	++context.stats.cameraRays;
+	
+	//resolve refraction/reflections and finally diffuse hits
+	trace(context, colour, rays, sampleOffset, TRACE_CAMERA | (debugTrace?TRACE_DEBUG:0));
+}
+
+void TraceScene::tracePhotons(int nthreads)
+{
+	printf("Photon mapping...\n");
+	
+	photonPoints.clear();
+	photonInfo.clear();
+	
+	int totalLightSamples = 0;
+	for (size_t l = 0; l < lights.size(); ++l)
+		totalLightSamples += (int)lights[l].samples.size();
+	if (totalLightSamples == 0 || photons.emit <= 0)
+	{
+		photonMap.clear();
+		return;
+	}
+
+	//create direction distribution for photons
+	int emitSphereCount = mymax(1, (int)sqrt(photons.emit/(4*pi)));
+	RandomStream random;
+	random.seed(0, sampleEmitSphere, frame);
+	poissonSphere(photons.emitSphere, emitSphereCount, random);
+	
+	//every light sample emits the same number of photons. the sphere of directions is given a
+	//new random rotation each time it's used up. the rotations are made up front so any photon
+	//can be emitted without shooting the ones before it
+	photonCount = ceil(photons.emit, totalLightSamples) * totalLightSamples;
+	photonRotations.resize(photonCount / photons.emitSphere.size() + 1);
+	for (int i = 0; i < (int)photonRotations.size(); ++i)
+		photonRotations[i] = Quat::random(random);
+	
+	//threads take chunks in any order, but each chunk keeps its own photons so
+	//they can be merged in emission order, giving the same map for any thread count
+	int chunkSize = 4096;
+	std::vector<PhotonChunk> chunks(ceil(photonCount, chunkSize));
+	for (int i = 0; i < (int)chunks.size(); ++i)
+	{
+		chunks[i].begin = i * chunkSize;
+		chunks[i].end = mymin(photonCount, chunks[i].begin + chunkSize);
+	}
+	printf("Tracing %i Photons in %i chunks\n", photonCount, (int)chunks.size());
+	
+	std::atomic<int> nextChunk(0);
+	std::vector<PhotonThread*> photonThreads(mymax(1, nthreads));
+	for (int i = 0; i < (int)photonThreads.size(); ++i)
+	{
+		photonThreads[i] = new PhotonThread();
+		photonThreads[i]->scene = this;
+		photonThreads[i]->chunks = &chunks;
+		photonThreads[i]->nextChunk = &nextChunk;
+		if (i > 0)
+			photonThreads[i]->start();
+	}
+	photonThreads[0]->run(); //the calling thread helps
+	for (int i = 0; i < (int)photonThreads.size(); ++i)
+	{
+		photonThreads[i]->wait();
+		addStats(photonThreads[i]->context.stats);
+		delete photonThreads[i];
+	}
+	
+	for (int i = 0; i < (int)chunks.size(); ++i)
+	{
+		photonPoints.insert(photonPoints.end(), chunks[i].points.begin(), chunks[i].points.end());
+		photonInfo.insert(photonInfo.end(), chunks[i].info.begin(), chunks[i].info.end());
+	}
+	printf("%i Photon Hits\n", (int)photonPoints.size());
+	
+	MyTimer qwe;
+	qwe.time();
+	std::vector<float> radii(photonInfo.size());
+	for (int i = 0; i < (int)photonInfo.size(); ++i)
+		radii[i] = photonInfo[i].radius;
+	photonMap.build(photonPoints, radii, nthreads);
+	printf("Took %.2fms to build the tree\n", qwe.time());
+	
+	printf("Photon Tree Built\n");
+}
+
+void TraceScene::emitPhoton(int photon, Ray& ray)
+{
+	//photons cycle through the light samples, in light order
+	int offset = photon;
+	int totalLightSamples = 0;
+	for (size_t l = 0; l < lights.size(); ++l)
+		totalLightSamples += (int)lights[l].samples.size();
+	offset %= totalLightSamples;
+	int l = 0;
+	while (offset >= (int)lights[l].samples.size())
+		offset -= (int)lights[l++].samples.size();
+	int samples = (int)lights[l].samples.size();
+	
+	float photonRatio = totalLightSamples / (float)(photons.emit * samples);
+	float photonEmitArea = 4.0f * pi * photonRatio;
+	//FIXME: don't use a constant here
+	float deltaAngle = atan(photonEmitArea) * 200.0f;
+	
+	int p = photon % photons.emitSphere.size();
+	const Quat& randomRot = photonRotations[photon / photons.emitSphere.size()];
+	
+	ray.start = lights[l].transform * vec4f(lights[l].samples[offset], 0.0f, 1.0f);
+	ray.dir = (randomRot * photons.emitSphere[p]);
+	ray.intensity = vec4f(vec3f(0.01f), 1.0f);
+	ray.depth = 0;
+	ray.canary = 0;
+	ray.mask = 0;
+
+	vec3f perp1 = ray.dir.cross(vec3f(0,0,1));
+	if (perp1.size() < 0.1f)
+		perp1 = ray.dir.cross(vec3f(0,1,0));
+	perp1.normalize();
+	vec3f perp2 = ray.dir.cross(perp1).unit();
+
+	ray.d[0].P = ray.d[0].D = Quat(deltaAngle, perp1) * ray.dir - ray.dir;
+	ray.d[1].P = ray.d[1].D = Quat(deltaAngle, perp2) * ray.dir - ray.dir;
+	ray.d[2].P = ray.d[2].D = Quat(-deltaAngle, perp1) * ray.dir - ray.dir;
+	ray.d[3].P = ray.d[3].D = Quat(-deltaAngle, perp2) * ray.dir - ray.dir;
+
+	ray.dir *= photons.maxDistance;
+	ray.end = ray.start + ray.dir;
+}
+
+void TraceScene::tracePhotonChunk(TraceContext& context, PhotonChunk& chunk)
+{
+	//stored photons go to the context, then are handed to the chunk
+	context.photonPoints.clear();
+	context.photonInfo.clear();
+	
+	//debug traces also record photon paths, which is only worth the lock when debugging
+	int traceFlags = TRACE_PHOTON | (debug ? TRACE_DEBUG : 0);
+	for (int i = chunk.begin; i < chunk.end; ++i)
+	{
+		context.random.seed(i, samplePhoton, frame);
+		
+		Ray ray;
+		emitPhoton(i, ray);
+		context.rays.push(ray);
+		
+		//resolve refraction/reflections and finally diffuse hits
+		vec4f colour(0.0f); //ignored - shooting photons, not tracing camera rays
+		trace(context, colour, context.rays, 0, traceFlags);
+	}
+	
+	chunk.points = context.photonPoints;
+	chunk.info = context.photonInfo;
+}
+
+void TraceScene::PhotonThread::run()
+{
+	int chunk;
+	while ((chunk = nextChunk->fetch_add(1)) < (int)chunks->size())
+		scene->tracePhotonChunk(context, (*chunks)[chunk]);
+}
+
+void TraceScene::computeIrradiance(TraceContext& context, const Ray& from, const vec3f& normal, int sampleOffset, IrradianceCache::Record& record)
+{
+	//the same stratified hemisphere as uncached GI, but all of it. the gradients are Ward and Heckbert's, from the
+	//same samples: rotation from how each sample's cosine weight changes, translation from the distances they hit
+	Ray giRay = from;
+	giRay.depth = 1;
+	giRay.mask |= Ray::GLOBAL;
+	
+	vec3f u, v;
+	createTangents(normal, u, v);
+	float a = context.random.unit()*2.0f*pi;
+	float ca = cos(a);
+	float sa = sin(a);
+	
+	record.pos = from.start;
+	record.normal = normal;
+	record.irradiance = vec3f(0.0f);
+	for (int c = 0; c < 3; ++c)
+	{
+		record.rotation[c] = vec3f(0.0f);
+		record.translation[c] = vec3f(0.0f);
+	}
+	float inverseDistances = 0.0f;
+	TraceStack& rays = context.irradianceRays;
+	for (int i = 0; i < (int)gi.samplesHemisphere.size(); ++i)
+	{
+		vec3f baseDir = gi.samplesHemisphere[i];
+		vec3f dir(baseDir.x * ca + baseDir.y * sa, -baseDir.x * sa + baseDir.y * ca, baseDir.z);
+		dir = u * dir.x + v * dir.y + normal * dir.z;
+		dir.normalize();
+		float diffuseScalar = dir.dot(normal);
+		
+		Ray sampleRay = giRay;
+		sampleRay.end = sampleRay.start + dir * gi.maxDistance;
+		sampleRay.dir = sampleRay.end - sampleRay.start;
+		sampleRay.intensity = vec4f(vec3f(diffuseScalar / gi.totalDiffuse), 1.0f);
+		
+		//trace() without the stack, to keep the hit distance
+		vec4f sample(0.0f);
+		HitInfo hit;
+		float distance = gi.maxDistance;
+		++context.stats.rays;
+		++context.stats.globalRays;
+		if (intersect(context, sampleRay, hit, NULL))
+		{
+			distance = hit.time * gi.maxDistance;
+			shade(context, sample, sampleRay, hit, rays, sampleOffset, TRACE_CAMERA);
+			trace(context, sample, rays, sampleOffset, TRACE_CAMERA);
+		}
+		distance = mymax(distance, irradiance.minRadius);
+		inverseDistances += 1.0f / distance;
+		
+		vec3f turn = normal.cross(dir);
+		vec3f along = dir - normal * diffuseScalar;
+		record.irradiance += sample.xyz();
+		for (int c = 0; c < 3; ++c)
+		{
+			record.rotation[c] += turn * (sample[c] / diffuseScalar);
+			record.translation[c] += along * (3.0f * sample[c] / distance);
+		}
+	}
+	record.radius = myclamp(gi.samplesHemisphere.size() / inverseDistances, irradiance.minRadius, irradiance.maxRadius);
+	++context.stats.irradianceRecords;
+}
+
+bool TraceScene::irradiancePoint(TraceContext& context, int point, IrradianceCache::Record& record)
+{
+	//the centre pixel of each cell of the pre-pass grid
+	QI::Image* image = renderInfo.image;
+	int spacing = irradiance.prepass;
+	int columns = ceil(image->width, spacing);
+	TraceThreadJob job;
+	job.x = mymin((point % columns) * spacing + spacing / 2, image->width - 1);
+	job.y = mymin((point / columns) * spacing + spacing / 2, image->height - 1);
+	job.view = renderInfo.view;
+	job.img = image;
+	job.cam = renderInfo.camera;
+	context.random.seed(job.y * image->width + job.x, sampleIrradiance, frame);
+	
+	Ray ray;
+	initCameraRay(ray, job.get(0.0f, 0.0f, 0.0f), job.get(0.0f, 0.0f, 1.0f), Ray::Diff(vec3f(0.0f), vec3f(0.0f)), Ray::Diff(vec3f(0.0f), vec3f(0.0f)));
+	HitInfo hit;
+	++context.stats.rays;
+	if (!intersect(context, ray, hit, NULL))
+		return false;
+	interpolateHit(hit);
+	if (materials[shading(hit).material]->reflects)
+		return false;
+	
+	Ray from = ray;
+	from.lastHit.insert(hit.triangle, hit.instance);
+	from.start = hit.pos;
+	computeIrradiance(context, from, hit.interp.n, 0, record);
+	return true;
+}
+
+void TraceScene::IrradianceThread::run()
+{
+	int point;
+	while ((point = nextPoint->fetch_add(1)) < (int)records->size())
+		(*found)[point] = scene->irradiancePoint(context, point, (*records)[point]);
+}
+
+void TraceScene::fillIrradianceCache(int nthreads)
+{
+	//records are computed in parallel but inserted in grid order, skipping those already covered,
+	//so the pre-pass cache doesn't depend on the thread count
+	MyTimer timer;
+	timer.time();
+	int spacing = irradiance.prepass;
+	int points = ceil(renderInfo.image->width, spacing) * ceil(renderInfo.image->height, spacing);
+	std::vector<IrradianceCache::Record> records(points);
+	std::vector<char> found(points, 0);
+	
+	std::atomic<int> nextPoint(0);
+	std::vector<IrradianceThread*> irradianceThreads(mymax(1, nthreads));
+	for (int i = 0; i < (int)irradianceThreads.size(); ++i)
+	{
+		irradianceThreads[i] = new IrradianceThread();
+		irradianceThreads[i]->scene = this;
+		irradianceThreads[i]->records = &records;
+		irradianceThreads[i]->found = &found;
+		irradianceThreads[i]->nextPoint = &nextPoint;
+		if (i > 0)
+			irradianceThreads[i]->start();
+	}
+	irradianceThreads[0]->run(); //the calling thread helps
+	for (int i = 0; i < (int)irradianceThreads.size(); ++i)
+	{
+		irradianceThreads[i]->wait();
+		addStats(irradianceThreads[i]->context.stats);
+		delete irradianceThreads[i];
+	}
+	
+	for (int i = 0; i < points; ++i)
+	{
+		vec3f covered;
+		if (found[i] && !irradianceCache.lookup(records[i].pos, records[i].normal, irradiance.accuracy, covered))
+			irradianceCache.insert(records[i], irradiance.accuracy);
+	}
+	printf("Irradiance cache pre-pass: %i records from %i points in %.2fms\n", irradianceCache.size(), points, timer.time());
+}
+
+vec3f TraceScene::TraceThreadJob::get(float dx, float dy, float z)
+{
+	vec4f point(2.0f * (x + 0.5f) / img->width - 1.0f + dx * 2.0f, 2.0f * (y + 0.5f) / img->height - 1.0f + dy * 2.0f, z * 2.0f - 1.0f, 1.0f);
+	point = view * point;
+	point /= point.w;
+	return point.xyz();
+}
+
+void TraceScene::addCameraRays(TraceThreadJob& job, TraceContext& context, int pixel)
+{
+	bool debug = (myabs(job.x-job.img->width/2) < 2) && (myabs(job.y-job.img->height/2) < 2);
+	
+	vec3f start = job.get(0.0f, 0.0f, 0.0f);
+	vec3f end = job.get(0.0f, 0.0f, 1.0f);
+	Ray::Diff dx, dy;
+	
+	//each pass takes a run of the pixel's stream. the first sample rotates the DOF samples, camera ray samples follow
+	int imagePixel = job.y * job.img->width + job.x;
+	int firstSample = job.pass * (dof.samples + 1);
+	context.random.seed(imagePixel, firstSample, frame);
+	
+	std::vector<CameraRay>& cameraRays = context.cameraRays;
+	if (dof.samples <= 1)
+	{
+		dof.samples = 1;
+		
+		vec3f dir = end-start;
+		float p = 0.5f;
+		dx.P = job.get(p / job.img->width, 0.0f, 0.0f);
+		dy.P = job.get(0.0f, p / job.img->height, 0.0f);
+		dx.D = job.get(p / job.img->width, 0.0f, 1.0f) - dx.P;
+		dy.D = job.get(0.0f, p / job.img->height, 1.0f) - dy.P;
+		dx.P -= start;
+		dy.P -= start;
+		dx.D.normalize();
+		dy.D.normalize();
+		dir.normalize();
+		dx.D -= dir;
+		dy.D -= dir;
+		
+		cameraRays.push_back(CameraRay());
+		initCameraRay(cameraRays.back().ray, start, end, dx, dy);
+		cameraRays.back().sampleOffset = 0;
+		cameraRays.back().debug = debug;
+	}
+	else
+	{
+		vec3f toVec = end - start;
+		float length = toVec.size();
+		vec3f dir = toVec.unit();
+		vec3f focus = start + dir * (dof.focus - job.cam->getClipPlanes().x) / dir.dot(job.cam->toVec());
+		vec3f up = job.cam->upVec();
+		vec3f right = job.cam->rightVec();
+		//gaussianKernal(
+		assert((int)samplesDisc.size() == dof.samples);
+		
+		float a = context.random.unit()*2.0f*pi;
 		float ca = cos(a);
 		float sa = sin(a);
-	
-		int samplesEmitted = 0;
-		int numSamples = ceil((int)gi.samplesHemisphere.size(), dof.samples); //can do both dof and GI at the same time
-		float giScale = ((float)gi.samplesHemisphere.size() / (float)numSamples) / gi.totalDiffuse;
-		for (int sampleIndex = 0; sampleIndex < numSamples; ++sampleIndex)
+		
+		dx.P = right / (float)job.img->width;
+		dy.P = up / (float)job.img->height;
+			
+		for (int i = 0; i < (int)samplesDisc.size(); ++i)
 		{
-			++samplesEmitted;
-			int i = (sampleOffset + sampleIndex) % gi.samplesHemisphere.size();
-			//vec2f rotoffset(offset.x * ca + offset.y * sa, -offset.x * sa + offset.y * ca);
-			vec3f baseDir = gi.samplesHemisphere[i];
-			vec3f dir(baseDir.x * ca + baseDir.y * sa, -baseDir.x * sa + baseDir.y * ca, baseDir.z);
-			dir = u * dir.x + v * dir.y + normal * dir.z;
-			dir.normalize();
-			float diffuseScalar = dir.dot(normal);
-			//assert(diffuseScalar >= 0.0f);
-			//if (diffuseScalar < 1.0f/255.0f)
-			//	continue;
-			giRay.end = giRay.start + dir * gi.maxDistance;
-			//giRay.intensity = vec4f(newRay.intensity.xyz() * diffuseColour.xyz() * (diffuseColour.w * diffuseScalar * giScale), newRay.intensity.w * diffuseColour.w);
-			giRay.intensity = vec4f(giBaseIntensity.xyz() * (diffuseScalar * giScale), giBaseIntensity.w);
-			rays.push(giRay);
+			//create rays, focusing on the "focus" point
+			vec2f offset = samplesDisc[i] * dof.aperture;
+			vec2f rotoffset(offset.x * ca + offset.y * sa, -offset.x * sa + offset.y * ca);
+			vec3f rayStart = job.cam->getZoomPos() + right * rotoffset.x + up * rotoffset.y;
+			vec3f dir = (focus - rayStart).unit();
+			vec3f rayEnd = start + dir * length;
 			
-			//printf("%i: %i %f %f %f %f\n", giRay.depth, samplesEmitted, giRay.intensity.x, giRay.intensity.y, giRay.intensity.z, giRay.intensity.w);
+			dx.D = focus - dx.P - rayStart;
+			dy.D = focus - dy.P - rayStart;
+			dx.D.normalize();
+			dy.D.normalize();
+			dx.D -= dir;
+			dy.D -= dir;
+			
+			cameraRays.push_back(CameraRay());
+			initCameraRay(cameraRays.back().ray, rayStart, rayEnd, dx, dy);
+			cameraRays.back().sampleOffset = i;
+			cameraRays.back().debug = debug && i == 0;
 		}
 	}
 	
-	//continue tracing if transparent
-	if (diffuseColour.w < 1.0f)
+	for (int i = (int)cameraRays.size() - dof.samples; i < (int)cameraRays.size(); ++i)
 	{
-		//remove intensity from this material
-		newRay.intensity *= 1.0f - diffuseColour.w;
-		
-		ray.mask |= Ray::TRANSPARENT;
-		ray.intensity = newRay.intensity;
-		
-		//don't increment depth - we still want to emit GI rays
-		//transparentRay.depth += 1;
-		//transparentRay.intensity.x -= col.w;
-		//transparentRay.intensity.y -= col.w;
-		//transparentRay.intensity.z -= col.w;
-		return false; //we're not done. keep going
+		cameraRays[i].pixel = pixel;
+		cameraRays[i].imagePixel = imagePixel;
+		cameraRays[i].sample = firstSample + 1 + cameraRays[i].sampleOffset;
+		cameraRays[i].colour = vec4f(0.0f);
 	}
-	
-	//ray.intensity = vec4f(0.0f);
-	return true; //we're done with this ray. stop tracing along it
 }
 
-static bool hitInfoCompare(const TraceScene::HitInfo& a, const TraceScene::HitInfo& b)
+void TraceScene::traceCameraRays(TraceContext& context)
 {
-	return a.time < b.time;
+	//rays are grouped by pixel, so each packet holds a 2x2 block of pixels or DOF samples of one
+	//pixel. both share a start or end point and usually walk the same nodes
+	std::vector<CameraRay>& cameraRays = context.cameraRays;
+	for (int i = 0; i < (int)cameraRays.size(); i += 4)
+	{
+		int count = mymin(4, (int)cameraRays.size() - i);
+		bool packed = packetTracing && accel == ACCEL_KDTREE && instances.empty() && count > 1 && intersectPacket(context, &cameraRays[i], count);
+		for (int j = i; j < i + count; ++j)
+		{
+			CameraRay& c = cameraRays[j];
+			int traceFlags = TRACE_CAMERA | (c.debug ? TRACE_DEBUG : 0);
+			context.random.seed(c.imagePixel, c.sample, frame);
+			++context.stats.rays;
+			++context.stats.cameraRays;
+			if (!packed)
+				c.found = intersect(context, c.ray, c.hit, NULL);
+			
+			//shade the first hit, then resolve refraction/reflections and finally diffuse hits
+			TraceStack& rays = context.rays;
+			if (!c.found || !shade(context, c.colour, c.ray, c.hit, rays, c.sampleOffset, traceFlags))
+				addSky(c.colour, c.ray);
+			if (wavefront.enabled)
+				queueSpawned(context, j);
+			else
+				trace(context, c.colour, rays, c.sampleOffset, traceFlags);
+		}
+	}
+	if (wavefront.enabled)
+		traceWaves(context);
 }
 
-bool TraceScene::trace(vec4f& colour, Ray& ray, HitInfo& hitInfo, TraceStack& rays, int sampleOffset, int traceFlags)
+void TraceScene::queueSpawned(TraceContext& context, int cameraRay)
 {
-	std::stack<TraceInterval> stack;
-	stack.push(TraceInterval(0, 0.0f, 1.0f));
-	while (stack.size())
+	CameraRay& c = context.cameraRays[cameraRay];
+	TraceStack& rays = context.rays;
+	while (rays.size() > 0)
 	{
-		int node = stack.top().node;
-		float start = stack.top().start;
-		float end = stack.top().end;
-		//int depth = stack.top().depth;
-		
-		#if GLOBAL_TRACE_DEBUG
-		for (int i = 0; i < depth; ++i)
-			printf("%c", "_+=#-|@"[i%7]);
-		printf("enter %i, %f->%f (depth %i)\n", node, start, end, depth);
-		#endif
-		
-		stack.pop();
-		
-		if (tree[node].type == 3)
+		if ((int)context.nextWave.size() >= wavefront.maxRays)
 		{
-			#if 0
-			Bounds& b = tree[node].debug;
-			if (debug && !debugMeshTrace)
-			{
-				debugTriangles.push_back(vec3f(b.bmin.x, b.bmin.y, b.bmin.z));
-				debugTriangles.push_back(vec3f(b.bmax.x, b.bmin.y, b.bmin.z));
-				debugTriangles.push_back(vec3f(b.bmax.x, b.bmin.y, b.bmax.z));
-				debugTriangles.push_back(vec3f(b.bmin.x, b.bmin.y, b.bmin.z));
-				debugTriangles.push_back(vec3f(b.bmax.x, b.bmin.y, b.bmax.z));
-				debugTriangles.push_back(vec3f(b.bmin.x, b.bmin.y, b.bmax.z));
-		
-				debugTriangles.push_back(vec3f(b.bmin.x, b.bmax.y, b.bmin.z));
-				debugTriangles.push_back(vec3f(b.bmax.x, b.bmax.y, b.bmin.z));
-				debugTriangles.push_back(vec3f(b.bmax.x, b.bmax.y, b.bmax.z));
-				debugTriangles.push_back(vec3f(b.bmin.x, b.bmax.y, b.bmin.z));
-				debugTriangles.push_back(vec3f(b.bmax.x, b.bmax.y, b.bmax.z));
-				debugTriangles.push_back(vec3f(b.bmin.x, b.bmax.y, b.bmax.z));
-		
-				debugTriangles.push_back(vec3f(b.bmin.x, b.bmin.y, b.bmin.z));
-				debugTriangles.push_back(vec3f(b.bmin.x, b.bmax.y, b.bmin.z));
-				debugTriangles.push_back(vec3f(b.bmin.x, b.bmax.y, b.bmax.z));
-				debugTriangles.push_back(vec3f(b.bmin.x, b.bmin.y, b.bmin.z));
-				debugTriangles.push_back(vec3f(b.bmin.x, b.bmax.y, b.bmax.z));
-				debugTriangles.push_back(vec3f(b.bmin.x, b.bmin.y, b.bmax.z));
-		
-				debugTriangles.push_back(vec3f(b.bmax.x, b.bmin.y, b.bmin.z));
-				debugTriangles.push_back(vec3f(b.bmax.x, b.bmax.y, b.bmin.z));
-				debugTriangles.push_back(vec3f(b.bmax.x, b.bmax.y, b.bmax.z));
-				debugTriangles.push_back(vec3f(b.bmax.x, b.bmin.y, b.bmin.z));
-				debugTriangles.push_back(vec3f(b.bmax.x, b.bmax.y, b.bmax.z));
-				debugTriangles.push_back(vec3f(b.bmax.x, b.bmin.y, b.bmax.z));
-		
-				debugTriangles.push_back(vec3f(b.bmin.x, b.bmin.y, b.bmin.z));
-				debugTriangles.push_back(vec3f(b.bmax.x, b.bmin.y, b.bmin.z));
-				debugTriangles.push_back(vec3f(b.bmax.x, b.bmax.y, b.bmin.z));
-				debugTriangles.push_back(vec3f(b.bmin.x, b.bmin.y, b.bmin.z));
-				debugTriangles.push_back(vec3f(b.bmax.x, b.bmax.y, b.bmin.z));
-				debugTriangles.push_back(vec3f(b.bmin.x, b.bmax.y, b.bmin.z));
+			//the batch is full, so the rest go depth first, which needs no more memory
+			trace(context, c.colour, rays, c.sampleOffset, TRACE_CAMERA | (c.debug ? TRACE_DEBUG : 0));
+			break;
+		}
+		context.nextWave.push_back(WaveRay());
+		WaveRay& w = context.nextWave.back();
+		w.ray = rays.top();
+		w.cameraRay = cameraRay;
+		w.random.seed(((uint64_t)context.random.next() << 32) | context.random.next(), c.imagePixel);
+		rays.pop();
+	}
+}
+
+static uint mortonIndex3(uint x, uint y, uint z)
+{
+	uint r = 0;
+	for (int b = 0; b < 10; ++b)
+		r |= (((x >> b) & 1) << (3 * b)) | (((y >> b) & 1) << (3 * b + 1)) | (((z >> b) & 1) << (3 * b + 2));
+	return r;
+}
+
+void TraceScene::traceWaves(TraceContext& context)
+{
+	//each batch holds the rays spawned by the previous one. secondary rays from neighbouring pixels
+	//scatter, so they're sorted to bring rays that will walk the same nodes next to each other
+	std::vector<WaveRay>& wave = context.wave;
+	std::vector<std::pair<uint64_t, int> >& order = context.waveOrder;
+	while (context.nextWave.size())
+	{
+		wave.swap(context.nextWave);
+		context.nextWave.clear();
 		
-				debugTriangles.push_back(vec3f(b.bmin.x, b.bmin.y, b.bmax.z));
-				debugTriangles.push_back(vec3f(b.bmax.x, b.bmin.y, b.bmax.z));
-				debugTriangles.push_back(vec3f(b.bmax.x, b.bmax.y, b.bmax.z));
-				debugTriangles.push_back(vec3f(b.bmin.x, b.bmin.y, b.bmax.z));
-				debugTriangles.push_back(vec3f(b.bmax.x, b.bmax.y, b.bmax.z));
-				debugTriangles.push_back(vec3f(b.bmin.x, b.bmax.y, b.bmax.z));
-			}
-			#endif
-			
-			HitInfo testHit;
-			vector<HitInfo> hits;
-			for (uint i = tree[node].a; i < tree[node].b; ++i)
-			{
-				Triangle& t = triangleData[triangles[i]];
-				#if 0
-				if (debug && !debugMeshTrace2)
-				{
-					PRINTVEC3(b.bmin);
-					PRINTVEC3(b.bmax);
-					debugTriangles2.push_back((b.bmin + b.bmax) * 0.5f);
-					debugTriangles2.push_back(t.a + (t.u + t.v) / 3.0f);
-				
-					debugTriangles3.push_back(t.a);
-					debugTriangles3.push_back(t.n);
-					debugTriangles3.push_back(t.a+t.u);
-					debugTriangles3.push_back(t.n);
-					debugTriangles3.push_back(t.a+t.v);
-					debugTriangles3.push_back(t.n);
-				}
-				#endif
-				if (ray.lastHit.find(&t) != ray.lastHit.end())
-					continue;
-				if (intersectRayTriangle(ray, t, testHit) && testHit.time > start && testHit.time <= end)
-				{
-					testHit.triangle = &t;
-					hits.push_back(testHit);
-				}
-			}
-			
-			std::sort(hits.begin(), hits.end(), hitInfoCompare);
-			
-			for (size_t i = 0; i < hits.size(); ++i)
-			{
-				HitInfo& hit = hits[i];
-				//ray.lastHit.insert(hit.triangle);
-				hit.interp = interpolateVertex(hit.triangle->verts[0], hit.triangle->verts[1], hit.triangle->verts[2], hit.s, hit.t);
-				hit.interp.n.normalize();
-				
-				#if GLOBAL_TRACE_DEBUG
-				printf("FOUND\n");
-				#endif
-				
-				if (hitSurface(colour, ray, hit, rays, sampleOffset, traceFlags))
-					return true;
-				//colour += 0.1f;
-			}
+		//key on direction octant first, then the Morton order of the start on a 1024^3 grid over the batch
+		vec3f bmin = wave[0].ray.start;
+		vec3f bmax = bmin;
+		for (int i = 1; i < (int)wave.size(); ++i)
+		{
+			bmin = vmin(bmin, wave[i].ray.start);
+			bmax = vmax(bmax, wave[i].ray.start);
 		}
-		else
+		vec3f size = bmax - bmin;
+		vec3f scale(1023.0f / mymax(size.x, 1e-6f), 1023.0f / mymax(size.y, 1e-6f), 1023.0f / mymax(size.z, 1e-6f));
+		order.resize(wave.size());
+		for (int i = 0; i < (int)wave.size(); ++i)
 		{
-			const int& axis = tree[node].type;
-			const float& pos = tree[node].split;
-		
-			const float& grad = ray.dir[axis];
-			float startPos = ray.start[axis] + grad * start;
-			float endPos = ray.start[axis] + grad * end;
-		
-			bool flip = grad < 0.0f;
-			uint startBranch = flip ? tree[node].b : tree[node].a;
-			uint endBranch = flip ? tree[node].a : tree[node].b;
-		
-			bool a_eq = startPos == pos;
-			bool b_eq = endPos == pos;
-			bool a = startPos > pos;
-			bool b = endPos > pos;
-			bool intersects = (grad != 0.0) && (a != b || a_eq || b_eq);
-		
-			float mid = end;
-			if (intersects)
-				mid = myclamp((pos - ray.start[axis]) / grad, start, end);
-				
-			if (flip != b || b_eq) //add end first because it's a stack
-				stack.push(TraceInterval(endBranch, intersects?(mid-0.00001f):start, end));
-				
-			if (flip == a || a_eq) //now the near branch will be searched first
-				stack.push(TraceInterval(startBranch, start, intersects?(mid+0.00001f):end));
-		
-			#if GLOBAL_TRACE_DEBUG
-			if (intersects)
-				assert(start <= mid && mid <= end);
-			assert((flip == a || a_eq) || (flip != b || b_eq));
-			#endif
-		
-			#if GLOBAL_TRACE_DEBUG
-			if (flip == a || a_eq)
-			{
-				for (int i = 0; i < depth; ++i)
-					printf("%c", "_+=#-|@"[i%7]);
-				printf("near: %f->%f (%i)\n", start, intersects?mid:end, startBranch);
-			}
-			#endif
-		
-			#if 0
-			if (intersects)
-			{
-				if (debug && !debugMeshTrace)
-				{
-					vec3f intPos = ray.start + ray.dir * mid;
-					debugTriangles.push_back(intPos);
-					debugTriangles.push_back(intPos + vec3f(0.01,0,0));
-					debugTriangles.push_back(intPos + vec3f(0.01,0.01,0));
-					debugTriangles.push_back(intPos);
-					debugTriangles.push_back(intPos + vec3f(0.01,0,0));
-					debugTriangles.push_back(intPos + vec3f(0.01,0,0.01));
-				}
-			}
-			#endif
-		
-		
-			#if GLOBAL_TRACE_DEBUG
-			if (flip != b || b_eq)
-			{
-				for (int i = 0; i < depth; ++i)
-					printf("%c", "_+=#-|@"[i%7]);
-				printf("far: %f->%f (%i)\n", intersects?mid:start, end, endBranch);
-			}
-			#endif
+			const Ray& ray = wave[i].ray;
+			vec3f dir = ray.end - ray.start;
+			uint octant = (dir.x < 0.0f ? 1 : 0) | (dir.y < 0.0f ? 2 : 0) | (dir.z < 0.0f ? 4 : 0);
+			vec3f cell = (ray.start - bmin) * scale;
+			order[i] = std::make_pair(((uint64_t)octant << 30) | mortonIndex3((uint)cell.x, (uint)cell.y, (uint)cell.z), i);
+		}
+		std::sort(order.begin(), order.end());
 		
+		//colour is additive, so each ray's result goes straight to its camera ray
+		for (int i = 0; i < (int)order.size(); ++i)
+		{
+			WaveRay& w = wave[order[i].second];
+			CameraRay& c = context.cameraRays[w.cameraRay];
+			context.random = w.random;
+			++context.stats.waveRays;
+			traceSpawned(context, c.colour, w.ray, context.rays, c.sampleOffset, TRACE_CAMERA | (c.debug ? TRACE_DEBUG : 0));
+			queueSpawned(context, w.cameraRay);
 		}
 	}
+}
+
+void TraceScene::performJob(TraceThreadJob& job, TraceContext& context)
+{
+	//pixels are added in 2x2 blocks, so consecutive camera rays can be traced in packets
+	context.cameraRays.clear();
+	TraceThreadJob pixel = job;
+	for (int by = job.y; by < job.y + job.h; by += 2)
+		for (int bx = job.x; bx < job.x + job.w; bx += 2)
+			for (pixel.y = by; pixel.y < mymin(by + 2, job.y + job.h); ++pixel.y)
+				for (pixel.x = bx; pixel.x < mymin(bx + 2, job.x + job.w); ++pixel.x)
+					addCameraRays(pixel, context, (pixel.y - job.y) * job.w + pixel.x - job.x);
 	
-	return false;
+	//trace scene
+	traceCameraRays(context);
+	
+	//add samples to the float buffer. each pixel belongs to one job, so no locking is needed
+	for (int i = 0; i < (int)context.cameraRays.size(); ++i)
+	{
+		const CameraRay& c = context.cameraRays[i];
+		int p = (job.y + c.pixel / job.w) * framebuffer.width + job.x + c.pixel % job.w;
+		//FIXME: was getting negative values at some point
+		vec4f sample = vmax(c.colour, vec4f(0.0f));
+		float luminance = vmin(sample.xyz(), vec3f(1.0f)).dot(vec3f(0.299f, 0.587f, 0.114f));
+		framebuffer.colour[p] += sample;
+		framebuffer.luminance[p] += luminance;
+		framebuffer.luminanceSq[p] += luminance * luminance;
+		++framebuffer.samples[p];
+	}
+	
+	//the image shows the mean so far, so a render can be watched as it progresses
+	for (int y = job.y; y < job.y + job.h; ++y)
+		for (int x = job.x; x < job.x + job.w; ++x)
+			toneMapPixel(y * framebuffer.width + x, job.img->data + (y * job.img->width + x) * job.img->channels, job.img->channels);
 }
-void TraceScene::addLight(mat44 transform, vec3f intensity, int samples, float radius, bool square)
+
+//framebuffer files hold the header then colour, luminance, luminanceSq and samples
+struct FramebufferHeader
 {
-	Light light;
-	light.center = vec3f(transform * vec4f(0.0f, 0.0f, 0.0f, 1.0f));
-	if (samples > 1)
+	char magic[8];
+	int32_t width, height, passes;
+};
+static const char framebufferMagic[8] = "PYFRAM2"; //2 added luminance
+
+void TraceScene::Framebuffer::resize(int w, int h)
+{
+	width = w;
+	height = h;
+	colour.resize(w * h);
+	luminance.resize(w * h);
+	luminanceSq.resize(w * h);
+	samples.resize(w * h);
+	clear();
+}
+
+void TraceScene::Framebuffer::clear()
+{
+	passes = 0;
+	std::fill(colour.begin(), colour.end(), vec4f(0.0f));
+	std::fill(luminance.begin(), luminance.end(), 0.0f);
+	std::fill(luminanceSq.begin(), luminanceSq.end(), 0.0f);
+	std::fill(samples.begin(), samples.end(), 0);
+}
+
+bool TraceScene::Framebuffer::add(const Framebuffer& other)
+{
+	//everything is a sum, so buffers merge exactly
+	if (other.width != width || other.height != height)
+		return false;
+	for (int i = 0; i < width * height; ++i)
 	{
-		if (square)
-			poissonSquare(light.samples, samples);
-		else
-			poissonDisc(light.samples, samples);
-		//for (int i = 0; i < (int)poisson.size(); ++i)
-		//	light.samples.push_back(vec3f(transform * vec4f(poisson[i] * radius, 0.0f, 1.0f)));
+		colour[i] += other.colour[i];
+		luminance[i] += other.luminance[i];
+		luminanceSq[i] += other.luminanceSq[i];
+		samples[i] += other.samples[i];
 	}
-	else
+	passes = mymax(passes, other.passes);
+	return true;
+}
+
+bool TraceScene::Framebuffer::save(const std::string& filename) const
+{
+	FramebufferHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, framebufferMagic, sizeof(framebufferMagic));
+	header.width = width;
+	header.height = height;
+	header.passes = passes;
+	FILE* file = fopen(filename.c_str(), "wb");
+	if (!file)
 	{
-		light.samples.push_back(vec2f(0.0f));
-		radius = 0.0f;
+		printf("Error: could not write framebuffer %s\n", filename.c_str());
+		return false;
 	}
-	light.transform = transform * mat44::scale(radius, radius, 1.0f);
-	light.intensity = intensity;// / (float)light.samples.size();
-	light.square = square;
-	lights.push_back(light);
+	size_t n = width * height;
+	bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+	ok = ok && (n == 0 || fwrite(&colour[0], sizeof(vec4f), n, file) == n);
+	ok = ok && (n == 0 || fwrite(&luminance[0], sizeof(float), n, file) == n);
+	ok = ok && (n == 0 || fwrite(&luminanceSq[0], sizeof(float), n, file) == n);
+	ok = ok && (n == 0 || fwrite(&samples[0], sizeof(int), n, file) == n);
+	ok = (fclose(file) == 0) && ok;
+	if (!ok)
+		printf("Error: could not write framebuffer %s\n", filename.c_str());
+	return ok;
 }
-void TraceScene::addMesh(VBOMesh* mesh, mat44 transform)
+
+bool TraceScene::Framebuffer::load(const std::string& filename)
 {
-	if (mesh->primitives != GL_TRIANGLES)
+	FILE* file = fopen(filename.c_str(), "rb");
+	if (!file)
+		return false;
+	FramebufferHeader header;
+	bool ok = fread(&header, sizeof(header), 1, file) == 1 && memcmp(header.magic, framebufferMagic, sizeof(framebufferMagic)) == 0 &&
+		header.width >= 0 && header.height >= 0;
+	if (ok)
 	{
-		printf("Error: Cannot raytrace non-triangle vbomesh.\n");
+		resize(header.width, header.height);
+		passes = header.passes;
+		size_t n = width * height;
+		ok = n == 0 || (fread(&colour[0], sizeof(vec4f), n, file) == n && fread(&luminance[0], sizeof(float), n, file) == n &&
+			fread(&luminanceSq[0], sizeof(float), n, file) == n && fread(&samples[0], sizeof(int), n, file) == n);
+	}
+	fclose(file);
+	if (!ok)
+	{
+		printf("Error: %s is not a framebuffer\n", filename.c_str());
+		resize(0, 0);
+	}
+	return ok;
+}
+
+//coordinator and workers exchange native structs, so both must be the same build
+struct RemoteHello
+{
+	char magic[8];
+	int32_t version;
+	int32_t threads;
+	uint64_t scene; //the worker's remoteKey(), which must match the coordinator's
+};
+static const char remoteMagic[8] = "PYTRACE";
+static const int32_t remoteVersion = 3;
+static const float remoteHelloTimeout = 5.0f; //seconds a new connection has to send its RemoteHello
+static const float remoteStallTimeout = 5.0f; //seconds a worker may stop partway through a message before it's dropped
+
+enum RemoteMessageType {
+	REMOTE_VIEW, //followed by a RemoteView
+	REMOTE_TILES, //followed by count RemoteTiles
+	REMOTE_RESULT, //followed by a RemoteTile and its RemotePixels, row by row
+	REMOTE_STATS, //followed by the TraceStats of the worker's last batch
+};
+struct RemoteMessage
+{
+	int32_t type;
+	int32_t render; //coordinator's renderId
+	int32_t count;
+};
+struct RemoteView
+{
+	Camera camera;
+	int32_t width, height, frame, pass;
+};
+struct RemoteTile
+{
+	int32_t index; //in the coordinator's tiles
+	int32_t x, y, w, h;
+};
+struct RemotePixel
+{
+	vec4f colour;
+	float luminance, luminanceSq;
+	int32_t samples;
+};
+
+uint64_t TraceScene::remoteKey()
+{
+	//workers add and build the scene themselves, so anything that changes the pixels they return must match.
+	//the camera, frame and pass come with each RemoteView instead
+	int counts[] = {(int)accel, dof.samples, gi.samples, gi.maxDepth, photons.emit, filtering.anisotropic, gloss.samples,
+		lightSampling.minLights, lightSampling.samples, wavefront.enabled ? 1 : 0, wavefront.maxRays, irradiance.enabled ? 1 : 0,
+		cullBackface ? 1 : 0, (int)materials.size(), (int)lights.size(), (int)instances.size()};
+	float values[] = {dof.focus, dof.aperture, gi.maxDistance, photons.maxDistance, irradiance.accuracy, irradiance.minRadius, irradiance.maxRadius, shadowScale};
+	uint64_t hash = buildKey();
+	hash = fnv1a(hash, counts, sizeof(counts));
+	hash = fnv1a(hash, values, sizeof(values));
+	hash = fnv1a(hash, &background, sizeof(background));
+	
+	for (int i = 0; i < (int)materials.size(); ++i)
+	{
+		const Material* m = materials[i];
+		float properties[] = {m->density, m->shininess, m->attenuation, m->index, m->gloss, m->internalTexture, m->unlit ? 1.0f : 0.0f};
+		hash = fnv1a(hash, properties, sizeof(properties));
+		hash = fnv1a(hash, &m->colour, sizeof(m->colour));
+		hash = fnv1a(hash, &m->ambient, sizeof(m->ambient));
+		hash = fnv1a(hash, &m->specular, sizeof(m->specular));
+		hash = fnv1a(hash, &m->reflect, sizeof(m->reflect));
+		hash = fnv1a(hash, &m->transmit, sizeof(m->transmit));
+		const MaterialTexture* textures[] = {&m->imgColour, &m->imgNormal, &m->imgSpecular};
+		for (int t = 0; t < 3; ++t)
+			hash = fnv1a(hash, textures[t]->filename.c_str(), textures[t]->filename.size() + 1);
+	}
+	uint64_t lightHash = lightsKey();
+	hash = fnv1a(hash, &lightHash, sizeof(lightHash));
+	for (int i = 0; i < (int)instances.size(); ++i)
+	{
+		hash = fnv1a(hash, &instances[i].prototype, sizeof(instances[i].prototype));
+		hash = fnv1a(hash, &instances[i].transform, sizeof(instances[i].transform));
+	}
+	
+	//buildKey() covers the triangles the KD tree is built from, but not what's read once they're hit
+	if (triangleShading.size())
+		hash = fnv1a(hash, &triangleShading[0], triangleShading.size() * sizeof(TriangleShading));
+	if (vertexData.size())
+		hash = fnv1a(hash, &vertexData[0], vertexData.size() * sizeof(Vertex));
+	if (prototypeTriangles.size())
+		hash = fnv1a(hash, &prototypeTriangles[0], prototypeTriangles.size() * sizeof(Triangle));
+	if (prototypeShading.size())
+		hash = fnv1a(hash, &prototypeShading[0], prototypeShading.size() * sizeof(TriangleShading));
+	return hash;
+}
+void TraceScene::acceptWorker(float now)
+{
+	//the hello is only read once poll() says it's there, so a silent connection can't stall the render
+	RemoteWorker* worker = new RemoteWorker();
+	if (!listener.accept(worker->socket))
+	{
+		delete worker;
 		return;
 	}
-	if (!mesh->data && !mesh->sub[VBOMesh::VERTICES])
+	//poll() only says the first byte is there. a worker that stalls mid-message must fail the read rather than block it
+	worker->socket.setTimeout(remoteStallTimeout);
+	worker->sentAt = now;
+	connecting.push_back(worker);
+}
+void TraceScene::greetWorker(int index)
+{
+	RemoteWorker* worker = connecting[index];
+	connecting.erase(connecting.begin() + index);
+	RemoteHello hello;
+	bool ok = worker->socket.recv(&hello, sizeof(hello)) &&
+		memcmp(hello.magic, remoteMagic, sizeof(remoteMagic)) == 0 && hello.version == remoteVersion;
+	if (ok && hello.scene != remoteKey())
+	{
+		printf("Warning: dropping a worker with a different scene or settings\n");
+		ok = false;
+	}
+	if (!ok)
 	{
-		printf("Error: TraceScene::addMesh needs local data. load() but don't upload() before TraceScene::addMesh().\n");
+		delete worker;
 		return;
 	}
-	if (!mesh->has[VBOMesh::VERTICES] || !mesh->has[VBOMesh::NORMALS])
+	worker->threads = mymax(1, hello.threads);
+	worker->render = 0;
+	worker->sentAt = 0.0f;
+	workers.push_back(worker);
+	printf("Worker %i connected with %i threads\n", (int)workers.size() - 1, worker->threads);
+}
+void TraceScene::dropWorker(int worker, std::deque<int>& pending)
+{
+	//its tiles go to the front, so they're handed out again first
+	pending.insert(pending.begin(), workers[worker]->batch.begin(), workers[worker]->batch.end());
+	delete workers[worker];
+	workers.erase(workers.begin() + worker);
+}
+bool TraceScene::receiveResult(RemoteWorker* worker)
+{
+	RemoteMessage message;
+	if (!worker->socket.recv(&message, sizeof(message)))
+		return false;
+	if (message.type == REMOTE_STATS)
 	{
-		printf("Error: TraceScene::addMesh needs at least vertices and normals.\n");
-		return;
+		TraceStats stats;
+		if (!worker->socket.recv(&stats, sizeof(stats)))
+			return false;
+		if (message.render == renderId)
+			addStats(stats);
+		return true;
 	}
-
-	MyTimer timer;
-	timer.time();
 	
-	mat44 normalMatrix = transform.inverse().transpose();
-	bool hasTexCoords = mesh->has[VBOMesh::TEXCOORDS];
-	bool hasTangents = mesh->has[VBOMesh::TANGENTS];
+	RemoteTile tile;
+	if (message.type != REMOTE_RESULT || !worker->socket.recv(&tile, sizeof(tile)) || tile.w < 0 || tile.h < 0 || tile.w * tile.h > (1 << 20))
+		return false;
+	std::vector<RemotePixel> pixels(tile.w * tile.h);
+	if (pixels.size() && !worker->socket.recv(&pixels[0], (int)(pixels.size() * sizeof(RemotePixel))))
+		return false;
 	
-	int offset = (int)triangleData.size();
-	int matOffset = (int)materials.size();
-	int vertOffset = (int)vertexData.size();
+	//late results of a cancelled render are dropped, as are tiles the worker was never sent
+	std::vector<int>::iterator sent = std::find(worker->batch.begin(), worker->batch.end(), tile.index);
+	if (message.render != renderId || sent == worker->batch.end())
+		return true;
+	TraceTile& t = tiles[tile.index];
+	if (tile.x != t.x || tile.y != t.y || tile.w != t.w || tile.h != t.h)
+		return false;
+	worker->batch.erase(sent);
 	
-	//make some more room for this mesh's triangles
-	int numTriangles = mesh->numIndices / 3;
-	int numVertices = mesh->numVertices;
-	triangleBounds.resize(offset + numTriangles);
-	triangleData.resize(offset + numTriangles);
-	vertexData.resize(vertOffset + numVertices);
+	QI::Image* image = renderInfo.image;
+	for (int y = 0; y < t.h; ++y)
+	{
+		for (int x = 0; x < t.w; ++x)
+		{
+			const RemotePixel& pixel = pixels[y * t.w + x];
+			int p = (t.y + y) * framebuffer.width + t.x + x;
+			framebuffer.colour[p] += pixel.colour;
+			framebuffer.luminance[p] += pixel.luminance;
+			framebuffer.luminanceSq[p] += pixel.luminanceSq;
+			framebuffer.samples[p] += pixel.samples;
+			toneMapPixel(p, image->data + ((t.y + y) * image->width + t.x + x) * image->channels, image->channels);
+		}
+	}
+	++t.passes;
+	pixelsComplete.fetch_add(t.w * t.h, std::memory_order_relaxed);
+	return true;
+}
+void TraceScene::distribute()
+{
+	//workers stay connected between renders, so only a new address needs a new listener
+	if (listening != distributed.address)
+	{
+		for (int i = 0; i < (int)workers.size(); ++i)
+			delete workers[i];
+		workers.clear();
+		for (int i = 0; i < (int)connecting.size(); ++i)
+			delete connecting[i];
+		connecting.clear();
+		listening.clear();
+		if (!listener.listen(distributed.address))
+			return;
+		listening = distributed.address;
+	}
+	if (workers.size() == 0)
+		printf("Waiting for workers on %s\n", listening.c_str());
+	
+	//batches left over from a cancelled render will come back with the old renderId and be ignored
+	++renderId;
+	for (int i = 0; i < (int)workers.size(); ++i)
+		workers[i]->batch.clear();
+	for (int i = 0; i < (int)connecting.size(); ++i)
+		connecting[i]->sentAt = 0.0f; //the clock restarts with each render
+	std::deque<int> pending;
+	for (int i = 0; i < (int)tiles.size(); ++i)
+		pending.push_back(i);
+	
+	RemoteView view;
+	view.camera = *renderInfo.camera;
+	view.width = renderInfo.image->width;
+	view.height = renderInfo.image->height;
+	view.frame = frame;
+	view.pass = renderInfo.pass;
 	
-	//duplicate materials. it is assumed the mesh has used MaterialCache and the material pointers remain valid
-	materials.resize(matOffset + mesh->materials.size());
-	for (int i = 0; i < (int)mesh->materials.size(); ++i)
+	MyTimer timer;
+	timer.time();
+	float now = 0.0f;
+	std::vector<Socket*> sockets;
+	std::vector<bool> readable;
+	std::vector<RemoteTile> batch;
+	while (true)
 	{
-		int matIndex = matOffset + i;
-		materials[matIndex] = dynamic_cast<Material*>(mesh->materials[i]);
-		if (materials[matIndex] == NULL)
-			materials[matIndex] = defaultMaterial;
-		else
-			materials[matIndex]->keepLocal = true;
+		renderInfo.threadMutex.lock();
+		bool cancelled = renderInfo.cancelled;
+		renderInfo.threadMutex.unlock();
+		if (cancelled)
+			break;
 		
-		materials[matIndex]->transmits = materials[matIndex]->transmit.sizesq() != 0.0f;
-		materials[matIndex]->reflects = materials[matIndex]->reflect.sizesq() != 0.0f;
-		shootPhotons = shootPhotons || materials[matIndex]->transmits || materials[matIndex]->reflects;
+		//idle workers take the next run of tiles along the curve, so each batch covers a compact region.
+		//faster workers come back sooner and take more batches
+		bool busy = false;
+		for (int i = 0; i < (int)workers.size(); ++i)
+		{
+			RemoteWorker* worker = workers[i];
+			if (worker->batch.size() == 0 && pending.size())
+			{
+				bool ok = true;
+				RemoteMessage message;
+				message.render = renderId;
+				if (worker->render != renderId)
+				{
+					message.type = REMOTE_VIEW;
+					message.count = 0;
+					ok = worker->socket.send(&message, sizeof(message)) && worker->socket.send(&view, sizeof(view));
+					worker->render = renderId;
+				}
+				
+				int count = mymin((int)pending.size(), mymax(1, worker->threads * distributed.tilesPerThread));
+				batch.resize(count);
+				for (int j = 0; j < count; ++j)
+				{
+					const TraceTile& t = tiles[pending.front()];
+					batch[j].index = pending.front();
+					batch[j].x = t.x;
+					batch[j].y = t.y;
+					batch[j].w = t.w;
+					batch[j].h = t.h;
+					worker->batch.push_back(pending.front());
+					pending.pop_front();
+				}
+				message.type = REMOTE_TILES;
+				message.count = count;
+				ok = ok && worker->socket.send(&message, sizeof(message)) && worker->socket.send(&batch[0], count * sizeof(RemoteTile));
+				worker->sentAt = now;
+				if (!ok)
+				{
+					printf("Lost worker %i\n", i);
+					dropWorker(i--, pending);
+					continue;
+				}
+			}
+			busy = busy || worker->batch.size() > 0;
+		}
+		if (!busy && pending.size() == 0)
+			break;
 		
-		if (materials[matIndex]->imgColour.mipmaps.size() == 1)
-			materials[matIndex]->imgColour.generateHostMipmaps();
+		//wake regularly to check for cancelling and timeouts
+		int connectingAt = 1 + (int)workers.size();
+		sockets.resize(connectingAt + connecting.size());
+		sockets[0] = &listener;
+		for (int i = 0; i < (int)workers.size(); ++i)
+			sockets[i + 1] = &workers[i]->socket;
+		for (int i = 0; i < (int)connecting.size(); ++i)
+			sockets[connectingAt + i] = &connecting[i]->socket;
+		if (Socket::poll(sockets, readable, 0.05f) < 0)
+		{
+			//retrying would spin without waiting. the render stops with the tiles it has
+			printf("Error: polling worker sockets failed\n");
+			break;
+		}
+		now += timer.time() * 0.001f;
 		
-		if (cullBackface && materials[matIndex]->transmits)
-			printf("Warning: Transmissive material added with backface culling on.\n");
+		//backwards, so dropping a worker doesn't shift the ones still to check
+		for (int i = (int)workers.size() - 1; i >= 0; --i)
+		{
+			if (readable[i + 1] && !receiveResult(workers[i]))
+			{
+				printf("Lost worker %i\n", i);
+				dropWorker(i, pending);
+			}
+			else if (distributed.timeout > 0.0f && workers[i]->batch.size() && now - workers[i]->sentAt > distributed.timeout)
+			{
+				printf("Worker %i timed out\n", i);
+				dropWorker(i, pending);
+			}
+		}
+		
+		//new workers are appended, so they don't move the connections still to check
+		for (int i = (int)connecting.size() - 1; i >= 0; --i)
+		{
+			if (readable[connectingAt + i])
+				greetWorker(i);
+			else if (now - connecting[i]->sentAt > remoteHelloTimeout)
+			{
+				printf("Warning: dropping a connection that sent no hello\n");
+				delete connecting[i];
+				connecting.erase(connecting.begin() + i);
+			}
+		}
+		if (readable[0])
+			acceptWorker(now);
 	}
+}
+bool TraceScene::serve(int nthreads)
+{
+	if (nthreads <= 0)
+		return false;
 	
-	//get mesh data iterators
-	InterleavedEditor<vec3f> verts = mesh->getAttrib<vec3f>(VBOMesh::VERTICES);
-	InterleavedEditor<vec3f> norms = mesh->getAttrib<vec3f>(VBOMesh::NORMALS);
-	InterleavedEditor<vec2f> texcs;
-	InterleavedEditor<vec3f> tangents;
-	if (hasTexCoords)
-		texcs = mesh->getAttrib<vec2f>(VBOMesh::TEXCOORDS);
-	if (hasTangents)
-		tangents = mesh->getAttrib<vec3f>(VBOMesh::TANGENTS);
-	
-	if (offset == 0)
+	//the coordinator only listens once render() is called, so give it a moment
+	Socket socket;
+	for (int attempt = 0; !socket.connect(distributed.address); ++attempt)
 	{
-		sceneBounds.bmin = verts[0];
-		sceneBounds.bmax = verts[0];
+		if (attempt == 100)
+		{
+			printf("Error: no coordinator at %s\n", distributed.address.c_str());
+			return false;
+		}
+		mysleep(0.1f);
 	}
+	RemoteHello hello;
+	memset(&hello, 0, sizeof(hello));
+	memcpy(hello.magic, remoteMagic, sizeof(remoteMagic));
+	hello.version = remoteVersion;
+	hello.threads = nthreads;
+	dof.samples = mymax(1, dof.samples); //as in render(), which the coordinator's remoteKey() sees
+	hello.scene = remoteKey();
+	if (!socket.send(&hello, sizeof(hello)))
+		return false;
+	printf("Serving %s with %i threads\n", distributed.address.c_str(), nthreads);
 	
-	std::vector<VBOMeshFaceset> meshFacesets;
-	for (VBOMesh::Facesets::iterator it = mesh->facesets.begin(); it != mesh->facesets.end(); ++it)
-		meshFacesets.push_back(it->second);
-	
-	//start copying out and processing the mesh data
-	int faceset = 0;
-	for (int i = 0; i < numTriangles; ++i)
+	//the usual render threads trace each batch, through the image and framebuffer of the coordinator's view
+	cancel();
+	for (int i = 0; i < nthreads; ++i)
 	{
-		int mat = 0; //default material
-		while (faceset < (int)meshFacesets.size() && i*3 >= meshFacesets[faceset].endIndex)
-			++faceset;
-		if (faceset < (int)meshFacesets.size() && i*3 >= meshFacesets[faceset].startIndex && i*3 < meshFacesets[faceset].endIndex)
-			mat = matOffset + meshFacesets[faceset].material; //triangle's material
+		TraceThread* thread = new TraceThread(this);
+		thread->id = i;
+		threads.push_back(thread);
+	}
+	QI::Image image;
+	Camera camera;
+	renderInfo.image = &image;
+	renderInfo.camera = &camera;
+	renderInfo.previewBlock = 1;
+	
+	int render = -1;
+	RemoteMessage message;
+	std::vector<RemoteTile> batch;
+	std::vector<RemotePixel> pixels;
+	std::vector<int> active;
+	while (socket.recv(&message, sizeof(message)))
+	{
+		if (message.type == REMOTE_VIEW)
+		{
+			RemoteView view;
+			if (!socket.recv(&view, sizeof(view)) || view.width <= 0 || view.height <= 0)
+				break;
+			camera = view.camera;
+			frame = view.frame;
+			renderInfo.pass = view.pass;
+			renderInfo.view = (camera.getProjection() * camera.getInverse()).inverse();
+			image.resize(view.width, view.height);
+			framebuffer.resize(view.width, view.height);
+			initSampling(nthreads);
+			irradianceCache.clear();
+			render = message.render;
+			continue;
+		}
+		if (message.type != REMOTE_TILES || message.render != render || message.count <= 0 || message.count > (1 << 20))
+			break;
 		
-		vec3f a = vec3f(transform * vec4f(verts[mesh->dataIndices[i*3+0]], 1.0f));
-		vec3f b = vec3f(transform * vec4f(verts[mesh->dataIndices[i*3+1]], 1.0f));
-		vec3f c = vec3f(transform * vec4f(verts[mesh->dataIndices[i*3+2]], 1.0f));
-		vec3f u = b - a;
-		vec3f v = c - a;
-		triangleData[offset + i].a = a;
-		triangleData[offset + i].u = b - a;
-		triangleData[offset + i].v = c - a;
-		triangleData[offset + i].n = u.cross(v).unit();
-		triangleData[offset + i].d_uv = u.dot(v);
-		triangleData[offset + i].d_uu = u.dot(u);
-		triangleData[offset + i].d_vv = v.dot(v);
-		triangleData[offset + i].uvuuvv = (triangleData[offset + i].d_uv*triangleData[offset + i].d_uv - triangleData[offset + i].d_uu*triangleData[offset + i].d_vv);
-		triangleData[offset + i].material = mat;
-		triangleData[offset + i].verts[0] = vertOffset + mesh->dataIndices[i*3+0];
-		triangleData[offset + i].verts[1] = vertOffset + mesh->dataIndices[i*3+1];
-		triangleData[offset + i].verts[2] = vertOffset + mesh->dataIndices[i*3+2];
-		triangleBounds[offset + i].bmin = vmin(vmin(a, b), c);
-		triangleBounds[offset + i].bmax = vmax(vmax(a, b), c);
-		sceneBounds.bmin = vmin(sceneBounds.bmin, triangleBounds[offset + i].bmin);
-		sceneBounds.bmax = vmax(sceneBounds.bmax, triangleBounds[offset + i].bmax);
+		batch.resize(message.count);
+		if (!socket.recv(&batch[0], message.count * sizeof(RemoteTile)))
+			break;
+		bool ok = true;
+		tiles.resize(batch.size());
+		active.resize(batch.size());
+		for (int i = 0; i < (int)batch.size(); ++i)
+		{
+			const RemoteTile& b = batch[i];
+			ok = ok && b.x >= 0 && b.y >= 0 && b.w > 0 && b.h > 0 && b.x + b.w <= image.width && b.y + b.h <= image.height;
+			tiles[i].x = b.x;
+			tiles[i].y = b.y;
+			tiles[i].w = b.w;
+			tiles[i].h = b.h;
+			tiles[i].passes = 0;
+			tiles[i].error = 0.0f;
+			active[i] = i;
+		}
+		if (!ok)
+			break;
+		
+		//a tile is only sent once per render, but clear it in case the coordinator re-issued it here
+		for (int i = 0; i < (int)tiles.size(); ++i)
+		{
+			for (int y = tiles[i].y; y < tiles[i].y + tiles[i].h; ++y)
+			{
+				int p = y * framebuffer.width + tiles[i].x;
+				std::fill(framebuffer.colour.begin() + p, framebuffer.colour.begin() + p + tiles[i].w, vec4f(0.0f));
+				std::fill(framebuffer.luminance.begin() + p, framebuffer.luminance.begin() + p + tiles[i].w, 0.0f);
+				std::fill(framebuffer.luminanceSq.begin() + p, framebuffer.luminanceSq.begin() + p + tiles[i].w, 0.0f);
+				std::fill(framebuffer.samples.begin() + p, framebuffer.samples.begin() + p + tiles[i].w, 0);
+			}
+		}
+		renderInfo.threadMutex.lock();
+		startPass(active);
+		renderInfo.threadMutex.unlock();
+		for (int i = 0; i < nthreads; ++i)
+			threads[i]->wait();
+		
+		//stats are passed on rather than kept, so the coordinator's getStats() covers every worker. they go
+		//before the tiles, as the coordinator stops reading once it has every tile
+		statsMutex.lock();
+		TraceStats stats = traceStats;
+		traceStats = TraceStats();
+		statsMutex.unlock();
+		message.type = REMOTE_STATS;
+		message.count = 0;
+		ok = socket.send(&message, sizeof(message)) && socket.send(&stats, sizeof(stats));
+		for (int i = 0; i < (int)batch.size() && ok; ++i)
+		{
+			const RemoteTile& b = batch[i];
+			pixels.resize(b.w * b.h);
+			for (int y = 0; y < b.h; ++y)
+			{
+				for (int x = 0; x < b.w; ++x)
+				{
+					int p = (b.y + y) * framebuffer.width + b.x + x;
+					RemotePixel& pixel = pixels[y * b.w + x];
+					pixel.colour = framebuffer.colour[p];
+					pixel.luminance = framebuffer.luminance[p];
+					pixel.luminanceSq = framebuffer.luminanceSq[p];
+					pixel.samples = framebuffer.samples[p];
+				}
+			}
+			message.type = REMOTE_RESULT;
+			message.count = 1;
+			ok = socket.send(&message, sizeof(message)) && socket.send(&b, sizeof(b)) && socket.send(&pixels[0], (int)(pixels.size() * sizeof(RemotePixel)));
+		}
+		if (!ok)
+			break;
 	}
-	for (int i = 0; i < numVertices; ++i)
+	printf("Coordinator at %s disconnected\n", distributed.address.c_str());
+	
+	for (int i = 0; i < (int)threads.size(); ++i)
+		delete threads[i];
+	threads.clear();
+	tiles.clear();
+	renderInfo.image = NULL;
+	renderInfo.camera = NULL;
+	return true;
+}
+void TraceScene::toneMapPixel(int pixel, unsigned char* out, int channels)
+{
+	int n = framebuffer.samples[pixel];
+	toneMapColour(n > 0 ? framebuffer.colour[pixel] / (float)n : vec4f(0.0f), out, channels);
+}
+void TraceScene::toneMapColour(const vec4f& colour, unsigned char* out, int channels)
+{
+	for (int c = 0; c < channels; ++c)
 	{
-		vertexData[vertOffset + i].n = normalMatrix * norms[i];
-		vertexData[vertOffset + i].n.normalize();
-		vertexData[vertOffset + i].t = hasTexCoords ? texcs[i] : vec2f(0.0f);
-		vertexData[vertOffset + i].ts = transform * (hasTangents ? tangents[i] : vec3f(1.0f, 0.0f, 0.0f));
+		float x = colour[c];
+		if (c < 3)
+		{
+			x *= toneMapping.exposure;
+			if (toneMapping.op == TONE_REINHARD)
+				x = x / (1.0f + x);
+			if (toneMapping.gamma != 1.0f)
+				x = pow(mymin(x, 1.0f), 1.0f / toneMapping.gamma);
+		}
+		out[c] = (unsigned char)myclamp((int)(x * 255.0f), 0, 255);
 	}
-	printf("Time to addMesh(): %f, %i polys\n", timer.time(), numTriangles);
 }
 
-bool TraceScene::trace(vec4f& colour, TraceStack& rays, int sampleOffset, int traceFlags)
+static const int queryChunkSize = 1024; //segments taken at a time by each query thread
+
+void TraceScene::queryRange(TraceContext& context, const RayQuery* queries, QueryHit* hits, bool* occluded, int begin, int end)
 {
-	while (rays.size() > 0)
+	//only what intersection reads is set. no differentials, intensity or TraceStack
+	Ray ray;
+	ray.lastHit.clear();
+	HitInfo hit;
+	for (int i = begin; i < end; ++i)
 	{
-		Ray ray = rays.top();
+		ray.start = queries[i].start;
+		ray.end = queries[i].end;
 		ray.dir = ray.end - ray.start;
-		rays.pop();
-		
-		//non GI rays with small light contribution are discarded
-		if (!(ray.mask & Ray::GLOBAL) && ray.intensity.x < 0.2/256.0f && ray.intensity.y < 0.2/256.0f && ray.intensity.z < 0.2/256.0f)
-			continue;
-		
-		//just in case I've messed up
-		if (ray.canary > 100)
-		{
-			printf("Canary died (%s):\n\t%i SHADOW\n\t%i GLOBAL\n\t%i TRANSPARENT\n\t%i REFRACT\n\t%i REFLECT\n",
-				(traceFlags & TRACE_PHOTON) ? "photon" : ((traceFlags & TRACE_SHADOW) ? "shadow" : "camera"),
-				(int)((ray.mask & Ray::SHADOW) > 0),
-				(int)((ray.mask & Ray::GLOBAL) > 0),
-				(int)((ray.mask & Ray::TRANSPARENT) > 0),
-				(int)((ray.mask & Ray::REFRACT) > 0),
-				(int)((ray.mask & Ray::REFLECT) > 0)
-				);
+		++context.stats.rays;
+		++context.stats.queryRays;
+		if (occluded)
+		{
+			occluded[i] = intersectAny(context, ray, hit, HIT_ANY); //any surface counts, however transmissive
 			continue;
 		}
-
-		HitInfo hitInfo;
-		bool found = trace(colour, ray, hitInfo, rays, sampleOffset, traceFlags);
-		
-		//TODO: background colour
-		if (!found && !(ray.mask & Ray::GLOBAL))
+		QueryHit& out = hits[i];
+		if (intersect(context, ray, hit, NULL))
+		{
+			out.time = hit.time;
+			out.s = hit.s;
+			out.t = hit.t;
+			out.instance = hit.instance;
+			if (hit.instance < 0)
+				out.triangle = (int)(hit.triangle - &triangleData[0]);
+			else
+				out.triangle = (int)(hit.triangle - &prototypeTriangles[prototypes[instances[hit.instance].prototype].first]);
+		}
+		else
 		{
-			float ratio = mymax(ray.dir.unit().y, 0.0f);
-			vec3f sky = interpLinear(vec3f(0.7, 0.8, 1.0), vec3f(0.3, 0.4, 0.6), ratio);
-			//if (ratio == 0.0)
-			//	sky = vec3f(0.4, 0.2, 0.0);
-			colour += vec4f(sky * ray.intensity.xyz(), 1.0f) * ray.intensity.w;
+			out.time = 1.0f;
+			out.s = out.t = 0.0f;
+			out.triangle = -1;
+			out.instance = -1;
 		}
 	}
-	
-	//colour += vec4f(mymax(0.0f, 1.0f - colour.w));
-	//colour.w = 1.0f;
-	return true;
 }
 
-void TraceScene::traceCameraRay(vec3f start, vec3f end, vec4f& colour, int sampleOffset, bool debugTrace)
+void TraceScene::QueryThread::run()
 {
-	if (debugTrace)
+	int chunk;
+	while ((chunk = nextChunk->fetch_add(1)) < ceil(count, queryChunkSize))
+		scene->queryRange(context, queries, hits, occluded, chunk * queryChunkSize, mymin(count, (chunk + 1) * queryChunkSize));
+}
+
+void TraceScene::runQueries(const RayQuery* queries, QueryHit* hits, bool* occluded, int count, int nthreads)
+{
+	if (count <= 0)
+		return;
+	if (triangles.size() == 0 && instanceBVH.size() == 0)
 	{
-		debugMutex.lock();
-		printf("Clearing Debug Rays\n");
-		debugPoints.clear();
-		debugRays.clear();
-		debugMutex.unlock();
+		printf("Warning: querying an empty scene. Did you build()?\n");
+		for (int i = 0; i < count; ++i)
+		{
+			if (occluded)
+				occluded[i] = false;
+			else
+			{
+				hits[i].time = 1.0f;
+				hits[i].s = hits[i].t = 0.0f;
+				hits[i].triangle = -1;
+				hits[i].instance = -1;
+			}
+		}
+		return;
 	}
 	
-	static Ray::Diff nodiff(vec3f(0.0f), vec3f(0.0f));
-	traceCameraRay(start, end, nodiff, nodiff, colour, sampleOffset, debugTrace);
+	//queries are independent and each writes only its own result, so threads just take the next chunk
+	std::atomic<int> nextChunk(0);
+	std::vector<QueryThread*> queryThreads(mymax(1, mymin(nthreads, ceil(count, queryChunkSize))));
+	for (int i = 0; i < (int)queryThreads.size(); ++i)
+	{
+		queryThreads[i] = new QueryThread();
+		queryThreads[i]->scene = this;
+		queryThreads[i]->queries = queries;
+		queryThreads[i]->hits = hits;
+		queryThreads[i]->occluded = occluded;
+		queryThreads[i]->count = count;
+		queryThreads[i]->nextChunk = &nextChunk;
+		if (i > 0)
+			queryThreads[i]->start();
+	}
+	queryThreads[0]->run(); //the calling thread helps
+	for (int i = 0; i < (int)queryThreads.size(); ++i)
+	{
+		queryThreads[i]->wait();
+		addStats(queryThreads[i]->context.stats);
+		delete queryThreads[i];
+	}
 }
 
-void TraceScene::traceCameraRay(vec3f start, vec3f end, Ray::Diff dx, Ray::Diff dy, vec4f& colour, int sampleOffset, bool debugTrace)
+void TraceScene::queryNearest(const RayQuery* queries, QueryHit* hits, int count, int nthreads)
 {
-	//debugTrace = true;
+	runQueries(queries, hits, NULL, count, nthreads);
+}
 
-	Ray startRay;
-	startRay.start = start;
-	startRay.end = end;
-	startRay.intensity = vec4f(1.0f, 1.0f, 1.0f, 1.0f);
-	startRay.depth = 0;
-	startRay.canary = 0;
-	startRay.mask = 0;
-	startRay.d[0] = -dx -dy;
-	startRay.d[1] = -dx + dy;
-	startRay.d[2] = dx + dy;
-	startRay.d[3] = dx -dy;
-	TraceStack rays;
-	rays.push(startRay);
-	
-	//resolve refraction/reflections and finally diffuse hits
-	trace(colour, rays, sampleOffset, TRACE_CAMERA | (debugTrace?TRACE_DEBUG:0));
+void TraceScene::queryAny(const RayQuery* queries, bool* occluded, int count, int nthreads)
+{
+	runQueries(queries, NULL, occluded, count, nthreads);
 }
 
-void TraceScene::tracePhotons()
+vec4f TraceScene::bakeTexel(TraceContext& context, const BakeTexel& texel, int index)
 {
-	printf("Photon mapping...\n");
+	context.random.seed(index, 0, frame);
+	
+	//the surface point, as if a ray had hit it
+	HitInfo hit;
+	hit.triangle = &triangleData[texel.triangle];
+	hit.instance = -1;
+	hit.s = texel.s;
+	hit.t = texel.t;
+	hit.time = 0.0f;
+	hit.backface = false;
+	hit.pos = hit.triangle->a + hit.triangle->u * texel.s + hit.triangle->v * texel.t;
+	interpolateHit(hit);
+	vec3f normal = hit.interp.n;
+	Ray from;
+	Ray::Diff noDiff(vec3f(0.0f), vec3f(0.0f));
+	initCameraRay(from, hit.pos, hit.pos, noDiff, noDiff);
+	from.lastHit.insert(hit.triangle, hit.instance);
+	
+	//what hitSurface() would multiply the diffuse colour by: lights, then photons, then GI
+	vec3f light(0.0f);
+	vec3f specular(0.0f);
+	sampleLights(context, from, normal, normal, 1.0f, false, context.rays, 0, false, light, specular);
+	if (photonMap.size())
+		gatherPhotons(context, hit.pos, normal, light);
+	if (gi.samplesHemisphere.size() > 0 && gi.maxDepth > 0)
+	{
+		IrradianceCache::Record record;
+		computeIrradiance(context, from, normal, 0, record);
+		light += record.irradiance;
+	}
 	
-	if (!photonTree)
-		photonTree = new RTree();
+	//cosine weighted fraction of the hemisphere that's open within occlusionDistance
+	float occlusion = 1.0f;
+	if (samplesOcclusion.size() > 0)
+	{
+		vec3f u, v;
+		createTangents(normal, u, v);
+		float a = context.random.unit()*2.0f*pi;
+		float ca = cos(a);
+		float sa = sin(a);
+		float open = 0.0f;
+		float total = 0.0f;
+		Ray probe = from;
+		HitInfo probeHit;
+		for (int i = 0; i < (int)samplesOcclusion.size(); ++i)
+		{
+			vec3f baseDir = samplesOcclusion[i];
+			vec3f dir(baseDir.x * ca + baseDir.y * sa, -baseDir.x * sa + baseDir.y * ca, baseDir.z);
+			dir = u * dir.x + v * dir.y + normal * dir.z;
+			probe.end = probe.start + dir.unit() * baking.occlusionDistance;
+			probe.dir = probe.end - probe.start;
+			++context.stats.rays;
+			++context.stats.shadowRays;
+			if (!intersectAny(context, probe, probeHit))
+				open += baseDir.z;
+			total += baseDir.z;
+		}
+		occlusion = open / total;
+	}
+	return vec4f(light, occlusion);
+}
 
-	//create direction distribution for photons
-	int emitSphereCount = mymax(1, (int)sqrt(photons.emit/(4*pi)));
-	poissonSphere(photons.emitSphere, emitSphereCount);
+void TraceScene::BakeThread::run()
+{
+	int row;
+	int height = (int)texels->size() / width;
+	while ((row = nextRow->fetch_add(1)) < height)
+	{
+		for (int x = 0; x < width; ++x)
+		{
+			int i = row * width + x;
+			if ((*texels)[i].triangle >= 0)
+				(*results)[i] = scene->bakeTexel(context, (*texels)[i], i);
+		}
+	}
+}
+
+bool TraceScene::bake(VBOMesh* mesh, QI::Image* lightmap, QI::Image* occlusion, int nthreads)
+{
+	std::map<VBOMesh*, int>::iterator it = meshTriangles.find(mesh);
+	if (it == meshTriangles.end() || !mesh->has[VBOMesh::TEXCOORDS])
+	{
+		printf("Error: bake() needs a mesh with texcoords given to addMesh()\n");
+		return false;
+	}
+	if (triangles.size() == 0 && instanceBVH.size() == 0)
+	{
+		printf("Error: baking an empty scene. Did you build()?\n");
+		return false;
+	}
+	QI::Image* target = lightmap ? lightmap : occlusion;
+	if (!target || (lightmap && occlusion && (lightmap->width != occlusion->width || lightmap->height != occlusion->height)))
+	{
+		printf("Error: bake() needs lightmap and occlusion images of the same size\n");
+		return false;
+	}
 	
-	photonPoints.clear();
-	photonInfo.clear();
+	MyTimer timer;
+	timer.time();
+	int width = target->width;
+	int height = target->height;
+	dof.samples = mymax(1, dof.samples);
+	initSampling(nthreads);
+	samplesOcclusion.clear();
+	if (occlusion && baking.occlusionSamples > 0)
+	{
+		RandomStream random;
+		random.seed(0, sampleOcclusion, frame);
+		poissonHemisphere(samplesOcclusion, baking.occlusionSamples, random);
+		for (int i = 0; i < (int)samplesOcclusion.size(); ++i)
+		{
+			samplesOcclusion[i] += vec3f(0, 0, 0.01f);
+			samplesOcclusion[i].normalize();
+		}
+	}
 	
-	TraceStack rays;
-		
-	size_t totalLightSamples = 0;
-	for (size_t l = 0; l < lights.size(); ++l)
-		totalLightSamples += lights[l].samples.size();
-		
-	int photonBatchMax = 500000;
+	//find the surface point under each texel centre. where charts overlap, the later triangle wins
+	BakeTexel empty = {-1, 0.0f, 0.0f};
+	std::vector<BakeTexel> texels(width * height, empty);
+	vec2f scale((float)width, (float)height);
+	for (int i = it->second; i < it->second + mesh->numIndices / 3; ++i)
+	{
+		const TriangleShading& cold = triangleShading[i];
+		vec2f a = vertexData[cold.verts[0]].t * scale;
+		vec2f u = vertexData[cold.verts[1]].t * scale - a;
+		vec2f v = vertexData[cold.verts[2]].t * scale - a;
+		float det = u.x * v.y - u.y * v.x;
+		if (myabs(det) < 1e-12f)
+			continue;
+		vec2f bmin = vmin(a, vmin(a + u, a + v));
+		vec2f bmax = vmax(a, vmax(a + u, a + v));
+		int x0 = mymax(0, (int)floor(bmin.x));
+		int y0 = mymax(0, (int)floor(bmin.y));
+		int x1 = mymin(width - 1, (int)floor(bmax.x));
+		int y1 = mymin(height - 1, (int)floor(bmax.y));
+		for (int y = y0; y <= y1; ++y)
+		{
+			for (int x = x0; x <= x1; ++x)
+			{
+				vec2f p = vec2f(x + 0.5f, y + 0.5f) - a;
+				float s = (p.x * v.y - p.y * v.x) / det;
+				float t = (u.x * p.y - u.y * p.x) / det;
+				if (s < 0.0f || t < 0.0f || s + t > 1.0f)
+					continue;
+				texels[y * width + x].triangle = i;
+				texels[y * width + x].s = s;
+				texels[y * width + x].t = t;
+			}
+		}
+	}
 	
-	int np = 0;
-	while (np < photons.emit)
+	//texels are independent and seeded by index, so the result doesn't depend on the thread count
+	std::vector<vec4f> results(width * height, vec4f(0.0f));
+	std::atomic<int> nextRow(0);
+	std::vector<BakeThread*> bakeThreads(mymax(1, nthreads));
+	for (int i = 0; i < (int)bakeThreads.size(); ++i)
+	{
+		bakeThreads[i] = new BakeThread();
+		bakeThreads[i]->scene = this;
+		bakeThreads[i]->texels = &texels;
+		bakeThreads[i]->results = &results;
+		bakeThreads[i]->width = width;
+		bakeThreads[i]->nextRow = &nextRow;
+		if (i > 0)
+			bakeThreads[i]->start();
+	}
+	bakeThreads[0]->run(); //the calling thread helps
+	for (int i = 0; i < (int)bakeThreads.size(); ++i)
 	{
+		bakeThreads[i]->wait();
+		addStats(bakeThreads[i]->context.stats);
+		delete bakeThreads[i];
+	}
 	
-		int photonBatch = mymin(photonBatchMax, photons.emit - np);
-		int photonBatchTarget = np + photonBatch;
-		printf("Creating %i -> %i Photons\n", np, photonBatchTarget);
-		
-		//shoot photons from lights
-		int p = 0;
-		if (lights.size() == 0)
-			photons.emitSphere.clear();
-		Quat randomRot = Quat::random();
-		while (np < photonBatchTarget)
+	//grow the charts a texel at a time, each new texel averaging its baked neighbours
+	std::vector<char> covered(width * height);
+	int baked = 0;
+	for (int i = 0; i < width * height; ++i)
+		baked += covered[i] = texels[i].triangle >= 0;
+	for (int pass = 0; pass < baking.padding; ++pass)
+	{
+		std::vector<char> grown = covered;
+		for (int y = 0; y < height; ++y)
 		{
-			for (size_t l = 0; l < lights.size(); ++l)
+			for (int x = 0; x < width; ++x)
 			{
-				size_t samples = lights[l].samples.size();
-				float photonRatio = totalLightSamples / (float)(photons.emit * samples);
-				float photonEmitArea = 4.0f * pi * photonRatio;
-				//FIXME: don't use a constant here
-				float deltaAngle = atan(photonEmitArea) * 200.0f;
-				for (size_t s = 0; s < samples; ++s)
+				if (covered[y * width + x])
+					continue;
+				vec4f sum(0.0f);
+				int n = 0;
+				for (int ny = mymax(0, y - 1); ny <= mymin(height - 1, y + 1); ++ny)
+					for (int nx = mymax(0, x - 1); nx <= mymin(width - 1, x + 1); ++nx)
+						if (covered[ny * width + nx])
+						{
+							sum += results[ny * width + nx];
+							++n;
+						}
+				if (n > 0)
 				{
-					Ray ray;
-					ray.start = lights[l].transform * vec4f(lights[l].samples[s], 0.0f, 1.0f);
-					ray.dir = (randomRot * photons.emitSphere[p]);
-					ray.intensity = vec4f(vec3f(0.01f), 1.0f);
-					ray.depth = 0;
-					ray.canary = 0;
-					ray.mask = 0;
-				
-					vec3f perp1 = ray.dir.cross(vec3f(0,0,1));
-					if (perp1.size() < 0.1f)
-						perp1 = ray.dir.cross(vec3f(0,1,0));
-					perp1.normalize();
-					vec3f perp2 = ray.dir.cross(perp1).unit();
-				
-					ray.d[0].P = ray.d[0].D = Quat(deltaAngle, perp1) * ray.dir - ray.dir;
-					ray.d[1].P = ray.d[1].D = Quat(deltaAngle, perp2) * ray.dir - ray.dir;
-					ray.d[2].P = ray.d[2].D = Quat(-deltaAngle, perp1) * ray.dir - ray.dir;
-					ray.d[3].P = ray.d[3].D = Quat(-deltaAngle, perp2) * ray.dir - ray.dir;
-				
-					ray.dir *= photons.maxDistance;
-					ray.end = ray.start + ray.dir;
-				
-					rays.push(ray);
-					p = (p+1)%photons.emitSphere.size();
-					if (p == 0)
-						randomRot = Quat::random();
-					++np;
+					results[y * width + x] = sum / (float)n;
+					grown[y * width + x] = 1;
 				}
 			}
 		}
-	
-		printf("Tracing Photons...\n");
-	
-		//resolve refraction/reflections and finally diffuse hits
-		vec4f colour(0.0f); //ignored - shooting photons, not tracing camera rays
-		//FIXME: do I need a sampleOffset?
-		trace(colour, rays, 0, TRACE_PHOTON | TRACE_DEBUG); //
+		covered.swap(grown);
 	}
 	
-	printf("%i Photon Hits\n", (int)photonPoints.size());
-	
-	//photonTree->setPoints((float*)&photonPoints[0], photonPoints.size());
-	//photonTree->rebuild();
-	MyTimer qwe;
-	qwe.time();
-	photonTree->clear();
-	for (int i = 0; i < (int)photonPoints.size(); ++i)
-		photonTree->insert(photonPoints[i] - photonInfo[i].radius, photonPoints[i] + photonInfo[i].radius, i);
-	printf("Took %.2fms to build the tree\n", qwe.time());
-	
-	printf("Photon Tree Built\n");
+	//8 bit, with lighting scaled by the tone mapping exposure and clamped. a fourth channel holds coverage
+	for (int i = 0; i < width * height; ++i)
+	{
+		if (lightmap)
+			for (int c = 0; c < lightmap->channels; ++c)
+				lightmap->data[i * lightmap->channels + c] = (unsigned char)myclamp((int)((c < 3 ? results[i][c] * toneMapping.exposure : (float)covered[i]) * 255.0f), 0, 255);
+		if (occlusion)
+			for (int c = 0; c < occlusion->channels; ++c)
+				occlusion->data[i * occlusion->channels + c] = (unsigned char)myclamp((int)((c < 3 ? results[i].w : (float)covered[i]) * 255.0f), 0, 255);
+	}
+	printf("Baked %i texels in %.2fms\n", baked, timer.time());
+	return true;
 }
 
-vec3f TraceScene::TraceThreadJob::get(float dx, float dy, float z)
+void TraceScene::ToneMapThread::run()
 {
-	vec4f point(2.0f * (x + 0.5f) / img->width - 1.0f + dx * 2.0f, 2.0f * (y + 0.5f) / img->height - 1.0f + dy * 2.0f, z * 2.0f - 1.0f, 1.0f);
-	point = view * point;
-	point /= point.w;
-	return point.xyz();
+	int row;
+	while ((row = nextRow->fetch_add(1)) < image->height)
+		for (int x = 0; x < image->width; ++x)
+			scene->toneMapPixel(row * image->width + x, image->data + (row * image->width + x) * image->channels, image->channels);
 }
 
-void TraceScene::performJob(TraceThreadJob& job)
+void TraceScene::toneMap(QI::Image* image, int nthreads)
 {
-	bool debug = (myabs(job.x-job.img->width/2) < 2) && (myabs(job.y-job.img->height/2) < 2);
+	if (!image || image->width != framebuffer.width || image->height != framebuffer.height)
+	{
+		printf("Error: tone mapping a %ix%i framebuffer into a different size image\n", framebuffer.width, framebuffer.height);
+		return;
+	}
 	
-	vec3f start = job.get(0.0f, 0.0f, 0.0f);
-	vec3f end = job.get(0.0f, 0.0f, 1.0f);
-	Ray::Diff dx, dy;
+	//rows are independent, so threads just take the next one
+	std::atomic<int> nextRow(0);
+	std::vector<ToneMapThread*> toneMapThreads(mymax(1, nthreads));
+	for (int i = 0; i < (int)toneMapThreads.size(); ++i)
+	{
+		toneMapThreads[i] = new ToneMapThread();
+		toneMapThreads[i]->scene = this;
+		toneMapThreads[i]->image = image;
+		toneMapThreads[i]->nextRow = &nextRow;
+		if (i > 0)
+			toneMapThreads[i]->start();
+	}
+	toneMapThreads[0]->run(); //the calling thread helps
+	for (int i = 0; i < (int)toneMapThreads.size(); ++i)
+	{
+		toneMapThreads[i]->wait();
+		delete toneMapThreads[i];
+	}
+}
 
-	//trace scene
-	vec4f colour(0.0f);
-	if (dof.samples <= 1)
+void TraceScene::performTile(TraceTile& tile, TraceThread* thread)
+{
+	TraceThreadJob job;
+	job.pass = renderInfo.pass;
+	job.view = renderInfo.view;
+	job.img = renderInfo.image;
+	job.cam = renderInfo.camera;
+	
+	//2x2 pixel blocks, so primary rays can be traced in packets. wavefront mode takes the whole tile
+	//as one job, so all of its secondary rays are sorted together. coarse preview passes take one job per block
+	int block = renderInfo.previewBlock;
+	int w = block > 1 ? block : (wavefront.enabled ? tile.w : 2);
+	int h = block > 1 ? block : (wavefront.enabled ? tile.h : 2);
+	for (job.y = tile.y; job.y < tile.y + tile.h; job.y += h)
 	{
-		dof.samples = 1;
-		
-		vec3f dir = end-start;
-		float p = 0.5f;
-		dx.P = job.get(p / job.img->width, 0.0f, 0.0f);
-		dy.P = job.get(0.0f, p / job.img->height, 0.0f);
-		dx.D = job.get(p / job.img->width, 0.0f, 1.0f) - dx.P;
-		dy.D = job.get(0.0f, p / job.img->height, 1.0f) - dy.P;
-		dx.P -= start;
-		dy.P -= start;
-		dx.D.normalize();
-		dy.D.normalize();
-		dir.normalize();
-		dx.D -= dir;
-		dy.D -= dir;
-		
-		traceCameraRay(start, end, dx, dy, colour, 0, debug);
+		for (job.x = tile.x; job.x < tile.x + tile.w; job.x += w)
+		{
+			if (thread->requestStop)
+				return;
+			job.w = mymin(w, tile.x + tile.w - job.x);
+			job.h = mymin(h, tile.y + tile.h - job.y);
+			if (block > 1)
+				performPreview(job, thread->context);
+			else
+				performJob(job, thread->context);
+		}
 	}
-	else
+	if (block > 1)
+		return; //preview passes don't add to the framebuffer or progress
+	++tile.passes;
+	pixelsComplete.fetch_add(tile.w * tile.h, std::memory_order_relaxed);
+}
+
+static uint mortonIndex(uint x, uint y)
+{
+	uint r = 0;
+	for (int b = 0; b < 16; ++b)
+		r |= (((x >> b) & 1) << (2 * b)) | (((y >> b) & 1) << (2 * b + 1));
+	return r;
+}
+
+static uint hilbertIndex(uint n, uint x, uint y)
+{
+	//n is the curve size, a power of two. http://en.wikipedia.org/wiki/Hilbert_curve
+	uint d = 0;
+	for (uint s = n / 2; s > 0; s /= 2)
 	{
-		vec3f toVec = end - start;
-		float length = toVec.size();
-		vec3f dir = toVec.unit();
-		vec3f focus = start + dir * (dof.focus - job.cam->getClipPlanes().x) / dir.dot(job.cam->toVec());
-		vec3f up = job.cam->upVec();
-		vec3f right = job.cam->rightVec();
-		//gaussianKernal(
-		assert((int)samplesDisc.size() == dof.samples);
-		
-		float a = UNIT_RAND*2.0f*pi;
-		float ca = cos(a);
-		float sa = sin(a);
-		
-		dx.P = right / (float)job.img->width;
-		dy.P = up / (float)job.img->height;
-			
-		for (int i = 0; i < (int)samplesDisc.size(); ++i)
+		uint rx = (x & s) > 0;
+		uint ry = (y & s) > 0;
+		d += s * s * ((3 * rx) ^ ry);
+		if (ry == 0)
 		{
-			//create rays, focusing on the "focus" point
-			vec2f offset = samplesDisc[i] * dof.aperture;
-			vec2f rotoffset(offset.x * ca + offset.y * sa, -offset.x * sa + offset.y * ca);
-			vec3f rayStart = job.cam->getZoomPos() + right * rotoffset.x + up * rotoffset.y;
-			vec3f dir = (focus - rayStart).unit();
-			vec3f rayEnd = start + dir * length;
-			
-			dx.D = focus - dx.P - rayStart;
-			dy.D = focus - dy.P - rayStart;
-			dx.D.normalize();
-			dy.D.normalize();
-			dx.D -= dir;
-			dy.D -= dir;
-		
-			//do the trace
-			vec4f tmp(0.0f);
-			traceCameraRay(rayStart, rayEnd, dx, dy, tmp, i, debug && i == 0);
-			//FIXME: was getting negative values at some point
-			//tmp = vmin(vmax(tmp, vec4f(0.0f)), vec4f(1.0f));
-			tmp = vmax(tmp, vec4f(0.0f));
-			colour += tmp;
+			if (rx == 1)
+			{
+				x = s - 1 - x;
+				y = s - 1 - y;
+			}
+			std::swap(x, y);
 		}
-		colour /= (float)samplesDisc.size();
 	}
+	return d;
+}
+
+void TraceScene::createTiles(int width, int height)
+{
+	int size = mymax(1, tiling.size);
+	vec2i count = ceil(vec2i(width, height), vec2i(size));
+	uint curveSize = nextPowerOf2(mymax(count.x, count.y));
+	
+	std::vector<std::pair<uint, int> > order;
+	for (int ty = 0; ty < count.y; ++ty)
+	{
+		for (int tx = 0; tx < count.x; ++tx)
+		{
+			uint key = (tiling.order == TILE_ORDER_MORTON) ? mortonIndex(tx, ty) : hilbertIndex(curveSize, tx, ty);
+			order.push_back(std::make_pair(key, ty * count.x + tx));
+		}
+	}
+	std::sort(order.begin(), order.end());
 	
-	//save colour
-	colour *= 255.0f;
-	for (int c = 0; c < job.img->channels; ++c)
-		job.img->data[(job.y*job.img->width+job.x)*job.img->channels+c] = 
-			(unsigned char)myclamp((int)colour[c], 0, 255);
+	tiles.resize(order.size());
+	for (int i = 0; i < (int)order.size(); ++i)
+	{
+		TraceTile& tile = tiles[i];
+		tile.x = (order[i].second % count.x) * size;
+		tile.y = (order[i].second / count.x) * size;
+		tile.w = mymin(size, width - tile.x);
+		tile.h = mymin(size, height - tile.y);
+		tile.passes = 0;
+		tile.error = 0.0f;
+	}
 }
 
-void TraceScene::run()
+uint64_t TraceScene::samplingKey()
 {
-	//unpack info from render() call
-	QI::Image* image = renderInfo.image;
-	Camera* camera = renderInfo.camera;
-	int nthreads = renderInfo.nthreads;
+	//the photons also depend on the triangles, but build() resets the key instead of hashing them
+	int counts[] = {frame, filtering.anisotropic, dof.samples, gi.samples, gloss.samples, photons.emit, shootPhotons ? 1 : 0, (int)lights.size()};
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	hash = fnv1a(hash, counts, sizeof(counts));
+	hash = fnv1a(hash, &photons.maxDistance, sizeof(photons.maxDistance));
+	uint64_t lightHash = lightsKey();
+	hash = fnv1a(hash, &lightHash, sizeof(lightHash));
+	return hash | 1; //never 0, which means nothing has been sampled
+}
+uint64_t TraceScene::lightsKey()
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (int l = 0; l < (int)lights.size(); ++l)
+	{
+		hash = fnv1a(hash, &lights[l].intensity, sizeof(lights[l].intensity));
+		hash = fnv1a(hash, &lights[l].center, sizeof(lights[l].center));
+		hash = fnv1a(hash, &lights[l].transform, sizeof(lights[l].transform));
+		hash = fnv1a(hash, &lights[l].square, sizeof(lights[l].square));
+		if (lights[l].samples.size())
+			hash = fnv1a(hash, &lights[l].samples[0], lights[l].samples.size() * sizeof(vec2f));
+	}
+	return hash;
+}
+void TraceScene::initSampling(int nthreads)
+{
+	//lights are public and may have been added or moved since build(). a stale tree would never pick the new ones
+	if (lightsKey() != lightsBuilt)
+		buildLights();
 	
-	jobMutex.lock();
-	renderInfo.initializingThreads = true;
-	jobMutex.unlock();
+	//re-rendering after a camera move keeps the photons, which are often the slowest part to restart
+	uint64_t key = samplingKey();
+	if (key == sampled)
+	{
+		printf("Reusing photons and sample patterns\n");
+		return;
+	}
+	sampled = key;
 	
-	//make sure the render doesn't get cancelled until sub threads have been created
-	printf("c init\n");
-	renderInfo.threadMutex.lock();
-	printf("c locked\n");
-	renderInfo.initMutex.lock();
-	printf("c init locked\n");
-	renderInfo.initialized = true;
-	printf("c init signaling\n");
-	renderInfo.initBarrier.signal();
-	printf("c init signaled\n");
-	renderInfo.initMutex.unlock();
-	printf("c init unlocked\n");
+	//sample patterns are shared by all pixels, so they come from one stream before threads start
+	RandomStream random;
+	random.seed(0, samplePatterns, frame);
 	
-	printf("Clearing Debug Rays\n");
-	debugPoints.clear();
-	debugRays.clear();
-
 	//create samples for texture filtering
 	if (filtering.anisotropic <= 0)
 	{
@@ -2018,7 +4956,7 @@ void TraceScene::run()
 	}
 	else
 	{
-		poissonSquare(filtering.samples, filtering.anisotropic);
+		poissonSquare(filtering.samples, filtering.anisotropic, random);
 		for (int i = 0; i < (int)filtering.samples.size(); ++i)
 			filtering.samples[i] = filtering.samples[i] * 0.5 + 0.5;
 	}
@@ -2026,7 +4964,7 @@ void TraceScene::run()
 
 	//shoot photons for the render
 	if (shootPhotons)
-		tracePhotons();
+		tracePhotons(nthreads);
 	else
 		printf("No photon mapping required\n");
 	
@@ -2034,14 +4972,14 @@ void TraceScene::run()
 	if (dof.samples > 1)
 	{
 		samplesDisc.clear();
-		poissonDisc(samplesDisc, dof.samples);
+		poissonDisc(samplesDisc, dof.samples, random);
 	}
 	
 	//create random hemisphere for GI
 	if (gi.samples > 1)
 	{
 		gi.samplesHemisphere.clear();
-		poissonHemisphere(gi.samplesHemisphere, gi.samples);
+		poissonHemisphere(gi.samplesHemisphere, gi.samples, random);
 		gi.totalDiffuse = 0.0f;
 		for (int i = 0; i < (int)gi.samplesHemisphere.size(); ++i)
 		{
@@ -2059,8 +4997,8 @@ void TraceScene::run()
 	{
 	
 		gloss.normalOffsets.clear();
-		poissonHemisphere(gloss.normalOffsets, gloss.samples);
-		gi.totalDiffuse = 0.0f;
+		poissonHemisphere(gloss.normalOffsets, gloss.samples, random);
+		gloss.totalDiffuse = 0.0f;
 		for (int i = 0; i < (int)gloss.normalOffsets.size(); ++i)
 		{
 			//zero-weight samples are useless
@@ -2071,48 +5009,228 @@ void TraceScene::run()
 			gloss.totalDiffuse += gloss.normalOffsets[i].z;
 		}
 	}
+}
+
+void TraceScene::run()
+{
+	//unpack info from render() call
+	QI::Image* image = renderInfo.image;
+	Camera* camera = renderInfo.camera;
+	int nthreads = renderInfo.nthreads;
+	
+	renderInfo.initializingThreads = true;
+	
+	//make sure the render doesn't get cancelled until sub threads have been created
+	printf("c init\n");
+	renderInfo.threadMutex.lock();
+	printf("c locked\n");
+	renderInfo.initMutex.lock();
+	printf("c init locked\n");
+	renderInfo.initialized = true;
+	printf("c init signaling\n");
+	renderInfo.initBarrier.signal();
+	printf("c init signaled\n");
+	renderInfo.initMutex.unlock();
+	printf("c init unlocked\n");
+	
+	printf("Clearing Debug Rays\n");
+	debugPoints.clear();
+	debugRays.clear();
+	
+	int levels = preview.enabled ? myclamp(preview.levels, 0, 8) : 0;
+	int block = 1 << levels;
+	renderInfo.previewBlock = block;
 
-	//generate jobs for each pixel
-	mat44 view = (camera->getProjection() * camera->getInverse()).inverse();
-	for (int y = 0; y < image->height; ++y)
+	//a coordinator doesn't trace anything itself
+	bool remote = distributed.address.size() > 0;
+	if (!remote)
+		initSampling(nthreads);
+
+	//split the image into tiles
+	renderInfo.view = (camera->getProjection() * camera->getInverse()).inverse();
+	createTiles(image->width, image->height);
+	totalPixels = image->width * image->height;
+	pixelsComplete = 0;
+	
+	//records from the last render may not match the scene or sampling. coarse preview passes don't
+	//trace GI, so the pre-pass waits until the full resolution passes are about to start
+	irradianceCache.clear();
+	bool prepass = !remote && irradiance.enabled && irradiance.prepass > 0 && gi.samplesHemisphere.size() > 0;
+	if (prepass && block == 1)
+		fillIrradianceCache(nthreads);
+	
+	//a resumed render continues the sample sequence, so it adds new samples rather than repeating old ones
+	if (!resume || framebuffer.width != image->width || framebuffer.height != image->height)
 	{
-		for (int x = 0; x < image->width; ++x)
-		{
-			TraceThreadJob job;
-			job.view = view;
-			job.img = image;
-			job.cam = camera;
-			job.x = x;
-			job.y = y;
-			jobs.push(job);
-		}
+		if (resume)
+			printf("Warning: can't resume a %ix%i framebuffer at %ix%i\n", framebuffer.width, framebuffer.height, image->width, image->height);
+		framebuffer.resize(image->width, image->height);
+	}
+	int firstPass = framebuffer.passes;
+	
+	if (remote)
+	{
+		renderInfo.pass = firstPass;
+		renderInfo.previewBlock = 1;
+		framebuffer.passes = firstPass + 1;
+		renderInfo.threadMutex.unlock();
+		renderInfo.initializingThreads = false;
+		distribute();
+		renderInfo.finished = true;
+		return;
 	}
-	totalJobs = (int)jobs.size();
 	
 	//must not have threads already running
 	assert(threads.size() == 0);
 	
-	//create threads
 	for (int i = 0; i < nthreads; ++i)
 	{
 		TraceThread* thread = new TraceThread(this);
 		thread->id = i;
-		thread->start();
 		threads.push_back(thread);
 	}
 	
+	MyTimer timer;
+	timer.time();
+	
+	std::vector<int> active(tiles.size());
+	for (int i = 0; i < (int)tiles.size(); ++i)
+		active[i] = i;
+	//coarse preview passes come first. they only write the image, so the first full pass is still firstPass
+	renderInfo.pass = firstPass;
+	if (block == 1)
+		framebuffer.passes = firstPass + 1;
+	startPass(active);
+	
 	renderInfo.threadMutex.unlock();
-	jobMutex.lock();
 	renderInfo.initializingThreads = false;
-	jobMutex.unlock();
 	printf("c unlocked\n");
+	
+	//each pass halves the block size. a new render() cancels between any two, so a camera move restarts at the coarsest
+	while (block > 1)
+	{
+		for (int i = 0; i < nthreads; ++i)
+			threads[i]->wait();
+		
+		//each level has a quarter of the rays of the one above, so only step when well outside the budget
+		if (block == 1 << levels && preview.frameTime > 0.0f)
+		{
+			float seconds = timer.time() * 0.001f;
+			if (seconds > preview.frameTime && (2 << levels) <= tiling.size)
+				preview.levels = levels + 1;
+			else if (seconds * 4.0f < preview.frameTime && levels > 1)
+				preview.levels = levels - 1;
+		}
+		
+		renderInfo.threadMutex.lock();
+		bool cancelled = renderInfo.cancelled;
+		if (!cancelled)
+		{
+			block /= 2;
+			renderInfo.previewBlock = block;
+			if (block == 1)
+			{
+				framebuffer.passes = firstPass + 1;
+				if (prepass)
+					fillIrradianceCache(nthreads);
+			}
+			startPass(active);
+		}
+		renderInfo.threadMutex.unlock();
+		if (cancelled)
+			return;
+	}
+	timer.time(); //progressive.maxTime covers full passes only
+	
+	if (!progressive.enabled)
+		return;
+	
+	//keep going until every tile has converged or the budget runs out. the threads are
+	//joined between passes, so each tile's error is measured from complete passes
+	float elapsed = 0.0f;
+	int pass = 1;
+	for (;; ++pass)
+	{
+		for (int i = 0; i < nthreads; ++i)
+			threads[i]->wait();
+		elapsed += timer.time() * 0.001f;
+		
+		active.clear();
+		for (int i = 0; i < (int)tiles.size(); ++i)
+		{
+			if (tiles[i].passes < pass)
+				continue; //converged in an earlier pass
+			tiles[i].error = tileError(tiles[i]);
+			if (pass < progressive.minPasses || tiles[i].error > progressive.threshold)
+				active.push_back(i);
+		}
+		if (active.size() == 0)
+			break;
+		if (progressive.maxPasses > 0 && pass >= progressive.maxPasses)
+			break;
+		if (progressive.maxTime > 0.0f && elapsed >= progressive.maxTime)
+			break;
+		
+		renderInfo.threadMutex.lock();
+		bool cancelled = renderInfo.cancelled;
+		if (!cancelled)
+		{
+			renderInfo.pass = firstPass + pass;
+			framebuffer.passes = firstPass + pass + 1;
+			startPass(active);
+		}
+		renderInfo.threadMutex.unlock();
+		if (cancelled)
+			break;
+	}
+	
+	progressive.passes = pass;
+	printf("Progressive render stopped after %i passes, %i of %i tiles unconverged, %.2fs\n", pass, (int)active.size(), (int)tiles.size(), elapsed);
+	renderInfo.finished = true;
+}
+void TraceScene::startPass(const std::vector<int>& active)
+{
+	//give each thread a contiguous run of the tile curve. all queues
+	//must be filled before any thread starts as idle threads steal from the others
+	int nthreads = (int)threads.size();
+	for (int i = 0; i < (int)active.size(); ++i)
+		threads[(int)((i * (int64_t)nthreads) / active.size())]->tiles.push_back(active[i]);
+	for (int i = 0; i < nthreads; ++i)
+	{
+		threads[i]->requestStop = false;
+		threads[i]->start();
+	}
+}
+float TraceScene::tileError(const TraceTile& tile)
+{
+	//standard error of each pixel's mean luminance, estimated from the variance between its samples
+	int n = tile.passes;
+	if (n < 2)
+		return 1.0f;
+	float maxError = 0.0f;
+	for (int y = tile.y; y < tile.y + tile.h; ++y)
+	{
+		for (int x = tile.x; x < tile.x + tile.w; ++x)
+		{
+			int p = y * framebuffer.width + x;
+			int samples = framebuffer.samples[p];
+			if (samples < 2)
+				return 1.0f;
+			//both moments are of the clamped sample luminance. the clamped mean colour would be brighter than
+			//the mean of clamped samples wherever samples pass 1, hiding the noise of highlights
+			float mean = framebuffer.luminance[p] / samples;
+			float variance = mymax(0.0f, framebuffer.luminanceSq[p] / samples - mean * mean) * samples / (samples - 1);
+			maxError = mymax(maxError, sqrt(variance / samples));
+		}
+	}
+	return maxError;
 }
 void TraceScene::render(QI::Image* image, Camera* camera, int nthreads)
 {
 	if (!image || !camera || nthreads <= 0)
 		return;
 	
-	if (triangles.size() == 0)
+	if (triangles.size() == 0 && instanceBVH.size() == 0)
 	{
 		printf("Warning: rendering an empty scene. Did you build()?\n");
 		return;
@@ -2122,7 +5240,6 @@ void TraceScene::render(QI::Image* image, Camera* camera, int nthreads)
 
 	//cleanup current/previous render
 	cancel();
-	mystdclear(jobs);
 	
 	//save info and start main render thread
 	renderInfo.image = image;
@@ -2130,6 +5247,8 @@ void TraceScene::render(QI::Image* image, Camera* camera, int nthreads)
 	renderInfo.nthreads = nthreads;
 	
 	renderInfo.initialized = false;
+	renderInfo.cancelled = false;
+	renderInfo.finished = false;
 	printf("t starting\n");
 	start();
 	printf("t started\n");
@@ -2148,6 +5267,7 @@ void TraceScene::cancel()
 {
 	//cannot cancel until child threads have been spawned
 	renderInfo.threadMutex.lock();
+	renderInfo.cancelled = true;
 	int runningThreads = 0;
 	for (int i = 0; i < (int)threads.size(); ++i)
 	{
@@ -2163,8 +5283,35 @@ void TraceScene::cancel()
 	
 	wait();
 }
+void TraceScene::performPreview(TraceThreadJob& job, TraceContext& context)
+{
+	//the pixel nearest the block's centre stands in for all of it. mirrors and glass still trace their rays,
+	//as without them they'd show the sky, but every surface is lit by the preview's headlight
+	TraceThreadJob pixel = job;
+	pixel.x = job.x + (job.w - 1) / 2;
+	pixel.y = job.y + (job.h - 1) / 2;
+	context.cameraRays.clear();
+	addCameraRays(pixel, context, 0);
+	CameraRay& c = context.cameraRays[0];
+	context.random.seed(c.imagePixel, c.sample, frame);
+	++context.stats.rays;
+	++context.stats.cameraRays;
+	if (!intersect(context, c.ray, c.hit, NULL) || !shade(context, c.colour, c.ray, c.hit, context.rays, c.sampleOffset, TRACE_CAMERA | TRACE_PREVIEW))
+		addSky(c.colour, c.ray);
+	trace(context, c.colour, context.rays, c.sampleOffset, TRACE_CAMERA | TRACE_PREVIEW);
+	
+	unsigned char out[4];
+	int channels = mymin(job.img->channels, 4);
+	toneMapColour(vmax(c.colour, vec4f(0.0f)), out, channels);
+	for (int y = job.y; y < job.y + job.h; ++y)
+		for (int x = job.x; x < job.x + job.w; ++x)
+			memcpy(job.img->data + (y * job.img->width + x) * job.img->channels, out, channels);
+}
 void TraceScene::wait()
 {
+	//wait for the main thread first, as it joins and restarts child threads between progressive passes
+	Thread::wait();
+	
 	//cannot wait until child threads have been spawned
 	renderInfo.threadMutex.lock();
 	for (int i = 0; i < (int)threads.size(); ++i)
@@ -2174,71 +5321,64 @@ void TraceScene::wait()
 	}
 	threads.clear();
 	renderInfo.threadMutex.unlock();
-	
-	//wait for the main thread
-	Thread::wait();
 }
 float TraceScene::getProgress()
 {
-	float ret;
-	jobMutex.lock();
+	//lock free. the counters are only ever reset before threads are started
 	if (renderInfo.initializingThreads)
-		ret = 0.0f;
-	else
-		ret = 1.0f - jobs.size() / (float)mymax(1, totalJobs);
-	jobMutex.unlock();
-	return ret;
+		return 0.0f;
+	if (progressive.enabled)
+	{
+		//the number of passes isn't known until tiles converge, so estimate against the pass budget
+		if (renderInfo.finished)
+			return 1.0f;
+		int budget = progressive.maxPasses > 0 ? progressive.maxPasses : progressive.minPasses;
+		return mymin(0.99f, pixelsComplete / (float)mymax(1, totalPixels * budget));
+	}
+	return pixelsComplete / (float)mymax(1, totalPixels);
 }
 
-#ifndef _WIN32
-#include <sys/time.h>
-#include <time.h>
-unsigned int timeGetTime()
+bool TraceScene::TraceThread::popTile(int& tile)
 {
-struct timeval now;
-gettimeofday(&now, NULL);
-return (now.tv_sec%1000)*1000000 + now.tv_usec;
-//return 0;
+	tileMutex.lock();
+	bool found = !tiles.empty();
+	if (found)
+	{
+		tile = tiles.front();
+		tiles.pop_front();
+	}
+	tileMutex.unlock();
+	return found;
 }
-#endif
 
-void TraceScene::TraceThread::run()
+bool TraceScene::TraceThread::stealTile(int& tile)
 {
-	bool hasJobs = true;
-	TraceThreadJob job;
-	while (hasJobs && !requestStop)
+	//take from the far end of another thread's run of the curve, starting with our neighbour
+	int n = (int)scene->threads.size();
+	for (int i = 1; i < n; ++i)
 	{
-		//get job
-		//printf("%u waiting\n", id);
-		DEBUGSTUFF qwe1 = {"lock", timeGetTime(), id};
-		//debugThreadStuff.push_back(qwe1);
-		scene->jobMutex.lock();
-		DEBUGSTUFF qwe2 = {"getjob", timeGetTime(), id};
-		//debugThreadStuff.push_back(qwe2);
-		//printf("%u getting\n", id);
-		hasJobs = !scene->jobs.empty();
-		if (hasJobs)
+		TraceThread* victim = scene->threads[(id + i) % n];
+		victim->tileMutex.lock();
+		bool found = !victim->tiles.empty();
+		if (found)
 		{
-			job = scene->jobs.front();
-			scene->jobs.pop();
+			tile = victim->tiles.back();
+			victim->tiles.pop_back();
 		}
-		DEBUGSTUFF qwe3 = {"gotjob", timeGetTime(), id};
-		//debugThreadStuff.push_back(qwe3);
-		scene->jobMutex.unlock();
-		DEBUGSTUFF qwe4 = {"unlock", timeGetTime(), id};
-		//debugThreadStuff.push_back(qwe4);
-		
-		//perform job
-		//printf("%u running\n", id);
-		if (hasJobs)
-			scene->performJob(job);
-		//printf("%u done\n", id);
+		victim->tileMutex.unlock();
+		if (found)
+			return true;
 	}
+	return false;
 }
 
-bool compareQWE(TraceScene::TraceThread::DEBUGSTUFF a, TraceScene::TraceThread::DEBUGSTUFF b)
+void TraceScene::TraceThread::run()
 {
-	return a.time < b.time;
+	int tile;
+	while (!requestStop && (popTile(tile) || stealTile(tile)))
+		scene->performTile(scene->tiles[tile], this);
+	scene->addStats(context.stats);
+	context.stats = TraceStats(); //threads are restarted for each progressive pass
 }
 
 void TraceScene::test()
@@ -2318,17 +5458,5 @@ void TraceScene::test()
 	cube.release();
 	
 	printf("Total Time for Test Render: %fms\n", timer.time());
-	
-	std::vector<TraceThread::DEBUGSTUFF> log;
-	for (size_t t = 0; t < threads.size(); ++t)
-	{
-		for (size_t v = 0; v < threads[t]->debugThreadStuff.size(); ++v)
-			log.push_back(threads[t]->debugThreadStuff[v]);
-	}
-	std::sort(log.begin(), log.end(), compareQWE);
-	for (std::vector<TraceThread::DEBUGSTUFF>::iterator it = log.begin(); it != log.end(); ++it)
-	{
-		printf("%i %i %s\n", it->time, it->id, it->doing.c_str());
-	}
 }
 
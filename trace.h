@@ -8,9 +8,21 @@
 //http://www.flipcode.com/archives/Raytracing_Topics_Techniques-Part_7_Kd-Trees_and_More_Speed.shtml
 //	^not-described-horribly
 
+#include <atomic>
+#include <deque>
+#include <iterator>
+#include <map>
+#include <stdint.h>
+
 #include "vec.h"
+#include "quaternion.h"
 #include "material.h"
 #include "thread.h"
+#include "random.h"
+#include "photonmap.h"
+#include "irradiancecache.h"
+#include "socket.h"
+#include "fileutil.h"
 
 //TODO: stop people from using windows libraries!
 #undef TRANSPARENT
@@ -32,8 +44,6 @@ namespace QI {
 	struct Image;
 };
 
-class RTree;
-
 class TraceScene : protected Thread
 {
 public:
@@ -41,24 +51,54 @@ public:
 		vec3f bmin;
 		vec3f bmax;
 	};
-	struct Node
+	struct KDBuildNode
 	{
 		uchar type; //x, y, z, leaf (0-3)
-		uint a, b; //if leaf, triangles[a->b], else left/right pointers
+		uint a, b; //if leaf, triangles[a->b] (blocks after buildBlocks), else left/right pointers
 		float split; //split plane along axis
 		//Bounds debug;
-		Node() : type(0), a(0), b(0), split(0.0f)
+		KDBuildNode() : type(0), a(0), b(0), split(0.0f)
 		{
 		}
 	};
+	struct Node
+	{
+		//packed KD tree node, written by layoutTree. the left child is always the next node
+		union {
+			float split; //split plane along axis
+			uint count; //if leaf, number of blocks
+		};
+		uint data; //type (x, y, z, leaf) in the low 2 bits, right child or first block above them
+		uint type() const {return data & 3;}
+		bool leaf() const {return (data & 3) == 3;}
+		uint offset() const {return data >> 2;}
+	};
+	struct BVHNode
+	{
+		Bounds bounds;
+		uint offset; //if leaf, first index in triangles, else the right child. left child is always the next node
+		ushort count; //number of triangles if leaf, zero if not
+		uchar axis; //split axis, for visiting the nearer child first
+	};
+	struct Prototype
+	{
+		//a mesh given to addInstance(), stored once in object space with its own BVH
+		std::vector<BVHNode> bvh;
+		std::vector<uint> triangles; //bvh leaf data. indexes prototypeTriangles
+		int first, count; //range in prototypeTriangles
+		Bounds bounds;
+	};
+	struct Instance
+	{
+		int prototype;
+		mat44 transform;
+		mat44 inverse; //takes rays into object space
+		mat44 normalMatrix;
+		bool mirrored; //negative determinant, so object space backfaces are front faces in the world. cullBackface culls in object space
+	};
 	struct Triangle {
-		//stores point a, edges u/v and normal n
+		//what intersection reads, one 64 byte cache line. stores point a, edges u/v and normal n
 		vec3f a, u, v, n;
-		int verts[3]; //per-vertex data
-		int material; //for faster lookup. don't want to search facesets.
-		
-		//for SAH kd tree construction
-		uchar side;
 		
 		//cached stuff for quick barycentric calcs
 		float d_uu;
@@ -66,6 +106,20 @@ public:
 		float d_uv;
 		float uvuuvv;
 	};
+	struct TriangleShading {
+		//what is only read once a triangle has been hit, kept apart so it doesn't share cache lines with Triangle
+		int verts[3]; //per-vertex data
+		int material; //for faster lookup. don't want to search facesets.
+	};
+	struct TriangleBlock {
+		//up to 4 triangles of a KD tree leaf, one per SIMD lane, so a ray tests them in one pass
+		float a[3][4]; //[x/y/z][lane]
+		float n[3][4]; //plane normal
+		float bs[3][4]; //barycentric s is (hit - a).bs
+		float bt[3][4]; //barycentric t is (hit - a).bt
+		uint triangle[4]; //indexes triangleData
+		int count; //used lanes. unused lanes have a zero normal and never hit
+	};
 	struct Vertex {
 		vec3f n;
 		vec2f t;
@@ -101,27 +155,104 @@ public:
 		float pos;
 		int axis;
 		int side;
+		bool operator<(const SAHSplit& other) const; //cheaper, or the one a single sweep would find first
+	};
+	struct KDLevel {
+		//left [0] and right [1] children of the node being split at this depth. shared by
+		//every node at the depth, so capacity is reused rather than reallocated
+		std::vector<SAHTriangle> T[2];
+		std::vector<SAHEvent> E[2];
+	};
+	struct KDBuild {
+		//output and scratch memory of one build task. subtrees built in parallel are spliced into tree/triangles
+		std::vector<KDBuildNode> tree;
+		std::vector<uint> triangles;
+		std::vector<uchar> side; //SAHTriangle::SplitSide for each triangle, used by doSplit
+		std::deque<KDLevel> levels; //deque so growing it keeps references to shallower levels
+		std::vector<SAHEvent> kept[2], straddle[2]; //doSplit's events for each side, before merging
+		std::vector<vec3f> debugTriangles;
+		int depth;
+		KDBuild() : depth(0) {}
+	};
+	struct SortThread : Thread {
+		std::vector<SAHEvent>* events;
+		size_t begin, mid, end; //sorts [begin, end), or merges [begin, mid) with [mid, end) if mid > begin
+		virtual void run();
+	};
+	struct SplitThread : Thread {
+		TraceScene* scene;
+		Bounds voxel;
+		const std::vector<SAHEvent>* events;
+		int totalTriangles;
+		int axis;
+		SAHSplit split;
+		virtual void run();
+	};
+	struct SubtreeThread : Thread {
+		TraceScene* scene;
+		KDBuild out;
+		std::vector<SAHTriangle> T;
+		std::vector<SAHEvent> E;
+		Bounds voxel;
+		int depth;
+		virtual void run();
 	};
 	struct TraceInterval {
 		uint node;
 		float start, end;
+		TraceInterval() {}
 		TraceInterval(uint n, float s, float e) : node(n), start(s), end(e) {}
 	};
 	struct TraceThreadJob {
 		int x, y;
+		int w, h; //block of pixels traced together, at most 2x2
+		int pass; //progressive pass, 0 for the first
 		mat44 view;
 		QI::Image* img;
 		Camera* cam;
 		vec3f get(float dx, float dy, float z);
 	};
-	struct TraceThread : Thread {
-		int id;
-		TraceScene* scene;
-		bool requestStop;
-		struct DEBUGSTUFF {std::string doing; unsigned int time; int id;};
-		std::vector<DEBUGSTUFF> debugThreadStuff;
-		TraceThread(TraceScene* owner) : scene(owner), requestStop(false) {}
-		virtual void run();
+	struct BakeTexel {
+		int triangle; //in triangleData, or -1 if no triangle covers the texel
+		float s, t; //barycentric coords of the texel centre
+	};
+	struct BVHBin {
+		Bounds bounds;
+		int count;
+	};
+	struct BuildStats {
+		float time; //milliseconds
+		int nodes;
+		int leaves;
+		int references; //triangle indices in leaves. more than the triangle count if split
+		int maxLeafSize;
+		int maxDepth;
+		int padding; //KD tree nodes inserted so small subtrees don't straddle cache lines
+	};
+	struct TraceStats {
+		uint64_t rays; //calls to trace a single ray, including shadow rays
+		uint64_t cameraRays; //primary rays, also counted in rays
+		uint64_t globalRays; //GI rays, also counted in rays
+		uint64_t photonRays; //photon paths, each bounce counted, also counted in rays
+		uint64_t nodes; //interior nodes visited
+		uint64_t leaves; //leaf nodes visited
+		uint64_t triangleTests;
+		uint64_t shadowRays; //occlusion queries, also counted in rays
+		uint64_t orderedShadowRays; //occlusion queries that hit only transmissive surfaces and were retraced in order
+		uint64_t packets; //camera ray packets traversed together
+		uint64_t divergentPackets; //packets that fell back to single rays
+		uint64_t waveRays; //secondary rays traced in sorted wavefront batches
+		uint64_t irradianceHits; //GI interpolated from the irradiance cache
+		uint64_t irradianceRecords; //irradiance cache records computed, each tracing the whole hemisphere
+		uint64_t queryRays; //segments from queryNearest() and queryAny(), also counted in rays
+		TraceStats() : rays(0), cameraRays(0), globalRays(0), photonRays(0), nodes(0), leaves(0), triangleTests(0), shadowRays(0), orderedShadowRays(0), packets(0), divergentPackets(0), waveRays(0), irradianceHits(0), irradianceRecords(0), queryRays(0) {}
+		void operator+=(const TraceStats& other);
+	};
+	struct TraceTile {
+		int x, y; //first pixel
+		int w, h; //size, clipped to the image
+		int passes; //progressive passes accumulated so far
+		float error; //progressive estimate of the largest pixel standard error, in display units
 	};
 	struct Light {
 		vec3f intensity;
@@ -141,9 +272,47 @@ public:
 		float time; //ratio along ray (for depth sorting)
 		Vertex interp; //interpolated vertex
 		Triangle* triangle;
+		int instance; //index in instances, or -1 if the triangle was baked by addMesh()
 		bool backface;
 	};
 	
+	struct RayQuery {
+		vec3f start, end; //a segment. surfaces are hit regardless of material
+	};
+	struct QueryHit {
+		float time; //fraction of the segment to the nearest hit, 1 if nothing was hit
+		float s, t; //barycentric coords
+		int triangle; //index in the triangles added by addMesh(), or in the instance's mesh. -1 if nothing was hit
+		int instance; //index in addInstance() order, or -1
+	};
+	
+	struct LastHit {
+		//a few triangles, stored inline so copying a ray never allocates. more than CAPACITY
+		//coincident surfaces at one point is unlikely, so the oldest are overwritten.
+		//instances share triangles, so a surface is the triangle and the instance it was hit in
+		enum {CAPACITY = 4};
+		const Triangle* triangles[CAPACITY];
+		int instances[CAPACITY];
+		int count; //total inserted since clear()
+		LastHit() : count(0) {}
+		void clear() {count = 0;}
+		bool empty() const {return count == 0;}
+		bool contains(const Triangle* t, int instance = -1) const
+		{
+			for (int i = 0; i < count && i < CAPACITY; ++i)
+				if (triangles[i] == t && instances[i] == instance)
+					return true;
+			return false;
+		}
+		void insert(const Triangle* t, int instance = -1)
+		{
+			if (!contains(t, instance))
+			{
+				triangles[count % CAPACITY] = t;
+				instances[count++ % CAPACITY] = instance;
+			}
+		}
+	};
 	struct Ray {
 		enum RayType {
 			SHADOW        = 1<<1,
@@ -168,7 +337,7 @@ public:
 		vec3f dir; //for convenience
 		Diff d[4]; //ray differentials
 		vec4f intensity;
-		std::set<Triangle*> lastHit; //triangle index
+		LastHit lastHit; //surfaces at the start of the ray, which it must not hit again
 		int depth;
 		int canary;
 		uchar mask; //RayType
@@ -211,7 +380,102 @@ public:
 		float transfer(const HitInfo& hitInfo, const vec3f& incidence); //returns distance to surface
 		void reflect(const HitInfo& hitInfo, const vec3f& incidence, const vec3f (&curve)[4]);
 		void refract(const HitInfo& hitInfo, const vec3f& incidence, const vec3f (&curve)[4], float eta);
-		void tangentDiff(const TraceScene::HitInfo& surface, const Vertex& a, const Vertex& b, const Vertex& c, vec3f (&curve)[4], vec2f (&area)[4]);
+		void tangentDiff(const TraceScene::HitInfo& surface, const Triangle& triangle, const Vertex& a, const Vertex& b, const Vertex& c, vec3f (&curve)[4], vec2f (&area)[4]);
+	};
+	typedef std::stack<Ray, std::vector<Ray> > TraceStack; //vector backed, so capacity is kept between uses
+	struct CameraRay {
+		Ray ray;
+		HitInfo hit; //first surface, found before shading so rays can be intersected in packets
+		bool found;
+		vec4f colour;
+		int pixel; //index within the job
+		int imagePixel; //index within the image, seeds the ray's random stream
+		int sample; //index within the pixel's random stream, unique across progressive passes
+		int sampleOffset;
+		bool debug;
+	};
+	struct WaveRay {
+		Ray ray;
+		int cameraRay; //index in TraceContext::cameraRays, whose colour the ray adds to
+		RandomStream random; //split from the parent's stream, so results don't depend on the sorted order
+	};
+	struct Photon
+	{
+		vec3f colour;
+		vec3f dir;
+		HitInfo hit;
+		float radius;
+	};
+	struct PhotonChunk {
+		int begin, end; //photon indices, in emission order
+		std::vector<vec3f> points;
+		std::vector<Photon> info;
+	};
+	struct TraceContext {
+		//per-thread state, so render threads don't share counters or scratch memory
+		TraceStats stats;
+		std::vector<CameraRay> cameraRays; //primary rays of the pixels in the current job
+		TraceStack rays; //secondary rays waiting to be traced. empty between camera rays
+		std::vector<WaveRay> wave; //secondary rays of the current job, traced in waveOrder
+		std::vector<WaveRay> nextWave; //rays spawned by wave
+		std::vector<std::pair<uint64_t, int> > waveOrder; //(direction octant and origin cell, index in wave)
+		std::vector<int> photonResults; //photon map query results
+		std::vector<vec3f> photonPoints; //photons stored by the current photon chunk
+		std::vector<Photon> photonInfo;
+		TraceStack irradianceRays; //rays of the irradiance cache record being computed
+		RandomStream random; //reseeded for each camera ray, so the numbers don't depend on which thread traces it
+	};
+	struct TraceThread : Thread {
+		int id;
+		TraceScene* scene;
+		std::atomic<bool> requestStop;
+		Mutex tileMutex; //taken once per tile by the owner or a thief, never per pixel
+		std::deque<int> tiles; //indexes TraceScene::tiles. owner pops the front, thieves take the back
+		TraceContext context;
+		TraceThread(TraceScene* owner) : scene(owner), requestStop(false) {}
+		bool popTile(int& tile);
+		bool stealTile(int& tile);
+		virtual void run();
+	};
+	struct PhotonThread : Thread {
+		TraceScene* scene;
+		std::vector<PhotonChunk>* chunks;
+		std::atomic<int>* nextChunk; //shared by all photon threads
+		TraceContext context;
+		virtual void run();
+	};
+	struct IrradianceThread : Thread {
+		TraceScene* scene;
+		std::vector<IrradianceCache::Record>* records; //one per pre-pass point
+		std::vector<char>* found; //whether the point's record was computed
+		std::atomic<int>* nextPoint; //shared by all pre-pass threads
+		TraceContext context;
+		virtual void run();
+	};
+	struct QueryThread : Thread {
+		TraceScene* scene;
+		const RayQuery* queries;
+		QueryHit* hits; //set for nearest hit queries
+		bool* occluded; //set for any hit queries
+		int count;
+		std::atomic<int>* nextChunk; //shared by all query threads
+		TraceContext context;
+		virtual void run();
+	};
+	struct BakeThread : Thread {
+		TraceScene* scene;
+		const std::vector<BakeTexel>* texels;
+		std::vector<vec4f>* results; //lighting and occlusion of each texel
+		int width;
+		std::atomic<int>* nextRow; //shared by all baking threads
+		TraceContext context;
+		virtual void run();
+	};
+	struct ToneMapThread : Thread {
+		TraceScene* scene;
+		QI::Image* image;
+		std::atomic<int>* nextRow; //shared by all tone mapping threads
+		virtual void run();
 	};
 	
 	struct DOF {
@@ -248,38 +512,171 @@ public:
 		std::vector<vec3f> normalOffsets;
 	} gloss;
 	
+	enum AccelType {
+		ACCEL_KDTREE, //event based SAH. splits triangles. slow to build, fast to trace
+		ACCEL_BVH, //binned SAH
+	};
+	
+	struct Stats {
+		AccelType accel;
+		BuildStats build;
+		TraceStats trace;
+	};
+	
+	enum TileOrder {
+		TILE_ORDER_MORTON,
+		TILE_ORDER_HILBERT,
+	};
+	
+	struct Tiling
+	{
+		int size; //width and height of the screen tiles handed to threads
+		TileOrder order; //space filling curve used to order tiles (and split them between threads)
+	} tiling;
+	
+	struct Progressive
+	{
+		bool enabled; //render repeated passes into a float buffer, retracing only the tiles that are still noisy
+		float threshold; //a tile is converged when no pixel's standard error is above this, in display units
+		int minPasses; //passes before the variance estimate is trusted
+		int maxPasses; //sample budget. 0 for no limit
+		float maxTime; //time budget in seconds, checked between passes. 0 for no limit
+		int passes; //passes completed by the last render
+	} progressive;
+	
+	struct Preview
+	{
+		bool enabled; //render() shows coarse passes first, one primary ray per pixel block lit by a headlight, halving the block size until full passes start
+		int levels; //coarse passes. the first traces one ray per 2^levels pixel square
+		float frameTime; //seconds. if non-zero, levels adapts after each render so the first coarse pass takes about this long
+	} preview; //for interactive camera moves. photons and sample patterns are kept between renders while their settings are unchanged
+	
+	struct Distributed
+	{
+		std::string address; //"unix:<path>" or "<host>:<port>". if set, render() listens here and hands tiles to worker processes instead of tracing them
+		int tilesPerThread; //tiles in each batch sent to a worker, times its thread count. more hides latency, fewer balances better
+		float timeout; //seconds a worker may take over a batch before it's dropped and its tiles re-issued. 0 for no limit
+	} distributed; //workers call serve() with the same scene, settings and address. one full pass is rendered, without preview or progressive passes
+	
+	struct LightSampling
+	{
+		int minLights; //with more lights than this, shading points pick lights from a tree by estimated contribution instead of visiting every light
+		int samples; //shadow rays per shading point when picking from the tree
+	} lightSampling;
+	
+	struct Wavefront
+	{
+		bool enabled; //trace a tile's secondary rays in batches sorted by direction and origin, rather than depth first from each hit
+		int maxRays; //rays queued per batch. past this, spawned rays are traced depth first
+	} wavefront;
+	
+	struct IrradianceCaching
+	{
+		bool enabled; //camera hits interpolate GI from cached records, computing a new one only where none are close enough
+		float accuracy; //records are used up to accuracy times their harmonic mean surface distance away. smaller is slower and more accurate
+		float minRadius; //clamps on that distance, in world units
+		float maxRadius;
+		int prepass; //pixel spacing of a pass that fills the cache before rendering, 0 for none. records added while rendering depend on thread timing
+	} irradiance;
+	
+	struct Framebuffer
+	{
+		int width, height;
+		int passes; //passes rendered into the buffer. a resumed render continues the sample sequence from here
+		std::vector<vec4f> colour; //per pixel sum of camera samples, linear and unclamped
+		std::vector<float> luminance; //per pixel sum of (clamped) sample luminance, for the progressive variance
+		std::vector<float> luminanceSq; //and of its square
+		std::vector<int> samples; //camera samples summed into each pixel
+		Framebuffer() : width(0), height(0), passes(0) {}
+		void resize(int w, int h); //and clears
+		void clear();
+		bool add(const Framebuffer& other); //merges a render of the same view made separately, with a different frame. false if the sizes differ
+		bool save(const std::string& filename) const;
+		bool load(const std::string& filename);
+	} framebuffer; //written by render(), then tone mapped into its image
+	
+	enum ToneOperator {
+		TONE_CLAMP, //linear, saturating at 1
+		TONE_REINHARD, //x/(1+x), compressing highlights
+	};
+	
+	struct ToneMapping
+	{
+		ToneOperator op;
+		float exposure; //scales the mean colour before the operator
+		float gamma; //applied after the operator. 1 keeps values linear
+	} toneMapping;
+	
+	bool resume; //render() adds to framebuffer instead of clearing it, if it matches the image size
+	
+	struct Baking
+	{
+		int occlusionSamples; //hemisphere rays per texel for ambient occlusion
+		float occlusionDistance; //occluders further than this don't darken a texel
+		int padding; //texels each chart is grown by, so filtering at chart edges doesn't pick up unbaked texels
+	} baking;
+	
+	AccelType accel; //acceleration structure created by build(). a KD tree too big to lay out falls back to ACCEL_BVH
 	float traversalCost;
 	float intersectCost;
+	int buildThreads; //threads used by build(). the KD tree is identical for any count
+	bool packetTracing; //intersect coherent camera rays with the KD tree in SIMD packets of 4, where supported
+	int frame; //seeds all random sampling. the same frame renders identically for any thread count
+	std::string buildCache; //directory where build() saves KD trees and maps them back in when the triangles match. empty to always build
 	bool cullBackface;
 	vec4f background;
 	Material* defaultMaterial;
 private:
 
-	struct Photon
-	{
-		vec3f colour;
-		vec3f dir;
-		HitInfo hit;
-		float radius;
-	};
-	
-	typedef std::stack<Ray> TraceStack;
-
 	bool shootPhotons;
-	int totalJobs;
 	int treeDepth;
-	Mutex jobMutex;
-	Bounds sceneBounds;
+	int totalPixels;
+	std::atomic<int> pixelsComplete; //written by render threads as tiles finish
 	std::vector<Photon> photonInfo;
+	std::vector<Quat> photonRotations; //random rotation of photons.emitSphere for each time it's used
+	int photonCount; //photons emitted by the last tracePhotons(), a multiple of the light samples
+	uint64_t sampled; //samplingKey() of the last initSampling(). 0 after build()
 	std::vector<vec2f> samplesDisc; //using this for dof
 	std::vector<TraceThread*> threads;
-	std::queue<TraceThreadJob> jobs;
+	std::vector<TraceTile> tiles; //in curve order
+	IrradianceCache irradianceCache; //cleared each render. filled by the pre-pass and then lazily by render threads
+	struct RemoteWorker {
+		Socket socket;
+		int threads;
+		int render; //renderId the camera was last sent for
+		std::vector<int> batch; //tiles sent and not yet returned
+		float sentAt; //seconds into the render when the batch was sent, or the connection accepted
+	};
+	Socket listener; //for workers, while distributed.address is set
+	std::string listening; //address listener is bound to
+	std::vector<RemoteWorker*> workers; //kept between renders
+	std::vector<RemoteWorker*> connecting; //accepted, but their RemoteHello hasn't arrived yet
+	int renderId; //distributed renders started. late results from an earlier one are dropped
 	std::vector<Material*> materials;
 	std::vector<Triangle> triangleData; //precomputed triangle info
+	std::vector<TriangleShading> triangleShading; //indexed like triangleData
 	std::vector<Vertex> vertexData; //standard vertex attributes for interpolation
 	std::vector<uint> triangles; //leaf data. indexes triangleData
-	std::vector<Node> tree; //list of KD-Tree nodes, leaves point to triangle ranges
-	std::vector<Bounds> triangleBounds; //bounds of each triangle within mesh
+	std::vector<Node> treeMemory;
+	const Node* tree; //KD tree nodes, cache line aligned within treeMemory or buildCacheFile. leaves point to block ranges
+	uint treeNodes;
+	std::vector<TriangleBlock> blocks; //KD tree leaf data, copied from triangleData in leaf order
+	const TriangleBlock* blockData; //blocks, or the same data in buildCacheFile
+	MappedFile buildCacheFile; //a KD tree loaded from buildCache, kept mapped while in use
+	std::vector<BVHNode> bvh; //depth first BVH nodes, leaves point to triangle ranges
+	BuildStats buildStats;
+	TraceStats traceStats; //accumulated from finished render threads
+	Mutex statsMutex;
+	std::map<VBOMesh*, int> prototypeIndex; //meshes already given to addInstance()
+	std::map<VBOMesh*, int> meshTriangles; //first triangle of the first addMesh() of each mesh, for bake()
+	std::vector<vec3f> samplesOcclusion; //hemisphere for baking ambient occlusion
+	std::vector<Prototype> prototypes;
+	std::vector<Triangle> prototypeTriangles; //object space triangles shared by every instance of a mesh
+	std::vector<TriangleShading> prototypeShading; //indexed like prototypeTriangles
+	std::vector<Instance> instances;
+	std::vector<Bounds> instanceBounds; //world space bounds of each instance
+	std::vector<BVHNode> instanceBVH; //top level BVH over instanceBounds, built with the scene's structure
+	std::vector<uint> instanceIndices; //instanceBVH leaf data. indexes instances
 	std::vector<vec3f> debugTriangles;
 	std::vector<vec3f> debugTriangles2;
 	std::vector<vec3f> debugTriangles3;
@@ -291,27 +688,101 @@ private:
 	inline Vertex interpolateVertex(int a, int b, int c, float s, float t);
 	int intersectTriSquare(int axis, float pos, const vec2f& bmin, const vec2f& bmax, const vec3f& a, const vec3f& b, const vec3f& c);
 	inline bool intersectRayTriangle(const Ray& ray, const Triangle& triangle, HitInfo& hit);
+	int intersectBlock(const TriangleBlock& block, const Ray& ray, float tmin, float tmax, float (&time)[4], float (&s)[4], float (&t)[4], int& backface); //returns a mask of lanes hit within (tmin, tmax]
 	Bounds intersectVoxel(const Bounds& a, const Bounds& b); //voxels are assumed to be overlapping
 	void clipTriangleBounds(SAHTriangle t, SAHSplit split, Bounds& left, Bounds& right);
 	float SA(Bounds voxel);
 	float SAH(float Pl, float Pr, int Nl, int Nr);
 	void SAH(Bounds v, SAHSplit& split, int Nl, int Nr, int Np);
 	void addEvents(std::vector<SAHEvent>& E, const SAHTriangle& t);
-	void findSplit(Bounds voxel, std::vector<SAHEvent>& events, int totalTriangles, SAHSplit& bestSplit);
-	void doSplit(SAHSplit split, const std::vector<SAHTriangle>& T, const std::vector<SAHEvent>& E, std::vector<SAHTriangle>& Tl, std::vector<SAHEvent>& El, std::vector<SAHTriangle>& Tr, std::vector<SAHEvent>& Er);
-	int rbuild(int depth, std::vector<SAHTriangle>& T, std::vector<SAHEvent>& E, Bounds voxel);
+	void findSplit(Bounds voxel, const std::vector<SAHEvent>& events, int totalTriangles, SAHSplit& bestSplit, int axis = -1); //axis -1 sweeps all axes
+	void findSplitParallel(Bounds voxel, const std::vector<SAHEvent>& events, int totalTriangles, SAHSplit& bestSplit);
+	void doSplit(KDBuild& out, SAHSplit split, const std::vector<SAHTriangle>& T, const std::vector<SAHEvent>& E, KDLevel& children);
+	int rbuild(KDBuild& out, int depth, std::vector<SAHTriangle>& T, std::vector<SAHEvent>& E, Bounds voxel);
+	void splice(KDBuild& out, KDBuild& subtree);
+	void sortEvents(std::vector<SAHEvent>& events);
+	bool buildKDTree(); //false if the tree is too big to lay out
+	void buildBlocks(std::vector<KDBuildNode>& nodes);
+	bool layoutTree(const std::vector<KDBuildNode>& nodes);
+	uint layoutSubtree(const std::vector<KDBuildNode>& nodes, const std::vector<uint>& sizes, uint node, std::vector<Node>& out);
+	int rbuildBVH(std::vector<BVHNode>& nodes, std::vector<uint>& indices, const std::vector<Bounds>& bounds, const std::vector<vec3f>& centroids, int depth, int begin, int end);
+	uint64_t buildKey(); //hash of everything the KD tree depends on
+	bool loadKDTree(const std::string& filename, uint64_t key);
+	void saveKDTree(const std::string& filename, uint64_t key);
+	void buildBVH(std::vector<BVHNode>& nodes, std::vector<uint>& indices, const std::vector<Bounds>& bounds, const std::vector<vec3f>& centroids, int begin, int end); //over bounds[begin, end)
+	void buildInstances();
+	void buildLights();
+	bool addTriangles(VBOMesh* mesh, const mat44& transform, std::vector<Triangle>& out, std::vector<TriangleShading>& outShading); //appends to vertexData and materials too
+	inline const TriangleShading& shading(const HitInfo& hit) const; //cold data of the hit triangle
+	void surfaceTriangle(const HitInfo& hit, Triangle& triangle, Vertex (&verts)[3]); //world space copies of the hit triangle and its vertices
+	void interpolateHit(HitInfo& hit); //fills hit.interp
+	void addStats(const TraceStats& stats);
 	
 	enum TraceFlags {
 		TRACE_CAMERA  = 1 << 0,
 		TRACE_SHADOW  = 1 << 1,
 		TRACE_PHOTON = 1 << 2,
 		TRACE_DEBUG   = 1 << 3,
+		TRACE_PREVIEW = 1 << 4, //with TRACE_CAMERA. no shadows, photons or GI
 	};
 	
-	bool hitSurface(vec4f& colour, Ray& ray, HitInfo& hitInfo, TraceStack& rays, int sampleOffset, int traceFlags); //return true to stop tracing along the current ray
-	bool trace(vec4f& colour, Ray& ray, HitInfo& hitInfo, TraceStack& rays, int sampleOffset, int traceFlags); //returns true if one or more surfaces were hit
-	bool trace(vec4f& colour, TraceStack& rays, int sampleOffset, int traceFlags); //trace until TraceStack is empty
-	void performJob(TraceThreadJob& job);
+	enum HitSearch {
+		HIT_NEAREST = 0,
+		HIT_ANY_OPAQUE, //the first opaque hit found in any order, otherwise a transmissive hit if there was one
+		HIT_ANY, //the first hit found, whatever its material
+	};
+	
+	//nearest hit along the ray that is further than "after" (ties broken by triangle), or any hit if "after" is NULL.
+	//any selects an occlusion search instead
+	bool intersectKDTree(TraceContext& context, const Ray& ray, HitInfo& hit, const HitInfo* after, HitSearch any);
+	bool intersectBVH(TraceContext& context, const Ray& ray, HitInfo& hit, const HitInfo* after, HitSearch any, bool found,
+		const std::vector<BVHNode>& nodes, const std::vector<uint>& indices, std::vector<Triangle>& tris, const std::vector<TriangleShading>& shading, int instance); //found: hit already holds one to beat
+	bool intersectInstances(TraceContext& context, const Ray& ray, HitInfo& hit, const HitInfo* after, HitSearch any, bool found);
+	bool intersect(TraceContext& context, const Ray& ray, HitInfo& hit, const HitInfo* after);
+	bool intersectAny(TraceContext& context, const Ray& ray, HitInfo& hit, HitSearch any = HIT_ANY_OPAQUE); //occlusion query for shadow rays
+	bool intersectPacket(TraceContext& context, CameraRay* packet, int count); //first hits of up to 4 rays. false if the rays diverge
+	
+	int pickLight(TraceContext& context, const vec3f& pos, const vec3f& normal, float& pdf); //a light chosen by its importance at pos, or -1 if none can light it
+	void addLightSample(TraceContext& context, const Ray& from, Ray& shadowRay, TraceStack& rays, int sampleOffset, bool debugTrace,
+		int light, vec2f offset, const vec3f& normal, const vec3f& specularReflectionDir, float shininess, float weight, vec3f& lightIntensity, vec3f& specularIntensity); //one shadow ray, added with weight
+	void computeIrradiance(TraceContext& context, const Ray& from, const vec3f& normal, int sampleOffset, IrradianceCache::Record& record); //traces the full hemisphere at from.start
+	bool irradiancePoint(TraceContext& context, int point, IrradianceCache::Record& record); //pre-pass record at the first GI surface under a grid pixel. false if there's none
+	void fillIrradianceCache(int nthreads);
+	void gatherPhotons(TraceContext& context, const vec3f& at, const vec3f& normal, vec3f& lightIntensity); //adds the photons that cover at
+	void sampleLights(TraceContext& context, const Ray& from, const vec3f& normal, const vec3f& specularReflectionDir, float shininess, bool nonPrimary,
+		TraceStack& rays, int sampleOffset, bool debugTrace, vec3f& lightIntensity, vec3f& specularIntensity); //shadow rays from from.start to every light, or to lights picked from the light tree
+	bool hitSurface(TraceContext& context, vec4f& colour, Ray& ray, HitInfo& hitInfo, TraceStack& rays, int sampleOffset, int traceFlags); //return true to stop tracing along the current ray
+	bool shade(TraceContext& context, vec4f& colour, Ray& ray, HitInfo& hitInfo, TraceStack& rays, int sampleOffset, int traceFlags); //hitSurface from hitInfo onwards, until a surface stops the ray
+	bool trace(TraceContext& context, vec4f& colour, Ray& ray, HitInfo& hitInfo, TraceStack& rays, int sampleOffset, int traceFlags); //returns true if one or more surfaces were hit
+	bool trace(TraceContext& context, vec4f& colour, TraceStack& rays, int sampleOffset, int traceFlags); //trace until TraceStack is empty
+	void traceCameraRay(TraceContext& context, vec3f start, vec3f end, Ray::Diff dx, Ray::Diff dy, vec4f& colour, int sampleOffset, bool debugTrace);
+	void addCameraRays(TraceThreadJob& job, TraceContext& context, int pixel);
+	void traceCameraRays(TraceContext& context);
+	void traceSpawned(TraceContext& context, vec4f& colour, Ray& ray, TraceStack& rays, int sampleOffset, int traceFlags); //one ray taken from a TraceStack. rays it spawns are pushed back
+	void queueSpawned(TraceContext& context, int cameraRay); //moves context.rays into context.nextWave
+	void traceWaves(TraceContext& context); //until no queued rays are left
+	void emitPhoton(int photon, Ray& ray);
+	void tracePhotonChunk(TraceContext& context, PhotonChunk& chunk);
+	void queryRange(TraceContext& context, const RayQuery* queries, QueryHit* hits, bool* occluded, int begin, int end);
+	void runQueries(const RayQuery* queries, QueryHit* hits, bool* occluded, int count, int nthreads);
+	uint64_t samplingKey(); //hash of everything initSampling() depends on, apart from the scene
+	uint64_t lightsKey(); //hash of the lights, which the light tree is rebuilt for when it changes
+	void initSampling(int nthreads); //sample patterns and photons, before rendering or baking
+	vec4f bakeTexel(TraceContext& context, const BakeTexel& texel, int index); //diffuse lighting and occlusion at a texel's surface point
+	void performJob(TraceThreadJob& job, TraceContext& context);
+	void performPreview(TraceThreadJob& job, TraceContext& context); //one ray at the job's centre, filling all of its pixels
+	void performTile(TraceTile& tile, TraceThread* thread);
+	void createTiles(int width, int height);
+	void startPass(const std::vector<int>& active); //hands tiles to the threads and starts them. threadMutex must be held
+	void toneMapColour(const vec4f& colour, unsigned char* out, int channels); //linear colour to 8 bits
+	void toneMapPixel(int pixel, unsigned char* out, int channels); //framebuffer mean to 8 bits
+	float tileError(const TraceTile& tile);
+	uint64_t remoteKey(); //buildKey() plus the materials, lights, instances and settings a worker's pixels depend on
+	void acceptWorker(float now);
+	void greetWorker(int index); //reads the hello of connecting[index], which becomes a worker if it matches
+	void dropWorker(int worker, std::deque<int>& pending); //closes the connection and re-queues its tiles
+	bool receiveResult(RemoteWorker* worker); //false if the connection failed
+	void distribute(); //run() as coordinator. hands tiles out to workers until all are back or the render is cancelled
 	
 	//no copying!
 	TraceScene(const Thread& other) {}
@@ -322,9 +793,14 @@ protected:
 	{
 		QI::Image* image;
 		Camera* camera;
+		mat44 view; //inverse projection*view, for generating camera rays
 		int nthreads;
 		bool initialized; //main render thread initialized
-		bool initializingThreads; //after photon tracing, the main render threads start, turning this off
+		bool cancelled; //stops progressive passes. locked by threadMutex
+		int pass; //progressive pass the threads are working on
+		std::atomic<int> previewBlock; //pixel block size of the coarse pass the threads are working on, 1 for full passes
+		std::atomic<bool> finished; //progressive passes have stopped
+		std::atomic<bool> initializingThreads; //after photon tracing, the main render threads start, turning this off
 		Condvar initBarrier; //to notify parent thread initialized is true and the threadMutex has been entered
 		Mutex initMutex; //locks the initialized boolean
 		Mutex threadMutex; //for starting, stopping and waiting child threads
@@ -334,7 +810,7 @@ protected:
 public:
 
 	//FIXME: make private
-	RTree* photonTree;
+	PhotonMap photonMap; //indexes photonPoints
 	
 	float shadowScale; //deprecated: not physically based but need it for paper
 	
@@ -343,23 +819,38 @@ public:
 	std::vector<vec3f> debugPoints;
 	std::vector<Ray> debugRays;
 	std::vector<Light> lights;
+	std::vector<Bounds> lightBounds; //area covered by each light's samples
+	std::vector<BVHNode> lightBVH; //over lightBounds, built with the scene's structure
+	std::vector<uint> lightIndices; //lightBVH leaf data. indexes lights
+	std::vector<float> lightPower; //summed lightPowerOf() below each lightBVH node
+	uint64_t lightsBuilt; //lightsKey() when the light tree was last built
+	static float lightPowerOf(const Light& light) {return light.intensity.x + light.intensity.y + light.intensity.z;}
 	std::vector<vec3f> photonPoints;
 	VBOMesh* debugMesh; //draws split planes
 	VBOMesh* debugMeshTrace; //draws trace triangles
 	VBOMesh* debugMeshTrace2; //draws trace triangles
 	VBOMesh* debugMeshTrace3; //draws trace triangles
-	void addLight(mat44 transform, vec3f intensity, int samples = 1, float radius = 0.0f, bool square = false);
+	void addLight(mat44 transform, vec3f intensity, int samples = 1, float radius = 0.0f, bool square = false); //the light tree is rebuilt by the next render if lights change after build()
 	void addMesh(VBOMesh* mesh, mat44 transform = mat44::identity());
-	void build();
+	void addInstance(VBOMesh* mesh, mat44 transform = mat44::identity()); //like addMesh(), but a mesh added many times is only stored once
+	void build(); //builds the structure selected by accel
+	Stats getStats(); //trace stats cover finished renders and traceCameraRay() calls
+	void resetStats();
 	//bool traceFirstHit(vec3f start, vec3f end, HitInfo& hitInfo); //single segment first-intersection test
 	
 	void traceCameraRay(vec3f start, vec3f end, vec4f& colour, int sampleOffset = 0, bool debugTrace = false); //the expensive, recursive one
 	void traceCameraRay(vec3f start, vec3f end, Ray::Diff dx, Ray::Diff dy, vec4f& colour, int sampleOffset = 0, bool debugTrace = false);
-	void tracePhotons();
+	void tracePhotons(int nthreads = 1); //emits photons over nthreads threads. the photon map doesn't depend on the count
+	void queryNearest(const RayQuery* queries, QueryHit* hits, int count, int nthreads = 1); //first surface along each segment, without shading. after build()
+	void queryAny(const RayQuery* queries, bool* occluded, int count, int nthreads = 1); //whether each segment hits anything, stopping at the first surface found
+	bool bake(VBOMesh* mesh, QI::Image* lightmap, QI::Image* occlusion, int nthreads = 1); //after build(). rasterises the texcoords of mesh's first addMesh() into the images, which must be the same size. either may be NULL
 	void cancel(); //stops threads. blocks!
 	void wait(); //waits until render finishes
 	void render(QI::Image* image, Camera* camera, int nthreads);
+	bool serve(int nthreads); //renders tiles for the coordinator at distributed.address until it disconnects. after build(). false if it can't be reached
+	void toneMap(QI::Image* image, int nthreads = 1); //quantises framebuffer into image, e.g. after changing toneMapping or adding buffers. image must match its size
 	float getProgress();
+	int getPreviewBlock() {return renderInfo.previewBlock;} //block size the image is being refined at, 1 once full resolution passes have started
 	void test();
 };
 
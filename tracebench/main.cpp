@@ -0,0 +1,296 @@
+/* Copyright 2011 Pyarelal Knowles, under GNU LGPL (see LICENCE.txt) */
+
+//headless TraceScene benchmark. loads models through the VBOMesh loaders into a fixed scene, renders it
+//from fixed views with fixed sampling and writes build/trace timings and statistics as JSON.
+//usage: tracebench [-r resolution] [-t threads] [-a kd|bvh] [-g gi samples] [-p photons] [-d sphere detail]
+//                  [-m models dir] [-o out.json] [-s] [-w] [-i] [-c address | -j address] [model files...]
+//-c renders through worker processes started with -j and the same address and options, e.g. -c unix:/tmp/tracebench
+
+#include "../prec.h"
+#include "../matrix.h"
+#include "../vbomesh.h"
+#include "../meshobj.h"
+#include "../mesh3ds.h"
+#include "../meshctm.h"
+#include "../meshifs.h"
+#include "../material.h"
+#include "../camera.h"
+#include "../img.h"
+#include "../imgpng.h"
+#include "../fileutil.h"
+#include "../util.h"
+#include "../trace.h"
+
+#include <thread>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+using namespace std;
+
+struct View
+{
+	const char* name;
+	vec3f from, to;
+};
+
+//fixed so results from different runs are comparable
+static const View views[] = {
+	{"front", vec3f(0.0f, 0.5f, 3.5f), vec3f(0.0f, -0.2f, -0.5f)},
+	{"high", vec3f(2.5f, 4.0f, 2.5f), vec3f(0.0f, -0.5f, -0.5f)},
+	{"glass", vec3f(-1.2f, 0.0f, 1.6f), vec3f(-1.2f, -0.2f, 0.0f)},
+};
+
+static size_t peakMemoryKB()
+{
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS counters;
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+		return 0;
+	return counters.PeakWorkingSetSize / 1024;
+#else
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0)
+		return 0;
+	return (size_t)usage.ru_maxrss; //kilobytes on linux
+#endif
+}
+
+static bool hasMeshExtension(const string& filename)
+{
+	string ext = fileExtension(filename);
+	return ext == "obj" || ext == "3ds" || ext == "ctm" || ext == "ifs";
+}
+
+static string jsonString(const string& str)
+{
+	string out = "\"";
+	for (int i = 0; i < (int)str.size(); ++i)
+	{
+		if (str[i] == '"' || str[i] == '\\')
+			out += '\\';
+		out += str[i];
+	}
+	return out + "\"";
+}
+
+static double mrays(uint64_t rays, float ms)
+{
+	return ms > 0.0f ? rays / (ms * 1000.0) : 0.0;
+}
+
+static void writeRays(FILE* out, const char* name, const TraceScene::TraceStats& stats, float ms)
+{
+	fprintf(out, "\t\t\t\"%s\": {\"total\": %.3f, \"camera\": %.3f, \"shadow\": %.3f, \"gi\": %.3f, \"photon\": %.3f}",
+		name, mrays(stats.rays, ms), mrays(stats.cameraRays, ms), mrays(stats.shadowRays, ms), mrays(stats.globalRays, ms), mrays(stats.photonRays, ms));
+}
+
+int main(int argc, char** argv)
+{
+	int resolution = 256;
+	int threads = mymax(1, (int)std::thread::hardware_concurrency());
+	int giSamples = 4;
+	int photons = 100000;
+	int detail = 4;
+	bool saveImages = false;
+	bool wavefront = false;
+	bool irradiance = false;
+	string coordinate; //address to hand tiles out on
+	string join; //address of a coordinator to work for
+	TraceScene::AccelType accel = TraceScene::ACCEL_KDTREE;
+	string modelDir = "../models/";
+	string outName;
+	vector<string> modelFiles;
+	for (int i = 1; i < argc; ++i)
+	{
+		string arg = argv[i];
+		bool hasValue = i + 1 < argc;
+		if (arg == "-r" && hasValue) resolution = mymax(1, atoi(argv[++i]));
+		else if (arg == "-t" && hasValue) threads = mymax(1, atoi(argv[++i]));
+		else if (arg == "-g" && hasValue) giSamples = mymax(0, atoi(argv[++i]));
+		else if (arg == "-p" && hasValue) photons = mymax(0, atoi(argv[++i]));
+		else if (arg == "-d" && hasValue) detail = mymax(1, atoi(argv[++i]));
+		else if (arg == "-a" && hasValue) accel = string(argv[++i]) == "bvh" ? TraceScene::ACCEL_BVH : TraceScene::ACCEL_KDTREE;
+		else if (arg == "-m" && hasValue) modelDir = argv[++i];
+		else if (arg == "-o" && hasValue) outName = argv[++i];
+		else if (arg == "-s") saveImages = true;
+		else if (arg == "-w") wavefront = true;
+		else if (arg == "-i") irradiance = true;
+		else if (arg == "-c" && hasValue) coordinate = argv[++i];
+		else if (arg == "-j" && hasValue) join = argv[++i];
+		else if (arg[0] == '-')
+		{
+			printf("Error: unknown option %s\n", arg.c_str());
+			return 1;
+		}
+		else
+			modelFiles.push_back(arg);
+	}
+
+	//without explicit files, every mesh in the models directory, sorted so the layout is stable
+	if (modelFiles.size() == 0)
+	{
+		vector<string> names = listDirectory(modelDir);
+		sort(names.begin(), names.end());
+		for (int i = 0; i < (int)names.size(); ++i)
+			if (hasMeshExtension(names[i]))
+				modelFiles.push_back(joinPath(modelDir, names[i]));
+	}
+
+	VBOMeshOBJ::registerLoader();
+	VBOMesh3DS::registerLoader();
+	VBOMeshCTM::registerLoader();
+	VBOMeshIFS::registerLoader();
+
+	TraceScene scene;
+	scene.accel = accel;
+	scene.buildThreads = threads;
+	scene.gi.samples = giSamples;
+	scene.gi.maxDepth = 1;
+	scene.photons.emit = photons;
+	scene.dof.samples = 1;
+	scene.wavefront.enabled = wavefront;
+	scene.irradiance.enabled = irradiance;
+	scene.distributed.address = coordinate;
+
+	//the TraceScene::test() room: a checkered box with a mirror sphere and a glass sphere, plus the models in a row behind
+	QI::Image checker;
+	checker.resize(8, 8);
+	checker.generateChecker(127);
+	checker.nearest = true;
+	checker.repeat = false;
+	Material* matRoom = new Material();
+	Material* matReflect = new Material();
+	Material* matRefract = new Material();
+	matRoom->imgColour = checker;
+	matReflect->reflect = vec3f(1.0f);
+	matRefract->reflect = vec3f(1.0f);
+	matRefract->transmit = vec3f(0.2f, 0.4f, 0.9f);
+	matRefract->density = 0.5f;
+	matRefract->index = 1.2f;
+
+	VBOMesh room = VBOMesh::cube();
+	VBOMesh mirror = VBOMesh::grid(vec2i(32, 16) * detail, VBOMesh::paramSphere);
+	VBOMesh glass = VBOMesh::grid(vec2i(32, 16) * detail, VBOMesh::paramSphere);
+	room.invertNormals();
+	room.transform(mat44::scale(-1));
+	mirror.triangulate();
+	glass.triangulate();
+	room.setMaterial(matRoom);
+	mirror.setMaterial(matReflect);
+	glass.setMaterial(matRefract);
+
+	int triangles = 0;
+	scene.addMesh(&room, mat44::translate(0, 3, 0) * mat44::scale(4));
+	scene.addMesh(&mirror, mat44::translate(1.2f, -0.2f, 0) * mat44::scale(0.8f));
+	scene.addMesh(&glass, mat44::translate(-1.2f, -0.2f, 0) * mat44::scale(0.8f));
+	triangles += (room.numIndices + mirror.numIndices + glass.numIndices) / 3;
+
+	vector<VBOMesh*> models;
+	vector<string> loaded;
+	for (int i = 0; i < (int)modelFiles.size(); ++i)
+	{
+		VBOMesh* mesh = new VBOMesh();
+		if (!mesh->load(modelFiles[i].c_str()))
+		{
+			printf("Error: could not load %s\n", modelFiles[i].c_str());
+			delete mesh;
+			continue;
+		}
+		mesh->normalize(true);
+		models.push_back(mesh);
+		loaded.push_back(modelFiles[i]);
+	}
+	for (int i = 0; i < (int)models.size(); ++i)
+	{
+		float x = (i - (models.size() - 1) * 0.5f) * 1.2f;
+		scene.addMesh(models[i], mat44::translate(x, -1.0f, -1.8f));
+		triangles += models[i]->numIndices / 3;
+	}
+
+	scene.addLight(mat44::translate(0, 5, 0), vec3f(1), 4, 0.2f, true);
+	scene.build();
+	TraceScene::BuildStats build = scene.getStats().build;
+	
+	//a worker renders whatever the coordinator sends until it's done
+	if (join.size())
+	{
+		scene.distributed.address = join;
+		bool served = scene.serve(threads);
+		for (int i = 0; i < (int)models.size(); ++i)
+			delete models[i];
+		return served ? 0 : 1;
+	}
+
+	vector<TraceScene::TraceStats> viewStats;
+	vector<float> viewTimes;
+	for (int v = 0; v < (int)(sizeof(views) / sizeof(views[0])); ++v)
+	{
+		Camera camera;
+		camera.setPerspective(pi*0.5f);
+		camera.zoomAt(views[v].from, views[v].to);
+		camera.regen();
+
+		QI::ImagePNG image;
+		image.resize(resolution, resolution);
+		scene.resetStats();
+		MyTimer timer;
+		timer.time();
+		scene.render(&image, &camera, threads);
+		while (scene.getProgress() < 1.0f)
+			mysleep(0.01f);
+		scene.wait();
+		viewTimes.push_back(timer.time());
+		viewStats.push_back(scene.getStats().trace);
+
+		if (saveImages)
+			image.saveImage((string("tracebench_") + views[v].name + ".png").c_str());
+		printf("%s: %.1fms, %.2f Mrays/s\n", views[v].name, viewTimes.back(), mrays(viewStats.back().rays, viewTimes.back()));
+	}
+
+	FILE* out = stdout;
+	if (outName.size() && !(out = fopen(outName.c_str(), "w")))
+	{
+		printf("Error: could not open %s\n", outName.c_str());
+		return 1;
+	}
+	fprintf(out, "{\n");
+	fprintf(out, "\t\"settings\": {\"resolution\": %i, \"threads\": %i, \"accel\": \"%s\", \"giSamples\": %i, \"photons\": %i, \"detail\": %i, \"wavefront\": %s, \"irradianceCache\": %s, \"distributed\": %s},\n",
+		resolution, threads, accel == TraceScene::ACCEL_BVH ? "bvh" : "kdtree", giSamples, photons, detail, wavefront ? "true" : "false", irradiance ? "true" : "false", jsonString(coordinate).c_str());
+	fprintf(out, "\t\"scene\": {\"triangles\": %i, \"models\": [", triangles);
+	for (int i = 0; i < (int)loaded.size(); ++i)
+		fprintf(out, "%s%s", i ? ", " : "", jsonString(loaded[i]).c_str());
+	fprintf(out, "]},\n");
+	fprintf(out, "\t\"build\": {\"ms\": %.3f, \"nodes\": %i, \"leaves\": %i, \"references\": %i, \"maxLeafSize\": %i, \"maxDepth\": %i, \"padding\": %i},\n",
+		build.time, build.nodes, build.leaves, build.references, build.maxLeafSize, build.maxDepth, build.padding);
+	fprintf(out, "\t\"views\": [\n");
+	for (int v = 0; v < (int)viewStats.size(); ++v)
+	{
+		const TraceScene::TraceStats& s = viewStats[v];
+		fprintf(out, "\t\t{\n");
+		fprintf(out, "\t\t\t\"name\": \"%s\",\n", views[v].name);
+		fprintf(out, "\t\t\t\"ms\": %.3f,\n", viewTimes[v]);
+		fprintf(out, "\t\t\t\"rays\": {\"total\": %llu, \"camera\": %llu, \"shadow\": %llu, \"gi\": %llu, \"photon\": %llu},\n",
+			(unsigned long long)s.rays, (unsigned long long)s.cameraRays, (unsigned long long)s.shadowRays, (unsigned long long)s.globalRays, (unsigned long long)s.photonRays);
+		writeRays(out, "mraysPerSecond", s, viewTimes[v]);
+		fprintf(out, ",\n");
+		fprintf(out, "\t\t\t\"traversal\": {\"nodes\": %llu, \"leaves\": %llu, \"triangleTests\": %llu, \"orderedShadowRays\": %llu, \"packets\": %llu, \"divergentPackets\": %llu, \"waveRays\": %llu},\n",
+			(unsigned long long)s.nodes, (unsigned long long)s.leaves, (unsigned long long)s.triangleTests, (unsigned long long)s.orderedShadowRays, (unsigned long long)s.packets, (unsigned long long)s.divergentPackets, (unsigned long long)s.waveRays);
+		fprintf(out, "\t\t\t\"irradiance\": {\"hits\": %llu, \"records\": %llu}\n",
+			(unsigned long long)s.irradianceHits, (unsigned long long)s.irradianceRecords);
+		fprintf(out, "\t\t}%s\n", v + 1 < (int)viewStats.size() ? "," : "");
+	}
+	fprintf(out, "\t],\n");
+	fprintf(out, "\t\"peakMemoryKB\": %llu\n", (unsigned long long)peakMemoryKB());
+	fprintf(out, "}\n");
+	if (out != stdout)
+		fclose(out);
+
+	for (int i = 0; i < (int)models.size(); ++i)
+		delete models[i];
+	return 0;
+}
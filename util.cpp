@@ -390,31 +390,55 @@ float gaussianKernal(int x, int n)
 
 vec2f randomOnCircle(float r)
 {
-	float a = UNIT_RAND * pi * 2.0f;
-	return vec2f(cos(a)*r, sin(a)*r);
+	RandomStream random(rand());
+	return randomOnCircle(random, r);
 }
 
 vec2f randomInCircle(float r)
 {
-	float rr = sqrt(UNIT_RAND) * r;
-	float a = UNIT_RAND * pi * 2.0f;
-	return vec2f(cos(a)*r, sin(a)*rr);
+	RandomStream random(rand());
+	return randomInCircle(random, r);
 }
 
 vec3f randomOnSphere(float r)
 {
-	float u = UNIT_RAND;
-	float v = UNIT_RAND;
+	RandomStream random(rand());
+	return randomOnSphere(random, r);
+}
+
+vec3f randomInSphere(float r)
+{
+	RandomStream random(rand());
+	return randomInSphere(random, r);
+}
+
+vec2f randomOnCircle(RandomStream& random, float r)
+{
+	float a = random.unit() * pi * 2.0f;
+	return vec2f(cos(a)*r, sin(a)*r);
+}
+
+vec2f randomInCircle(RandomStream& random, float r)
+{
+	float rr = sqrt(random.unit()) * r;
+	float a = random.unit() * pi * 2.0f;
+	return vec2f(cos(a)*r, sin(a)*rr);
+}
+
+vec3f randomOnSphere(RandomStream& random, float r)
+{
+	float u = random.unit();
+	float v = random.unit();
 	vec2f dir(acos(2.0*v - 1.0)-pi*0.5, 2.0*pi*u);
 	return dir.toVec() * r;
 }
 
-vec3f randomInSphere(float r)
+vec3f randomInSphere(RandomStream& random, float r)
 {
-	float u = UNIT_RAND;
-	float v = UNIT_RAND;
+	float u = random.unit();
+	float v = random.unit();
 	vec2f dir(acos(2.0*v - 1.0)-pi*0.5, 2.0*pi*u);
-	return dir.toVec() * sqrt(UNIT_RAND) * r;
+	return dir.toVec() * sqrt(random.unit()) * r;
 }
 
 void createTangents(const vec3f& normal, vec3f& u, vec3f& v)
@@ -430,21 +454,21 @@ void createTangents(const vec3f& normal, vec3f& u, vec3f& v)
 	u = v.cross(normal);
 }
 
-inline void poisson2D(std::vector<vec2f>& list, float rmin, float rdisc, bool square)
+inline void poisson2D(std::vector<vec2f>& list, float rmin, float rdisc, bool square, RandomStream& random)
 {
 	float cell = rmin / sqrt(2.0f);
 	int dim = (int)ceil(2.0f * rdisc / cell);
 	std::vector<int> grid(dim*dim, -1);
 	std::vector<vec2f> active;
 	
-	list.push_back(randomInCircle(rmin * 0.5f));
+	list.push_back(randomInCircle(random, rmin * 0.5f));
 	//list.push_back(vec2i(0.0f)); //always start with center
 	grid[(int)((list.back().y + rdisc) / cell) * dim + (int)((list.back().x + rdisc) / cell)] = (int)list.size() - 1;
 	active.push_back(list.back());
 	
 	while (active.size())
 	{
-		int r = rand() % active.size();
+		int r = random.range((int)active.size());
 		vec2f a = active[r];
 		active[r] = active.back();
 		
@@ -452,8 +476,8 @@ inline void poisson2D(std::vector<vec2f>& list, float rmin, float rdisc, bool sq
 		vec2f bestPos;
 		for (int i = 0; i < 32; ++i)
 		{
-			float dr = UNIT_RAND;
-			vec2f n = a + randomOnCircle(rmin * (1.0 + dr * dr));
+			float dr = random.unit();
+			vec2f n = a + randomOnCircle(random, rmin * (1.0 + dr * dr));
 			if (square)
 			{
 				if (mymax(myabs(n.x), myabs(n.y)) > rdisc - rmin * 0.5f)
@@ -509,7 +533,7 @@ bool compareVecSqiareDist(const vec2f& a, const vec2f& b)
 	return mymax(myabs(a.x), myabs(a.y)) < mymax(myabs(b.x), myabs(b.y));
 }
 
-inline void poisson2D(std::vector<vec2f>& list, int n, bool square)
+inline void poisson2D(std::vector<vec2f>& list, int n, bool square, RandomStream& random)
 {
 	list.clear();
 	
@@ -517,7 +541,7 @@ inline void poisson2D(std::vector<vec2f>& list, int n, bool square)
 		return;
 	
 	float rmin = 1.0f / sqrt((float)n);
-	poisson2D(list, rmin, 1.0f, square);
+	poisson2D(list, rmin, 1.0f, square, random);
 	
 	//keep only the inner n points
 	if (square)
@@ -538,16 +562,20 @@ inline void poisson2D(std::vector<vec2f>& list, int n, bool square)
 		list[i] /= m;
 }
 
-void poissonSquare(std::vector<vec2f>& list, float rmin, float width) {poisson2D(list, rmin, width * 0.5f, true);}
-void poissonSquare(std::vector<vec2f>& list, int n) {poisson2D(list, n, true);}
-void poissonDisc(std::vector<vec2f>& list, float rmin, float rdisc) {poisson2D(list, rmin, rdisc, false);}
-void poissonDisc(std::vector<vec2f>& list, int n) {poisson2D(list, n, false);}
+void poissonSquare(std::vector<vec2f>& list, float rmin, float width) {RandomStream random(rand()); poisson2D(list, rmin, width * 0.5f, true, random);}
+void poissonSquare(std::vector<vec2f>& list, int n) {RandomStream random(rand()); poisson2D(list, n, true, random);}
+void poissonDisc(std::vector<vec2f>& list, float rmin, float rdisc) {RandomStream random(rand()); poisson2D(list, rmin, rdisc, false, random);}
+void poissonDisc(std::vector<vec2f>& list, int n) {RandomStream random(rand()); poisson2D(list, n, false, random);}
+void poissonHemisphere(std::vector<vec3f>& list, int n) {RandomStream random(rand()); poissonHemisphere(list, n, random);}
+void poissonSphere(std::vector<vec3f>& list, int n) {RandomStream random(rand()); poissonSphere(list, n, random);}
+void poissonSquare(std::vector<vec2f>& list, int n, RandomStream& random) {poisson2D(list, n, true, random);}
+void poissonDisc(std::vector<vec2f>& list, int n, RandomStream& random) {poisson2D(list, n, false, random);}
 
-void poissonHemisphere(std::vector<vec3f>& list, int n)
+void poissonHemisphere(std::vector<vec3f>& list, int n, RandomStream& random)
 {
 	list.clear();
 	std::vector<vec2f> square;
-	poissonSquare(square, n);
+	poissonSquare(square, n, random);
 	for (int i = 0; i < (int)square.size(); ++i)
 	{
 		float a = pi * (square[i].x + 1.0f);
@@ -556,7 +584,7 @@ void poissonHemisphere(std::vector<vec3f>& list, int n)
 	}
 }
 
-void poissonSphere(std::vector<vec3f>& list, int n)
+void poissonSphere(std::vector<vec3f>& list, int n, RandomStream& random)
 {
 	const float totalArea = 4.0f * pi;
 	float pointArea = totalArea / n;
@@ -565,12 +593,12 @@ void poissonSphere(std::vector<vec3f>& list, int n)
 	float maxAngle = 2.0f * minAngle;
 	list.clear();
 	std::vector<vec3f> active;
-	list.push_back(randomOnSphere());
+	list.push_back(randomOnSphere(random));
 	active.push_back(list.back());
 	while (active.size())
 	{
 		//printf("%i\n", active.size());
-		int r = rand() % active.size();
+		int r = random.range((int)active.size());
 		vec3f a = active[r];
 		active[r] = active.back();
 		
@@ -578,9 +606,9 @@ void poissonSphere(std::vector<vec3f>& list, int n)
 		vec3f bestPos;
 		for (int i = 0; i < 32; ++i)
 		{
-			float randOffset = UNIT_RAND;
+			float randOffset = random.unit();
 			float angle = maxAngle * (1.0 + randOffset * randOffset);
-			vec3f rvec = Quat(angle, randomOnSphere()).unit() * a;
+			vec3f rvec = Quat(angle, randomOnSphere(random)).unit() * a;
 			
 			//ewwww
 			bool ok = true;
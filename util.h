@@ -16,6 +16,7 @@
 #endif
 
 #include "vec.h"
+#include "random.h"
 
 #define UNIT_RAND (rand()/(float)RAND_MAX)
 
@@ -54,10 +55,15 @@ float standardpdf(float x); //faster normalpdf(x, 1)
 float standardcdf(float x);
 float gaussianKernal(int x, int n);
 
+//versions without a RandomStream use rand(), which is neither thread safe nor reproducible
 vec2f randomOnCircle(float r = 1.0f);
 vec2f randomInCircle(float r = 1.0f);
 vec3f randomOnSphere(float r = 1.0f);
 vec3f randomInSphere(float r = 1.0f);
+vec2f randomOnCircle(RandomStream& random, float r = 1.0f);
+vec2f randomInCircle(RandomStream& random, float r = 1.0f);
+vec3f randomOnSphere(RandomStream& random, float r = 1.0f);
+vec3f randomInSphere(RandomStream& random, float r = 1.0f);
 
 void createTangents(const vec3f& normal, vec3f& u, vec3f& v); //generates arbitrary but orthonormal tangents for a given normalized direction
 
@@ -68,6 +74,10 @@ void poissonDisc(std::vector<vec2f>& list, float rmin, float rdisc);
 void poissonDisc(std::vector<vec2f>& list, int n);
 void poissonHemisphere(std::vector<vec3f>& list, int n); //WARNING: incorrect, but will do for now
 void poissonSphere(std::vector<vec3f>& list, int n); //WARNING: sloow. TODO: spatial data structure. not always n points
+void poissonSquare(std::vector<vec2f>& list, int n, RandomStream& random);
+void poissonDisc(std::vector<vec2f>& list, int n, RandomStream& random);
+void poissonHemisphere(std::vector<vec3f>& list, int n, RandomStream& random);
+void poissonSphere(std::vector<vec3f>& list, int n, RandomStream& random);
 
 void reflect(vec3f &out, const vec3f &incidentVec, const vec3f &normal);
 bool refract(vec3f &out, const vec3f &incidentVec, const vec3f &normal, float eta);